@@ -0,0 +1,167 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "addrlist.h"
+
+/* Adds [offset] to the 128-bit big-endian address [addr]. */
+static void _in6_add(struct in6_addr *addr, uint64_t offset)
+{
+  for (int i = 15; i >= 0 && offset > 0; i--) {
+    offset += addr->s6_addr[i];
+    addr->s6_addr[i] = offset & 0xff;
+    offset >>= 8;
+  }
+}
+
+/* Parses a single address or CIDR block into [range]. */
+static int _parse_range(struct addrlist_range *range, char *token)
+{
+  char *slash;
+  long prefix_len = -1;
+  char *endptr;
+  slash = strchr(token, '/');
+  if (slash != NULL) {
+    *slash = '\0';
+    prefix_len = strtol(slash + 1, &endptr, 10);
+    if (*endptr != '\0' || slash[1] == '\0' || prefix_len < 0)
+      return -1;
+  }
+  memset(range, 0, sizeof(*range));
+  if (inet_pton(AF_INET, token, &range->first.v4) == 1) {
+    uint32_t addr, mask;
+    range->family = AF_INET;
+    if (prefix_len == -1)
+      prefix_len = 32;
+    if (prefix_len > 32)
+      return -1;
+    mask = prefix_len == 0 ? 0 : ~((1ULL << (32 - prefix_len)) - 1);
+    addr = ntohl(range->first.v4.s_addr) & mask;
+    range->nb_addresses = 1ULL << (32 - prefix_len);
+    if (prefix_len < 31) {
+      /* Skip network and broadcast addresses */
+      addr++;
+      range->nb_addresses -= 2;
+    }
+    range->first.v4.s_addr = htonl(addr);
+  } else if (inet_pton(AF_INET6, token, &range->first.v6) == 1) {
+    range->family = AF_INET6;
+    if (prefix_len == -1)
+      prefix_len = 128;
+    if (prefix_len > 128)
+      return -1;
+    /* Clear host bits */
+    for (int bit = prefix_len; bit < 128; bit++)
+      range->first.v6.s6_addr[bit / 8] &= ~(0x80 >> (bit % 8));
+    if (128 - prefix_len >= 32)
+      range->nb_addresses = ADDRLIST_MAX_RANGE_SIZE;
+    else
+      range->nb_addresses = 1ULL << (128 - prefix_len);
+  } else {
+    return -1;
+  }
+  return 0;
+}
+
+int addrlist_parse(struct addrlist *list, const char *spec)
+{
+  char *copy, *token, *saveptr;
+  unsigned int max_ranges = 1;
+  list->ranges = NULL;
+  list->nb_ranges = 0;
+  list->nb_addresses = 0;
+  for (const char *c = spec; *c != '\0'; c++)
+    if (*c == ',')
+      max_ranges++;
+  list->ranges = calloc(max_ranges, sizeof(struct addrlist_range));
+  copy = strdup(spec);
+  for (token = strtok_r(copy, ",", &saveptr); token != NULL;
+       token = strtok_r(NULL, ",", &saveptr)) {
+    char *original = strdup(token);
+    if (_parse_range(&list->ranges[list->nb_ranges], token) != 0) {
+      fprintf(stderr, "Error: invalid address or CIDR block '%s'\n", original);
+      free(original);
+      free(copy);
+      addrlist_free(list);
+      return -1;
+    }
+    free(original);
+    list->nb_addresses += list->ranges[list->nb_ranges].nb_addresses;
+    list->nb_ranges++;
+  }
+  free(copy);
+  if (list->nb_addresses == 0) {
+    fprintf(stderr, "Error: empty address list '%s'\n", spec);
+    addrlist_free(list);
+    return -1;
+  }
+  return 0;
+}
+
+socklen_t addrlist_get(const struct addrlist *list, uint64_t index,
+		       uint16_t port, struct sockaddr_storage *addr)
+{
+  const struct addrlist_range *range = list->ranges;
+  index %= list->nb_addresses;
+  while (index >= range->nb_addresses) {
+    index -= range->nb_addresses;
+    range++;
+  }
+  memset(addr, 0, sizeof(*addr));
+  if (range->family == AF_INET) {
+    struct sockaddr_in *sin = (struct sockaddr_in*) addr;
+    sin->sin_family = AF_INET;
+    sin->sin_port = htons(port);
+    sin->sin_addr.s_addr = htonl(ntohl(range->first.v4.s_addr) + index);
+    return sizeof(struct sockaddr_in);
+  } else {
+    struct sockaddr_in6 *sin6 = (struct sockaddr_in6*) addr;
+    sin6->sin6_family = AF_INET6;
+    sin6->sin6_port = htons(port);
+    sin6->sin6_addr = range->first.v6;
+    _in6_add(&sin6->sin6_addr, index);
+    return sizeof(struct sockaddr_in6);
+  }
+}
+
+int addrlist_has_only_family(const struct addrlist *list, int family)
+{
+  for (unsigned int i = 0; i < list->nb_ranges; i++)
+    if (list->ranges[i].family != family)
+      return 0;
+  return 1;
+}
+
+void addrlist_free(struct addrlist *list)
+{
+  free(list->ranges);
+  list->ranges = NULL;
+  list->nb_ranges = 0;
+  list->nb_addresses = 0;
+}
+
+int addrlist_parse_port_range(const char *spec, uint16_t *first_port, uint16_t *last_port)
+{
+  char *endptr;
+  long first, last;
+  first = strtol(spec, &endptr, 10);
+  last = first;
+  if (*endptr == '-')
+    last = strtol(endptr + 1, &endptr, 10);
+  if (endptr == spec || *endptr != '\0' || first <= 0 || last > 65535 || first > last) {
+    fprintf(stderr, "Error: invalid port or port range '%s'\n", spec);
+    return -1;
+  }
+  *first_port = first;
+  *last_port = last;
+  return 0;
+}
+
+void addrlist_set_port(struct sockaddr_storage *addr, uint16_t port)
+{
+  if (addr->ss_family == AF_INET)
+    ((struct sockaddr_in*) addr)->sin_port = htons(port);
+  else
+    ((struct sockaddr_in6*) addr)->sin6_port = htons(port);
+}
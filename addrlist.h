@@ -0,0 +1,51 @@
+#include <stdint.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+/* Maximum number of addresses taken from a single CIDR block (larger
+   IPv6 prefixes are truncated). */
+#define ADDRLIST_MAX_RANGE_SIZE (1ULL << 32)
+
+/* A contiguous range of IPv4 or IPv6 addresses. */
+struct addrlist_range {
+  int family;
+  union {
+    struct in_addr v4;
+    struct in6_addr v6;
+  } first;
+  uint64_t nb_addresses;
+};
+
+/* A list of IP addresses, given as a comma-separated list of addresses
+   and CIDR blocks (e.g. "127.0.0.0/8,::1,fd00::/120").  Addresses are
+   stored as ranges, so that large blocks do not use any memory. */
+struct addrlist {
+  struct addrlist_range *ranges;
+  unsigned int nb_ranges;
+  uint64_t nb_addresses;
+};
+
+/* Parses [spec] into [list].  For IPv4 blocks larger than /31, the
+   network and broadcast addresses are skipped.  Returns 0 on success,
+   and -1 on error (after printing an error message). */
+int addrlist_parse(struct addrlist *list, const char *spec);
+
+/* Stores the [index]-th address of the list (modulo the number of
+   addresses) into [addr], with the given port, and returns the length of
+   the resulting socket address. */
+socklen_t addrlist_get(const struct addrlist *list, uint64_t index,
+		       uint16_t port, struct sockaddr_storage *addr);
+
+/* Returns 1 if all addresses of the list belong to the given address
+   family, 0 otherwise. */
+int addrlist_has_only_family(const struct addrlist *list, int family);
+
+void addrlist_free(struct addrlist *list);
+
+/* Parses a single port ("4242") or an inclusive port range
+   ("4242-4251").  Returns 0 on success, and -1 on error (after printing
+   an error message). */
+int addrlist_parse_port_range(const char *spec, uint16_t *first_port, uint16_t *last_port);
+
+/* Sets the port of an IPv4 or IPv6 socket address. */
+void addrlist_set_port(struct sockaddr_storage *addr, uint16_t port);
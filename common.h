@@ -1,10 +1,22 @@
+#include <stdatomic.h>
+#include <stddef.h>
+#include <event2/buffer.h>
+#include <event2/http.h>
+
 #include "poisson.h"
 #include "utils.h"
+#include "histogram.h"
+#include "rttlog.h"
+#include "querytable.h"
+#include "counters.h"
+
+/* Default timeout of a query (--timeout): queries without an answer
+   after this time are counted as lost, and later answers as late. */
+#define QUERY_TIMEOUT_MSEC_DEFAULT 5000
 
-/* Maximum expected response time for a query.  This is used to compute
-   how many queries in flight we should expect on each connection, and
-   thus how many timestamps to keep in memory. */
-#define MAX_RTT_MSEC 60000
+/* Minimum size of the outstanding-query table of a connection, to
+   absorb bursts on a single connection. */
+#define QUERY_TABLE_MIN_SIZE 8
 
 /* Average sending period of a single Poisson process (in milliseconds per
    query).  We will spawn as much iid Poisson processes as needed to
@@ -25,21 +37,82 @@
 /* How many commands we are prepared to accept on stdin. */
 #define MAX_STDIN_COMMANDS 256
 
+/* Rate controller: interval between two measurements of the achieved
+   query rate, and number of intervals in its sliding window. */
+#define RATE_CONTROL_INTERVAL_MSEC 100
+#define RATE_CONTROL_WINDOW 10
+
+/* Bounds of the correction applied by the rate controller to the rate of
+   the schedulers. */
+#define RATE_CORRECTION_MIN 0.5
+#define RATE_CORRECTION_MAX 2.
+
+/* Capacity search (--search): maximum number of doublings of the initial
+   rate, and maximum number of steps. */
+#define SEARCH_MAX_DOUBLINGS 10
+#define SEARCH_MAX_STEPS 30
+/* The search stops once the lowest failing rate is within this fraction
+   of the highest passing rate. */
+#define SEARCH_PRECISION 0.05
+/* A step also fails if the generator does not achieve this fraction of
+   its target rate (beyond Poisson noise): the server is then not the
+   bottleneck being measured. */
+#define SEARCH_MIN_ACHIEVED 0.95
+
+/* Prefix of the metrics of the text exposition (--stats-port) */
+#define STATS_METRIC_PREFIX "tcpscaler_"
+
 
 
-struct event_base *base;
+/* Event base of the current thread. */
+__thread struct event_base *base;
 static short verbose;
+/* Whether we log every query and answer, as CSV on stdout (-R) or in a
+   binary log (--rtt-log) */
 static short print_rtt;
+/* Binary log of queries and answers (--rtt-log), NULL for CSV output. */
+static struct rttlog *rtt_log;
 /* Whether we take commands from stdin (sequence of duration and query rate) */
 static short stdin_commands;
 /* Whether we take slope commands from stdin (sequence of duration and query rate slope) */
 static short stdin_rateslope_commands;
-/* Maximum number of queries "in flight" on a given UDP or TCP connection.
-   Computed from MAX_RTT, rate, and nb_conn. */
-static uint16_t max_queries_in_flight;
-/* Sending rate of each Poisson process. */
-static double poisson_rate = 1000. / (double) POISSON_PROCESS_PERIOD_MSEC;
-/* How many UDP or TCP connections we maintain. */
+/* Whether Poisson processes are scheduled against absolute intended times */
+static short use_absolute;
+/* Whether RTTs are recorded in in-memory histograms (--hist) */
+static short use_histogram;
+/* Interval between periodic latency summaries, in seconds (0 to only
+   print a summary at exit). */
+static unsigned int histogram_interval;
+/* RTT histograms (one per thread), merged when printing summaries. */
+static struct histogram **rtt_histograms;
+static unsigned int nb_rtt_histograms;
+/* Query timeout, in milliseconds. */
+static unsigned int query_timeout = QUERY_TIMEOUT_MSEC_DEFAULT;
+/* Number of slots of the outstanding-query table of each connection,
+   computed from the timeout, rate, and nb_conn. */
+static uint32_t query_table_size;
+/* Outstanding-query trackers (one per thread), merged when printing
+   counters. */
+static struct query_tracker **query_trackers;
+static unsigned int nb_query_trackers;
+/* Live statistics: interval between two lines on stderr, in
+   milliseconds (--stats, 0 for none), and local HTTP port of the text
+   exposition (--stats-port, 0 for none). */
+static unsigned int stats_interval;
+static uint16_t stats_port;
+static short use_stats;
+/* Schedule lag histograms (one per thread, as for query trackers), only
+   filled with live statistics. */
+static struct histogram **lag_histograms;
+/* Sending rate of each Poisson process of the current thread. */
+static __thread double poisson_rate = 1000. / (double) POISSON_PROCESS_PERIOD_MSEC;
+/* Fraction of the total query rate handled by the current thread.  Query
+   rates and slopes given as commands are scaled by this factor. */
+static __thread double rate_share = 1.;
+/* With the merged-stream scheduler (--merged), the single Poisson process
+   of the current thread, running at the aggregate rate.  NULL otherwise. */
+static __thread struct poisson_process *merged_process;
+/* How many UDP or TCP connections we maintain (in total). */
 static uint32_t nb_conn = 0;
 
 
@@ -54,7 +127,127 @@ struct rateslope_command {
   int query_rate_slope;
 };
 
+/* Closed-loop rate control: the schedulers of each thread run at the
+   target rate of the thread times a correction factor, which is adjusted
+   whenever the rate achieved over a sliding window deviates from the
+   target by more than Poisson noise explains. */
+struct rate_controller {
+  /* Target query rate of the current thread, in queries per second. */
+  double target;
+  double correction;
+  struct event *event;
+  /* Sliding window: queries sent by the thread, and time, at the last
+     RATE_CONTROL_WINDOW + 1 measurements (circular). */
+  unsigned long window_sent[RATE_CONTROL_WINDOW + 1];
+  struct timespec window_time[RATE_CONTROL_WINDOW + 1];
+  unsigned int nb_samples;
+  /* Current phase: index, whether it is running, and queries sent and
+     time when it started. */
+  unsigned int phase;
+  short phase_running;
+  unsigned long phase_sent;
+  struct timespec phase_start;
+  /* Rate of the capacity search step last applied by the thread. */
+  unsigned int search_rate;
+};
+static __thread struct rate_controller rate_controller;
+
+/* Phases of constant target rate (one per --stdin command, or the whole
+   run with a fixed rate and duration), merged across threads: the last
+   thread to finish a phase logs the rate achieved during that phase. */
+struct phase_stats {
+  /* Total target rate */
+  double target;
+  _Atomic unsigned long sent;
+  _Atomic unsigned int nb_done;
+};
+static struct phase_stats *phase_stats;
+static unsigned int nb_phases;
+static unsigned int nb_phase_threads = 1;
+
+/* Automatic capacity search (--search): the offered rate is doubled
+   until a step breaks the p99 latency SLO or the loss budget, and then
+   bisected between the highest passing rate and the lowest failing one.
+   Each step starts with a warm-up window, excluded from measurements.
+   The search is driven by a single thread, and the other threads follow
+   the rate of the current step from their rate controller. */
+struct capacity_search {
+  /* p99 SLO in microseconds (0 when not searching), maximum fraction of
+     unanswered queries, and durations of the warm-up and measurement
+     windows of each step, in seconds. */
+  unsigned long slo_us;
+  double max_loss;
+  unsigned int warmup;
+  unsigned int step_duration;
+  unsigned int start_rate;
+  /* Total rate of the current step, 0 once the search is over. */
+  _Atomic unsigned int rate;
+  /* Highest rate that passed and lowest rate that failed (0 if none). */
+  unsigned int passed;
+  unsigned int failed;
+  unsigned int nb_steps;
+  /* Whether the warm-up of the current step is over, and counters at
+     the end of the warm-up. */
+  short measuring;
+  struct histogram *snapshot;
+  unsigned long snapshot_sent;
+  struct timespec snapshot_time;
+  struct event *event;
+  /* Measurements at the highest passing rate: p99 with its 95%
+     confidence interval, number of samples, and unanswered fraction. */
+  uint64_t best_p99;
+  uint64_t best_p99_low;
+  uint64_t best_p99_high;
+  uint64_t best_samples;
+  double best_loss;
+};
+static struct capacity_search search = {
+  .max_loss = 0.001,
+  .warmup = 2,
+  .step_duration = 10,
+};
+
 static void add_poisson_sender();
+/* Returns the number of queries sent so far by the current thread. */
+static unsigned long thread_queries_sent();
+/* Returns the number of queries sent so far by all threads.  May be
+   called from any thread. */
+static unsigned long total_queries_sent();
+static void search_follow();
+
+/* Counters of a thread, for live statistics */
+struct thread_counters {
+  uint64_t sent;
+  uint64_t answers;
+  uint64_t bytes_sent;
+  uint64_t bytes_received;
+  uint64_t in_flight;
+  uint64_t lost;
+  uint64_t late;
+  uint64_t duplicate;
+  uint64_t mismatched;
+  uint64_t conn_up;
+  /* Connections that failed, or went down after being up */
+  uint64_t conn_down;
+};
+
+/* Reads the counters of thread [thread] that are specific to each
+   client (queries, answers, bytes and connections).  May be called from
+   any thread. */
+static void read_thread_counters(unsigned int thread, struct thread_counters *counters);
+
+/* Returns the size of outstanding-query tables, when sending at most
+   [max_rate] queries per second in total: room for all queries sent on
+   a connection during a timeout, with a safety factor of 4 for bursts,
+   rounded up to a power of two. */
+static uint32_t compute_query_table_size(double max_rate)
+{
+  double in_flight = 4 * (double) query_timeout * max_rate / (double) nb_conn / 1000.;
+  uint32_t size = QUERY_TABLE_MIN_SIZE;
+  while (size < in_flight && size < QUERY_TABLE_MAX_SIZE)
+    size *= 2;
+  return size;
+}
 
 int read_nb_commands(unsigned int *nb_commands)
 {
@@ -107,19 +300,153 @@ int read_rateslope_commands(struct rateslope_command *commands, unsigned int nb_
   return 0;
 }
 
+/* Applies the target rate of the current thread, with its correction,
+   to its schedulers.  The new rate takes effect immediately. */
+static void apply_query_rate()
+{
+  double rate = rate_controller.target * rate_controller.correction;
+  if (merged_process != NULL) {
+    /* Only one number to retune. */
+    poisson_set_rate(merged_process, rate);
+    return;
+  }
+  if (poisson_nb_processes() == 0)
+    return;
+  poisson_rate = rate / (double) poisson_nb_processes();
+  poisson_set_rate_all(poisson_rate);
+}
+
+/* Measures the rate achieved over the sliding window, and corrects the
+   rate of the schedulers if it is off. */
+static void rate_control_tick(evutil_socket_t fd, short events, void *ctx)
+{
+  struct rate_controller *rc = &rate_controller;
+  unsigned int last, first;
+  struct timespec elapsed;
+  double expected, sent;
+  if (search.slo_us > 0)
+    search_follow();
+  last = rc->nb_samples % (RATE_CONTROL_WINDOW + 1);
+  rc->window_sent[last] = thread_queries_sent();
+  clock_gettime(CLOCK_MONOTONIC, &rc->window_time[last]);
+  rc->nb_samples++;
+  if (rc->target <= 0 || rc->nb_samples <= RATE_CONTROL_WINDOW)
+    return;
+  first = rc->nb_samples % (RATE_CONTROL_WINDOW + 1);
+  subtract_timespec(&elapsed, &rc->window_time[last], &rc->window_time[first]);
+  expected = rc->target * (elapsed.tv_sec + elapsed.tv_nsec / 1000000000.);
+  sent = rc->window_sent[last] - rc->window_sent[first];
+  /* Only correct deviations beyond 3 standard deviations of the number
+     of events of a Poisson process. */
+  if (fabs(sent - expected) <= 3 * sqrt(expected))
+    return;
+  rc->correction *= sent > 0 ? expected / sent : RATE_CORRECTION_MAX;
+  if (rc->correction < RATE_CORRECTION_MIN)
+    rc->correction = RATE_CORRECTION_MIN;
+  if (rc->correction > RATE_CORRECTION_MAX)
+    rc->correction = RATE_CORRECTION_MAX;
+  debug("Sent %.0f queries instead of %.0f over the last %d ms, rate correction set to %.3f\n",
+	sent, expected, RATE_CONTROL_INTERVAL_MSEC * RATE_CONTROL_WINDOW, rc->correction);
+  apply_query_rate();
+  /* Start a new window at the new rate. */
+  rc->nb_samples = 0;
+}
+
+/* Starts the rate controller of the current thread, with the given
+   target rate (for this thread), once queries are being sent. */
+static void rate_controller_start(double target)
+{
+  struct timeval interval = {0, RATE_CONTROL_INTERVAL_MSEC * 1000};
+  rate_controller.target = target;
+  rate_controller.correction = 1.;
+  rate_controller.nb_samples = 0;
+  rate_controller.event = event_new(base, -1, EV_PERSIST, rate_control_tick, NULL);
+  event_add(rate_controller.event, &interval);
+}
+
+static void rate_controller_stop()
+{
+  if (rate_controller.event != NULL)
+    event_free(rate_controller.event);
+  rate_controller.event = NULL;
+}
+
+/* Sets up per-phase statistics, with one phase per command, or a single
+   phase at [query_rate] if [commands] is NULL.  [nb_threads] threads
+   send queries. */
+static void init_phases(const struct command *commands, unsigned int nb_commands,
+			unsigned int query_rate, unsigned int nb_threads)
+{
+  nb_phases = commands != NULL ? nb_commands : 1;
+  nb_phase_threads = nb_threads;
+  phase_stats = calloc(nb_phases, sizeof(struct phase_stats));
+  for (unsigned int i = 0; i < nb_phases; i++)
+    phase_stats[i].target = commands != NULL ? commands[i].query_rate : query_rate;
+}
+
+static void start_phase()
+{
+  rate_controller.phase_running = 1;
+  rate_controller.phase_sent = thread_queries_sent();
+  clock_gettime(CLOCK_MONOTONIC, &rate_controller.phase_start);
+}
+
+/* Ends the current phase of the current thread.  The last thread to end
+   it logs the target and achieved rates. */
+static void end_phase()
+{
+  struct rate_controller *rc = &rate_controller;
+  struct phase_stats *phase;
+  struct timespec now, elapsed;
+  unsigned long sent = thread_queries_sent();
+  double duration, achieved;
+  if (!rc->phase_running || rc->phase >= nb_phases)
+    return;
+  rc->phase_running = 0;
+  phase = &phase_stats[rc->phase];
+  atomic_fetch_add_explicit(&phase->sent, sent - rc->phase_sent, memory_order_relaxed);
+  if (atomic_fetch_add(&phase->nb_done, 1) == nb_phase_threads - 1) {
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    subtract_timespec(&elapsed, &now, &rc->phase_start);
+    duration = elapsed.tv_sec + elapsed.tv_nsec / 1000000000.;
+    achieved = duration > 0 ? atomic_load(&phase->sent) / duration : 0.;
+    fprintf(stderr, "Phase %u: target %.0f qps, achieved %.0f qps (%+.1f%%) over %.3f s\n",
+	    rc->phase, phase->target, achieved,
+	    phase->target > 0 ? 100. * (achieved - phase->target) / phase->target : 0., duration);
+  }
+  rc->phase++;
+}
+
+/* Called at the start of each --stdin command: ends the previous phase,
+   and applies the new rate right away. */
 static void change_query_rate(evutil_socket_t fd, short events, void *ctx)
 {
-  unsigned int *new_rate = ctx;
-  poisson_rate = (double) *new_rate / (double) poisson_nb_processes();
-  /* TODO: apply this rate to all processes. */
-  info("Changed Poisson rate to %f\n", poisson_rate);
+  struct command *command = ctx;
+  end_phase();
+  rate_controller.target = rate_share * (double) command->query_rate;
+  rate_controller.nb_samples = 0;
+  apply_query_rate();
+  start_phase();
+  info("Changed query rate to %u qps (%f qps for this thread)\n",
+       command->query_rate, rate_controller.target);
+}
+
+/* Ends the run: ends the last phase and stops the event loop. */
+static void end_of_run(evutil_socket_t fd, short events, void *ctx)
+{
+  end_phase();
+  event_base_loopexit(base, NULL);
 }
 
+/* Stops and frees a recurrent rate slope event, along with its
+   argument. */
 static void stop_event(evutil_socket_t fd, short events, void *ctx)
 {
   struct event *event_to_stop = ctx;
+  void *arg = event_get_callback_arg(event_to_stop);
   event_del(event_to_stop);
   event_free(event_to_stop);
+  free(arg);
 }
 
 /* Adds or removes Poisson processes to update the query rate. */
@@ -141,22 +468,37 @@ static void add_remove_poisson_processes(evutil_socket_t fd, short events, void
   }
 }
 
-/* Called once, and starts a recurrent event that periodically adds or
-   removes Poisson processes to implement a rate slope change. */
-static void change_query_rate_slope(evutil_socket_t fd, short events, void *ctx)
+/* Changes the rate of the merged-stream scheduler to implement a rate
+   slope change. */
+static void update_merged_rate(evutil_socket_t fd, short events, void *ctx)
+{
+  /* By how much (positive or negative) should we change the rate? */
+  double *rate_change = ctx;
+  double new_rate = merged_process->rate + *rate_change;
+  poisson_set_rate(merged_process, new_rate > 0 ? new_rate : 0);
+}
+
+/* Returns a recurrent event that changes the rate of the merged-stream
+   scheduler at regular intervals, to implement the given rate slope.
+   [repeat_interval] is set to the interval between changes. */
+static struct event *new_merged_rate_slope_event(double query_rate_slope, struct timeval *repeat_interval)
+{
+  /* Freed by stop_event() */
+  double *rate_change = malloc(sizeof(double));
+  *rate_change = query_rate_slope * RATE_SLOPE_UPDATE_INTERVAL_MSEC / 1000.;
+  info("Changing query rate slope to %.1f qps/s (%+.1f qps every %d ms)\n",
+       query_rate_slope, *rate_change, RATE_SLOPE_UPDATE_INTERVAL_MSEC);
+  timeval_add_ms(repeat_interval, RATE_SLOPE_UPDATE_INTERVAL_MSEC);
+  return event_new(base, -1, EV_PERSIST, update_merged_rate, rate_change);
+}
+
+/* Returns a recurrent event that adds or removes Poisson processes at
+   regular intervals, to implement the given rate slope.
+   [repeat_interval] is set to the interval between changes. */
+static struct event *new_poisson_processes_slope_event(double query_rate_slope, struct timeval *repeat_interval)
 {
-  struct rateslope_command *command = ctx;
-  struct event *recurr_ev;
   unsigned long int repeat_interval_us;
-  struct timeval repeat_interval = {0, 0};
-  struct event *stop_ev;
-  struct timeval stop_delay = {0, 0};
-  /* Instructed to do nothing, let's do it. */
-  if (command->query_rate_slope == 0) {
-    info("Resetting query slope to 0 qps/s\n");
-    return;
-  }
-  /* TODO: where should we free nb_poisson_change? */
+  /* Freed by stop_event() */
   int *nb_poisson_change = malloc(sizeof(int));
   /* Schedule recurrent event to add or remove poisson processes */
   /* Compute jointly the interval between updates, and the number of
@@ -164,21 +506,532 @@ static void change_query_rate_slope(evutil_socket_t fd, short events, void *ctx)
      target an update interval of 100 ms (RATE_SLOPE_UPDATE_INTERVAL_MSEC)
      but the actual value will be slightly different: for instance, to
      reach a slope of +42 qps/s, we add 4 poisson processes every 95.2 ms. */
-  *nb_poisson_change = divide_closest(command->query_rate_slope * RATE_SLOPE_UPDATE_INTERVAL_MSEC, 1000);
+  *nb_poisson_change = lrint(query_rate_slope * RATE_SLOPE_UPDATE_INTERVAL_MSEC / 1000.);
   if (*nb_poisson_change == 0)
-    *nb_poisson_change = command->query_rate_slope > 0 ? 1 : -1;
-  repeat_interval_us = 1000 * 1000 * (*nb_poisson_change) / command->query_rate_slope;
-  info("Changing query rate slope to %d qps/s (%d Poisson processes every %lu.%.3lu ms)\n",
-       command->query_rate_slope,
+    *nb_poisson_change = query_rate_slope > 0 ? 1 : -1;
+  repeat_interval_us = lrint(1000. * 1000. * (*nb_poisson_change) / query_rate_slope);
+  info("Changing query rate slope to %.1f qps/s (%d Poisson processes every %lu.%.3lu ms)\n",
+       query_rate_slope,
        *nb_poisson_change,
        repeat_interval_us / 1000,
        repeat_interval_us % 1000);
-  recurr_ev = event_new(base, -1, EV_PERSIST, add_remove_poisson_processes, nb_poisson_change);
-  timeval_add_us(&repeat_interval, repeat_interval_us);
+  timeval_add_us(repeat_interval, repeat_interval_us);
+  return event_new(base, -1, EV_PERSIST, add_remove_poisson_processes, nb_poisson_change);
+}
+
+/* Called once, and starts a recurrent event that periodically adds or
+   removes Poisson processes (or changes the rate of the merged-stream
+   scheduler) to implement a rate slope change. */
+static void change_query_rate_slope(evutil_socket_t fd, short events, void *ctx)
+{
+  struct rateslope_command *command = ctx;
+  /* Slope handled by the current thread, in qps per second */
+  double query_rate_slope = rate_share * command->query_rate_slope;
+  struct event *recurr_ev;
+  struct timeval repeat_interval = {0, 0};
+  struct timeval stop_delay = {0, 0};
+  /* Instructed to do nothing, let's do it. */
+  if (command->query_rate_slope == 0) {
+    info("Resetting query slope to 0 qps/s\n");
+    return;
+  }
+  if (merged_process != NULL) {
+    recurr_ev = new_merged_rate_slope_event(query_rate_slope, &repeat_interval);
+  } else {
+    recurr_ev = new_poisson_processes_slope_event(query_rate_slope, &repeat_interval);
+  }
   event_add(recurr_ev, &repeat_interval);
-  /* Schedule removal of the repeating event */
-  stop_ev = event_new(base, -1, 0, stop_event, recurr_ev);
+  /* Schedule removal of the repeating event (one-shot events are freed
+     by libevent once they ran) */
   timeval_add_ms(&stop_delay, command->duration_ms);
-  event_add(stop_ev, &stop_delay);
-  /* TODO: where should we free stop_ev? */
+  event_base_once(base, -1, EV_TIMEOUT, stop_event, recurr_ev, &stop_delay);
+}
+
+/* Logs a query sent at [now_realtime], either as CSV or in the binary
+   log.  [thread_id] identifies the calling thread, and [query_id] is the
+   sequence number of the query on its connection (the binary log only
+   keeps its low 32 bits). */
+static void log_query(unsigned int thread_id, const struct timespec *now_realtime,
+		      uint32_t connection_id, uint64_t query_id, uint32_t poisson_id,
+		      const struct timespec *lag)
+{
+  struct rttlog_record record = {0};
+  if (rtt_log != NULL) {
+    record.type = RTTLOG_TYPE_QUERY;
+    record.timestamp_ns = now_realtime->tv_sec * 1000000000UL + now_realtime->tv_nsec;
+    record.connection_id = connection_id;
+    record.query_id = query_id;
+    record.poisson_id = poisson_id;
+    record.rtt_us = 0;
+    record.schedule_lag_us = (lag->tv_nsec / 1000) + (1000000 * lag->tv_sec);
+    rttlog_append(rtt_log, thread_id, &record);
+    return;
+  }
+  /* CSV format: type (Query), timestamp, connection ID, query ID, Poisson ID, poisson interval (in µs), unused,
+     schedule lag in µs (how late the query was sent compared to its intended time). */
+  printf("Q,%lu.%.9lu,%u,%lu,%u,,,%lu\n",
+	 now_realtime->tv_sec, now_realtime->tv_nsec,
+	 connection_id,
+	 query_id,
+	 poisson_id,
+	 (lag->tv_nsec / 1000) + (1000000 * lag->tv_sec));
+}
+
+/* Logs an answer received at [now_realtime], either as CSV or in the
+   binary log.  [lag] is the schedule lag of the corresponding query. */
+static void log_answer(unsigned int thread_id, const struct timespec *now_realtime,
+		       uint32_t connection_id, uint64_t query_id,
+		       const struct timespec *rtt, const struct timespec *lag)
+{
+  struct rttlog_record record = {0};
+  if (rtt_log != NULL) {
+    record.type = RTTLOG_TYPE_ANSWER;
+    record.timestamp_ns = now_realtime->tv_sec * 1000000000UL + now_realtime->tv_nsec;
+    record.connection_id = connection_id;
+    record.query_id = query_id;
+    record.poisson_id = 0;
+    record.rtt_us = (rtt->tv_nsec / 1000) + (1000000 * rtt->tv_sec);
+    record.schedule_lag_us = (lag->tv_nsec / 1000) + (1000000 * lag->tv_sec);
+    rttlog_append(rtt_log, thread_id, &record);
+    return;
+  }
+  /* CSV format: type (Answer), timestamp at the time of reception
+     (answer), connection ID, query ID, unused, unused, computed RTT in µs,
+     schedule lag of the query in µs */
+  printf("A,%lu.%.9lu,%u,%lu,,,%lu,%lu\n",
+	 now_realtime->tv_sec, now_realtime->tv_nsec,
+	 connection_id,
+	 query_id,
+	 (rtt->tv_nsec / 1000) + (1000000 * rtt->tv_sec),
+	 (lag->tv_nsec / 1000) + (1000000 * lag->tv_sec));
+}
+
+/* Merges all per-thread RTT histograms into [result]. */
+static void merge_rtt_histograms(struct histogram *result)
+{
+  histogram_init(result);
+  for (unsigned int i = 0; i < nb_rtt_histograms; i++)
+    histogram_add(result, rtt_histograms[i]);
+}
+
+/* Periodically prints a summary of RTTs measured since the last call. */
+static void print_rtt_histogram_interval(evutil_socket_t fd, short events, void *ctx)
+{
+  /* Snapshot of all RTTs at the time of the previous summary */
+  struct histogram *previous = ctx;
+  struct histogram *current = malloc(sizeof(struct histogram));
+  char label[64];
+  merge_rtt_histograms(current);
+  histogram_subtract(current, previous);
+  snprintf(label, sizeof(label), "RTT over the last %u s", histogram_interval);
+  histogram_print_summary(stderr, label, current);
+  histogram_add(previous, current);
+  free(current);
+}
+
+/* Periodic RTT summaries, and snapshot of all RTTs at the time of the
+   previous summary */
+static struct event *rtt_report_event;
+static struct histogram *rtt_report_snapshot;
+
+/* Starts printing periodic RTT summaries, every [histogram_interval]
+   seconds, from the event loop of the current thread. */
+static void start_rtt_histogram_reports(evutil_socket_t fd, short events, void *ctx)
+{
+  struct timeval interval = {histogram_interval, 0};
+  if (histogram_interval == 0)
+    return;
+  rtt_report_snapshot = malloc(sizeof(struct histogram));
+  merge_rtt_histograms(rtt_report_snapshot);
+  rtt_report_event = event_new(base, -1, EV_PERSIST, print_rtt_histogram_interval, rtt_report_snapshot);
+  event_add(rtt_report_event, &interval);
+}
+
+/* Stops periodic RTT summaries, from the thread that printed them. */
+static void stop_rtt_histogram_reports()
+{
+  if (rtt_report_event != NULL)
+    event_free(rtt_report_event);
+  free(rtt_report_snapshot);
+  rtt_report_event = NULL;
+  rtt_report_snapshot = NULL;
+}
+
+/* Prints a summary of all RTTs measured during the run. */
+static void print_rtt_histogram_total()
+{
+  struct histogram *total = malloc(sizeof(struct histogram));
+  merge_rtt_histograms(total);
+  histogram_print_summary(stderr, "RTT over the whole run", total);
+  free(total);
+}
+
+/* Applies the rate of the current capacity search step to the current
+   thread, or ends the run once the search is over. */
+static void search_follow()
+{
+  unsigned int rate = atomic_load(&search.rate);
+  if (rate == rate_controller.search_rate)
+    return;
+  rate_controller.search_rate = rate;
+  if (rate == 0) {
+    end_of_run(-1, EV_TIMEOUT, NULL);
+    return;
+  }
+  /* A correction measured at the rate of the previous step (possibly
+     with an overloaded event loop) does not carry over. */
+  rate_controller.target = rate_share * (double) rate;
+  rate_controller.correction = 1.;
+  rate_controller.nb_samples = 0;
+  apply_query_rate();
+}
+
+/* Records the result of a step at [rate], and returns the rate of the
+   next step, or 0 if the search is over. */
+static unsigned int search_next_rate(unsigned int rate, short pass)
+{
+  struct capacity_search *s = &search;
+  if (pass)
+    s->passed = rate;
+  else
+    s->failed = rate;
+  if (s->nb_steps >= SEARCH_MAX_STEPS)
+    return 0;
+  if (s->failed == 0)
+    return (unsigned long) rate < (unsigned long) s->start_rate << SEARCH_MAX_DOUBLINGS ? 2 * rate : 0;
+  if (s->passed == 0)
+    return rate / 2;
+  if (s->failed <= s->passed * (1. + SEARCH_PRECISION) || s->failed - s->passed <= 1)
+    return 0;
+  return s->passed + (s->failed - s->passed) / 2;
+}
+
+/* Prints the outcome of the capacity search. */
+static void search_report()
+{
+  struct capacity_search *s = &search;
+  if (s->passed == 0) {
+    fprintf(stderr, "Capacity search: no rate down to %u qps meets p99 <= %lu us with at most %.3f%% unanswered queries\n",
+	    s->failed, s->slo_us, 100. * s->max_loss);
+    return;
+  }
+  fprintf(stderr, "Capacity: %u qps, with p99 %lu us (95%% CI %lu-%lu us over %lu samples) and %.3f%% unanswered queries\n",
+	  s->passed, s->best_p99, s->best_p99_low, s->best_p99_high, s->best_samples, 100. * s->best_loss);
+  if (s->failed == 0)
+    fprintf(stderr, "Capacity search: stopped at %u qps without any failure, the capacity may be higher\n", s->passed);
+  else
+    fprintf(stderr, "Capacity search: %u qps failed, so the capacity is within %.1f%% of %u qps\n",
+	    s->failed, 100. * (s->failed - s->passed) / s->passed, s->passed);
+  if (s->best_p99_high > s->slo_us)
+    fprintf(stderr, "Warning: the p99 at %u qps is not below the SLO with 95%% confidence, consider longer steps\n",
+	    s->passed);
+}
+
+/* Ends the warm-up of a step, or measures the step and moves on to the
+   next one. */
+static void search_tick(evutil_socket_t fd, short events, void *ctx)
+{
+  struct capacity_search *s = &search;
+  struct histogram *step;
+  struct timespec now, elapsed;
+  struct timeval timeout = {s->warmup, 0};
+  unsigned int rate = atomic_load(&s->rate), next_rate;
+  unsigned long sent;
+  uint64_t answers, p99;
+  double duration, achieved, expected, loss, ci;
+  short behind, pass;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if (!s->measuring) {
+    merge_rtt_histograms(s->snapshot);
+    s->snapshot_sent = total_queries_sent();
+    s->snapshot_time = now;
+    s->measuring = 1;
+    timeout.tv_sec = s->step_duration;
+    event_add(s->event, &timeout);
+    return;
+  }
+  s->measuring = 0;
+  s->nb_steps++;
+  /* RTTs and queries of the measurement window only.  Answers to queries
+     sent before the window, and queries answered after it, cancel out
+     at a steady state. */
+  step = malloc(sizeof(struct histogram));
+  merge_rtt_histograms(step);
+  histogram_subtract(step, s->snapshot);
+  sent = total_queries_sent() - s->snapshot_sent;
+  answers = histogram_count(step);
+  subtract_timespec(&elapsed, &now, &s->snapshot_time);
+  duration = elapsed.tv_sec + elapsed.tv_nsec / 1000000000.;
+  achieved = duration > 0 ? sent / duration : 0.;
+  expected = rate * duration;
+  behind = expected - sent > fmax((1. - SEARCH_MIN_ACHIEVED) * expected, 3 * sqrt(expected));
+  loss = sent > answers ? (double) (sent - answers) / sent : 0.;
+  p99 = histogram_percentile(step, 99.);
+  pass = answers > 0 && p99 <= s->slo_us && loss <= s->max_loss && !behind;
+  fprintf(stderr, "Search step %u: target %u qps, achieved %.0f qps, p99 %lu us, %.3f%% unanswered: %s\n",
+	  s->nb_steps, rate, achieved, p99, 100. * loss,
+	  pass ? "pass" : answers == 0 || p99 > s->slo_us ? "fail (latency)" :
+	  loss > s->max_loss ? "fail (loss)" : "fail (generator behind)");
+  if (pass) {
+    /* Order statistics: the rank of the p99 among n samples has a
+       standard deviation of sqrt(n * 0.99 * 0.01). */
+    ci = 1.96 * 100. * sqrt(0.99 * 0.01 / answers);
+    s->best_p99 = p99;
+    s->best_p99_low = histogram_percentile(step, 99. - ci);
+    s->best_p99_high = histogram_percentile(step, 99. + ci < 100. ? 99. + ci : 100.);
+    s->best_samples = answers;
+    s->best_loss = loss;
+  }
+  free(step);
+  next_rate = search_next_rate(rate, pass);
+  if (next_rate == 0)
+    search_report();
+  atomic_store(&s->rate, next_rate);
+  search_follow();
+  if (next_rate > 0)
+    event_add(s->event, &timeout);
+}
+
+/* Starts the capacity search from the current thread, once queries are
+   being sent. */
+static void search_start()
+{
+  struct timeval timeout = {search.warmup, 0};
+  info("Searching for the highest rate with p99 <= %lu us, starting at %u qps\n",
+       search.slo_us, search.start_rate);
+  search.snapshot = malloc(sizeof(struct histogram));
+  search.event = event_new(base, -1, 0, search_tick, NULL);
+  atomic_store(&search.rate, search.start_rate);
+  search_follow();
+  event_add(search.event, &timeout);
+}
+
+/* Frees the capacity search, from the thread that drove it. */
+static void search_stop()
+{
+  if (search.event != NULL)
+    event_free(search.event);
+  free(search.snapshot);
+  search.event = NULL;
+  search.snapshot = NULL;
+}
+
+/* Prints the loss counters of all threads, for [sent] queries. */
+static void print_query_counters(unsigned long sent)
+{
+  uint64_t lost = 0, late = 0, duplicate = 0, mismatched = 0, pending = 0;
+  for (unsigned int i = 0; i < nb_query_trackers; i++) {
+    lost += atomic_load(&query_trackers[i]->lost);
+    late += atomic_load(&query_trackers[i]->late);
+    duplicate += atomic_load(&query_trackers[i]->duplicate);
+    mismatched += atomic_load(&query_trackers[i]->mismatched);
+    pending += query_tracker_pending(query_trackers[i]);
+  }
+  fprintf(stderr, "Queries: %lu sent, %lu lost (%.3f%%, no answer within %u ms), %lu still pending at exit\n",
+	  sent, lost, sent > 0 ? 100. * lost / sent : 0., query_timeout, pending);
+  fprintf(stderr, "Answers: %lu late, %lu duplicate, %lu mismatched\n", late, duplicate, mismatched);
+}
+
+/* Reads all counters of thread [thread]. */
+static void read_thread_stats(unsigned int thread, struct thread_counters *counters)
+{
+  struct query_tracker *tracker = query_trackers[thread];
+  read_thread_counters(thread, counters);
+  counters->in_flight = query_tracker_pending(tracker);
+  counters->lost = RELAXED_LOAD(tracker->lost);
+  counters->late = RELAXED_LOAD(tracker->late);
+  counters->duplicate = RELAXED_LOAD(tracker->duplicate);
+  counters->mismatched = RELAXED_LOAD(tracker->mismatched);
+}
+
+/* Counters are all uint64_t: sums them field by field. */
+static void sum_thread_stats(struct thread_counters *total)
+{
+  struct thread_counters counters;
+  uint64_t *dst = (uint64_t *) total, *src = (uint64_t *) &counters;
+  memset(total, 0, sizeof(*total));
+  for (unsigned int i = 0; i < nb_query_trackers; i++) {
+    read_thread_stats(i, &counters);
+    for (size_t j = 0; j < sizeof(counters) / sizeof(uint64_t); j++)
+      dst[j] += src[j];
+  }
+}
+
+/* Merges all per-thread schedule lag histograms into [result]. */
+static void merge_lag_histograms(struct histogram *result)
+{
+  histogram_init(result);
+  for (unsigned int i = 0; i < nb_query_trackers; i++)
+    histogram_add(result, lag_histograms[i]);
+}
+
+/* Records the schedule lag of a query sent at [sent] instead of
+   [intended] into [lag_histogram], with live statistics. */
+static void record_schedule_lag(struct histogram *lag_histogram, const struct timespec *sent,
+				const struct timespec *intended)
+{
+  struct timespec lag;
+  if (!use_stats)
+    return;
+  subtract_timespec(&lag, sent, intended);
+  histogram_record(lag_histogram, (lag.tv_nsec / 1000) + (1000000 * lag.tv_sec));
+}
+
+/* Live statistics, driven by the event loop of a single thread.  The
+   line on stderr covers the last interval, while the text exposition
+   gives totals since the start (and latency percentiles over the whole
+   run), so that scrapers compute their own rates. */
+static struct live_stats {
+  struct event *event;
+  struct evhttp *http;
+  /* Totals and histograms at the time of the previous line */
+  struct thread_counters previous;
+  struct timespec previous_time;
+  struct histogram *rtt_snapshot;
+  struct histogram *lag_snapshot;
+} live_stats;
+
+/* Prints counters and latency percentiles of the last interval. */
+static void stats_tick(evutil_socket_t fd, short events, void *ctx)
+{
+  struct live_stats *ls = &live_stats;
+  struct thread_counters total;
+  struct histogram *rtt = malloc(sizeof(struct histogram));
+  struct histogram *lag = malloc(sizeof(struct histogram));
+  struct timespec now, elapsed;
+  double duration;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  sum_thread_stats(&total);
+  merge_rtt_histograms(rtt);
+  histogram_subtract(rtt, ls->rtt_snapshot);
+  histogram_add(ls->rtt_snapshot, rtt);
+  merge_lag_histograms(lag);
+  histogram_subtract(lag, ls->lag_snapshot);
+  histogram_add(ls->lag_snapshot, lag);
+  subtract_timespec(&elapsed, &now, &ls->previous_time);
+  duration = elapsed.tv_sec + elapsed.tv_nsec / 1000000000.;
+  if (duration <= 0)
+    duration = 1;
+  fprintf(stderr, "Stats: %.0f qps sent, %.0f answers/s, %.2f Mbit/s out, %.2f Mbit/s in, "
+	  "%lu in flight, %lu lost, %lu connections up, %lu down, lag p99 %lu us, "
+	  "RTT p50 %lu us, p99 %lu us, max %lu us\n",
+	  (total.sent - ls->previous.sent) / duration,
+	  (total.answers - ls->previous.answers) / duration,
+	  8e-6 * (total.bytes_sent - ls->previous.bytes_sent) / duration,
+	  8e-6 * (total.bytes_received - ls->previous.bytes_received) / duration,
+	  total.in_flight, total.lost - ls->previous.lost, total.conn_up, total.conn_down,
+	  histogram_percentile(lag, 99.), histogram_percentile(rtt, 50.),
+	  histogram_percentile(rtt, 99.), histogram_percentile(rtt, 100.));
+  ls->previous = total;
+  ls->previous_time = now;
+  free(rtt);
+  free(lag);
+}
+
+/* Metrics of the text exposition, with one sample per thread. */
+static const struct stats_metric {
+  const char *name;
+  const char *type;
+  const char *help;
+  size_t offset;
+} stats_metrics[] = {
+  {"queries_sent_total", "counter", "Queries sent.", offsetof(struct thread_counters, sent)},
+  {"answers_received_total", "counter", "Answers received, including bad ones.",
+   offsetof(struct thread_counters, answers)},
+  {"sent_bytes_total", "counter", "Bytes of queries sent.", offsetof(struct thread_counters, bytes_sent)},
+  {"received_bytes_total", "counter", "Bytes of answers received.",
+   offsetof(struct thread_counters, bytes_received)},
+  {"queries_in_flight", "gauge", "Queries waiting for an answer.", offsetof(struct thread_counters, in_flight)},
+  {"queries_lost_total", "counter", "Queries without an answer before their timeout.",
+   offsetof(struct thread_counters, lost)},
+  {"answers_late_total", "counter", "Answers received after the timeout of their query.",
+   offsetof(struct thread_counters, late)},
+  {"answers_duplicate_total", "counter", "Second answers to the same query.",
+   offsetof(struct thread_counters, duplicate)},
+  {"answers_mismatched_total", "counter", "Answers matching no outstanding query.",
+   offsetof(struct thread_counters, mismatched)},
+  {"connections_up", "gauge", "Connections currently up.", offsetof(struct thread_counters, conn_up)},
+  {"connections_down_total", "counter", "Connections that failed, or went down after being up.",
+   offsetof(struct thread_counters, conn_down)},
+};
+
+/* Appends the percentiles of [h] (in microseconds) as a summary in
+   seconds. */
+static void stats_print_summary(struct evbuffer *out, const char *name, const char *help,
+				struct histogram *h)
+{
+  static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+  evbuffer_add_printf(out, "# HELP " STATS_METRIC_PREFIX "%s %s\n", name, help);
+  evbuffer_add_printf(out, "# TYPE " STATS_METRIC_PREFIX "%s summary\n", name);
+  for (size_t i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); i++)
+    evbuffer_add_printf(out, STATS_METRIC_PREFIX "%s{quantile=\"%g\"} %.6f\n", name, quantiles[i],
+			histogram_percentile(h, 100. * quantiles[i]) / 1000000.);
+  evbuffer_add_printf(out, STATS_METRIC_PREFIX "%s_count %lu\n", name, histogram_count(h));
+}
+
+/* Serves the text exposition of all counters on /metrics. */
+static void stats_http_cb(struct evhttp_request *req, void *ctx)
+{
+  struct evbuffer *out = evbuffer_new();
+  struct thread_counters *counters = calloc(nb_query_trackers, sizeof(struct thread_counters));
+  struct histogram *h = malloc(sizeof(struct histogram));
+  const struct stats_metric *metric;
+  for (unsigned int i = 0; i < nb_query_trackers; i++)
+    read_thread_stats(i, &counters[i]);
+  for (size_t m = 0; m < sizeof(stats_metrics) / sizeof(stats_metrics[0]); m++) {
+    metric = &stats_metrics[m];
+    evbuffer_add_printf(out, "# HELP " STATS_METRIC_PREFIX "%s %s\n", metric->name, metric->help);
+    evbuffer_add_printf(out, "# TYPE " STATS_METRIC_PREFIX "%s %s\n", metric->name, metric->type);
+    for (unsigned int i = 0; i < nb_query_trackers; i++)
+      evbuffer_add_printf(out, STATS_METRIC_PREFIX "%s{thread=\"%u\"} %lu\n", metric->name, i,
+			  *(uint64_t *) ((char *) &counters[i] + metric->offset));
+  }
+  merge_rtt_histograms(h);
+  stats_print_summary(out, "rtt_seconds", "RTT of answers received on time, over the whole run.", h);
+  merge_lag_histograms(h);
+  stats_print_summary(out, "schedule_lag_seconds", "Delay of queries after their intended send time.", h);
+  evhttp_add_header(evhttp_request_get_output_headers(req), "Content-Type", "text/plain; version=0.0.4");
+  evhttp_send_reply(req, HTTP_OK, "OK", out);
+  evbuffer_free(out);
+  free(counters);
+  free(h);
+}
+
+/* Starts live statistics from the event loop of the current thread. */
+static void stats_start()
+{
+  struct timeval interval = {stats_interval / 1000, (stats_interval % 1000) * 1000};
+  live_stats.rtt_snapshot = malloc(sizeof(struct histogram));
+  live_stats.lag_snapshot = malloc(sizeof(struct histogram));
+  merge_rtt_histograms(live_stats.rtt_snapshot);
+  merge_lag_histograms(live_stats.lag_snapshot);
+  sum_thread_stats(&live_stats.previous);
+  clock_gettime(CLOCK_MONOTONIC, &live_stats.previous_time);
+  if (stats_interval > 0) {
+    live_stats.event = event_new(base, -1, EV_PERSIST, stats_tick, NULL);
+    event_add(live_stats.event, &interval);
+  }
+  if (stats_port > 0) {
+    /* Only reachable from the local host. */
+    live_stats.http = evhttp_new(base);
+    if (live_stats.http == NULL || evhttp_bind_socket(live_stats.http, "127.0.0.1", stats_port) != 0) {
+      fprintf(stderr, "Warning: cannot serve statistics on 127.0.0.1 port %u\n", stats_port);
+      return;
+    }
+    evhttp_set_allowed_methods(live_stats.http, EVHTTP_REQ_GET);
+    evhttp_set_cb(live_stats.http, "/metrics", stats_http_cb, NULL);
+    info("Serving statistics on http://127.0.0.1:%u/metrics\n", stats_port);
+  }
+}
+
+/* Stops live statistics, from the thread that drove them. */
+static void stats_stop()
+{
+  if (live_stats.event != NULL)
+    event_free(live_stats.event);
+  if (live_stats.http != NULL)
+    evhttp_free(live_stats.http);
+  free(live_stats.rtt_snapshot);
+  free(live_stats.lag_snapshot);
+  memset(&live_stats, 0, sizeof(live_stats));
 }
@@ -0,0 +1,17 @@
+#include <stdatomic.h>
+
+/* Statistics counters, written by a single thread and read by the
+   reporting thread. */
+
+/* Single-writer counter update: no need for a locked instruction. */
+#define RELAXED_ADD(_counter, _value) \
+    atomic_store_explicit(&(_counter), \
+			  atomic_load_explicit(&(_counter), memory_order_relaxed) + (_value), \
+			  memory_order_relaxed)
+
+#define RELAXED_LOAD(_counter) atomic_load_explicit(&(_counter), memory_order_relaxed)
+
+/* Difference between two struct timespec, in seconds, e.g. to turn
+   counters into rates. */
+#define TIMESPEC_DIFF(_a, _b) \
+    ((double) ((_a).tv_sec - (_b).tv_sec) + ((_a).tv_nsec - (_b).tv_nsec) / 1e9)
@@ -0,0 +1,121 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "delay.h"
+
+/* Reads an empirical CDF from [path].  Returns 0 on success. */
+static int _read_cdf(struct delay_dist *dist, const char *path)
+{
+  FILE *file;
+  size_t size = 64;
+  double delay, prob;
+  int ret = 0;
+  file = fopen(path, "r");
+  if (file == NULL) {
+    perror("Failed to open delay CDF file");
+    return -1;
+  }
+  dist->cdf_delays = malloc(size * sizeof(double));
+  dist->cdf_probs = malloc(size * sizeof(double));
+  while (fscanf(file, "%lf %lf", &delay, &prob) == 2) {
+    if (delay < 0. || prob < 0. || prob > 1.
+	|| (dist->cdf_len > 0 && (delay < dist->cdf_delays[dist->cdf_len - 1]
+				  || prob < dist->cdf_probs[dist->cdf_len - 1]))) {
+      fprintf(stderr, "Invalid delay CDF line %lu: delays and probabilities must be increasing, "
+	      "with probabilities between 0 and 1\n", dist->cdf_len + 1);
+      ret = -1;
+      break;
+    }
+    if (dist->cdf_len == size) {
+      size *= 2;
+      dist->cdf_delays = realloc(dist->cdf_delays, size * sizeof(double));
+      dist->cdf_probs = realloc(dist->cdf_probs, size * sizeof(double));
+    }
+    dist->cdf_delays[dist->cdf_len] = delay;
+    dist->cdf_probs[dist->cdf_len] = prob;
+    dist->cdf_len++;
+  }
+  if (ret == 0 && (!feof(file) || dist->cdf_len == 0 || dist->cdf_probs[dist->cdf_len - 1] != 1.)) {
+    fprintf(stderr, "Invalid delay CDF file %s: expected lines of '<us> <probability>', "
+	    "ending with probability 1\n", path);
+    ret = -1;
+  }
+  fclose(file);
+  return ret;
+}
+
+int delay_dist_parse(struct delay_dist *dist, const char *spec)
+{
+  int ret = -1;
+  memset(dist, 0, sizeof(*dist));
+  if (sscanf(spec, "const:%lf", &dist->params[0]) == 1) {
+    dist->type = DELAY_CONSTANT;
+    ret = dist->params[0] >= 0. ? 0 : -1;
+  } else if (sscanf(spec, "exp:%lf", &dist->params[0]) == 1) {
+    dist->type = DELAY_EXPONENTIAL;
+    ret = dist->params[0] >= 0. ? 0 : -1;
+  } else if (sscanf(spec, "bimodal:%lf:%lf:%lf", &dist->params[0], &dist->params[1], &dist->params[2]) == 3) {
+    dist->type = DELAY_BIMODAL;
+    ret = (dist->params[0] >= 0. && dist->params[0] <= 1.
+	   && dist->params[1] >= 0. && dist->params[2] >= 0.) ? 0 : -1;
+  } else if (strncmp(spec, "cdf:", 4) == 0) {
+    dist->type = DELAY_CDF;
+    /* Errors are reported while reading the file */
+    if (_read_cdf(dist, spec + 4) != 0) {
+      delay_dist_free(dist);
+      return -1;
+    }
+    return 0;
+  }
+  if (ret != 0)
+    fprintf(stderr, "Invalid delay distribution '%s'\n", spec);
+  return ret;
+}
+
+void delay_dist_free(struct delay_dist *dist)
+{
+  free(dist->cdf_delays);
+  free(dist->cdf_probs);
+  dist->cdf_delays = dist->cdf_probs = NULL;
+  dist->cdf_len = 0;
+}
+
+/* Inverse transform sampling of the empirical CDF, with linear
+   interpolation between points. */
+static double _sample_cdf(const struct delay_dist *dist, double u)
+{
+  size_t low = 0, high = dist->cdf_len - 1, mid;
+  double span;
+  if (u <= dist->cdf_probs[0])
+    return dist->cdf_delays[0];
+  /* Find the first point with a probability >= u */
+  while (low < high) {
+    mid = (low + high) / 2;
+    if (dist->cdf_probs[mid] < u)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+  span = dist->cdf_probs[low] - dist->cdf_probs[low - 1];
+  if (span <= 0.)
+    return dist->cdf_delays[low];
+  return dist->cdf_delays[low - 1] + (dist->cdf_delays[low] - dist->cdf_delays[low - 1])
+    * (u - dist->cdf_probs[low - 1]) / span;
+}
+
+uint64_t delay_dist_sample(const struct delay_dist *dist, double u)
+{
+  switch (dist->type) {
+  case DELAY_CONSTANT:
+    return dist->params[0];
+  case DELAY_EXPONENTIAL:
+    return -dist->params[0] * log(1. - u);
+  case DELAY_BIMODAL:
+    return u < dist->params[0] ? dist->params[1] : dist->params[2];
+  case DELAY_CDF:
+    return _sample_cdf(dist, u);
+  }
+  return 0;
+}
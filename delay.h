@@ -0,0 +1,32 @@
+#include <stddef.h>
+#include <stdint.h>
+
+/* Distributions of server-side processing delays */
+#define DELAY_CONSTANT    1
+#define DELAY_EXPONENTIAL 2
+#define DELAY_BIMODAL     3
+#define DELAY_CDF         4
+
+struct delay_dist {
+  int type;
+  /* Constant: delay.  Exponential: mean.  Bimodal: probability of the
+     first delay, then both delays.  All delays are in microseconds. */
+  double params[3];
+  /* Empirical CDF: increasing delays, and cumulative probabilities. */
+  double *cdf_delays;
+  double *cdf_probs;
+  size_t cdf_len;
+};
+
+/* Parses a delay distribution, one of:
+     const:<us>
+     exp:<mean_us>
+     bimodal:<p>:<us1>:<us2>   (first delay with probability p)
+     cdf:<file>                (lines of "<us> <cumulative probability>")
+   Prints an error and returns -1 if [spec] is invalid, 0 otherwise. */
+int delay_dist_parse(struct delay_dist *dist, const char *spec);
+
+void delay_dist_free(struct delay_dist *dist);
+
+/* Returns a delay in microseconds, from a uniform sample [u] in [0, 1). */
+uint64_t delay_dist_sample(const struct delay_dist *dist, double u);
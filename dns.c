@@ -0,0 +1,125 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "dns.h"
+
+/* Answer record: pointer to the question name (offset 12), type A, class
+   IN, TTL 300, 4 bytes of data (192.0.2.1). */
+static const char answer_record[] = {
+  0xc0, 0x0c,
+  0x00, 0x01, 0x00, 0x01,
+  0x00, 0x00, 0x01, 0x2c,
+  0x00, 0x04, 0xc0, 0x00, 0x02, 0x01
+};
+
+/* Returns the length of the question section starting at [question], or
+   0 if it is malformed. */
+static size_t _question_len(const unsigned char *question, size_t len)
+{
+  size_t pos = 0;
+  /* Sequence of labels, terminated by the root label. */
+  while (pos < len && question[pos] != 0) {
+    /* Compression pointers are not expected in queries. */
+    if (question[pos] & 0xc0)
+      return 0;
+    pos += question[pos] + 1;
+    /* Names are at most 255 bytes long, including the root label. */
+    if (pos >= DNS_MAX_QUESTION_SIZE - 4)
+      return 0;
+  }
+  /* Root label, type and class */
+  pos += 1 + 4;
+  if (pos > len)
+    return 0;
+  return pos;
+}
+
+/* Copies the header and question of [query] into [answer], turned into
+   the header of an answer with [nb_records] records.  Returns the length
+   of the header and question, or 0 if [query] is not a DNS query with a
+   single question, or if the header, question and [records_len] bytes of
+   records do not fit in [max_len] bytes. */
+static size_t _make_header(const char *query, size_t query_len, char *answer, size_t max_len,
+			   uint16_t nb_records, size_t records_len)
+{
+  const unsigned char *q = (const unsigned char *) query;
+  size_t question_len;
+  if (query_len < DNS_HEADER_SIZE)
+    return 0;
+  /* Must be a query (QR = 0) with exactly one question. */
+  if ((q[2] & 0x80) || q[4] != 0 || q[5] != 1)
+    return 0;
+  question_len = _question_len(q + DNS_HEADER_SIZE, query_len - DNS_HEADER_SIZE);
+  if (question_len == 0 || DNS_HEADER_SIZE + question_len + records_len > max_len)
+    return 0;
+  memcpy(answer, query, DNS_HEADER_SIZE + question_len);
+  /* QR = 1, keep opcode and RD, set RA, RCODE = NOERROR */
+  answer[2] = 0x80 | (q[2] & 0x79);
+  answer[3] = 0x80;
+  /* QDCOUNT = 1, ANCOUNT = nb_records, NSCOUNT = 0, ARCOUNT = 0 */
+  answer[6] = nb_records >> 8;
+  answer[7] = nb_records & 0xff;
+  memset(answer + 8, 0, 4);
+  return DNS_HEADER_SIZE + question_len;
+}
+
+size_t dns_make_answer(const char *query, size_t query_len, char *answer, size_t max_len)
+{
+  size_t len = _make_header(query, query_len, answer, max_len, 1, sizeof(answer_record));
+  if (len == 0)
+    return 0;
+  memcpy(answer + len, answer_record, sizeof(answer_record));
+  return len + sizeof(answer_record);
+}
+
+int dns_template_init(struct dns_template *template, unsigned int nb_records, size_t rdata_size)
+{
+  size_t record_len = sizeof(answer_record) - 4 + rdata_size;
+  unsigned char *record;
+  size_t left;
+  memset(template, 0, sizeof(*template));
+  if (nb_records > 0xffff || rdata_size > 0xffff
+      || DNS_HEADER_SIZE + DNS_MAX_QUESTION_SIZE + nb_records * record_len > DNS_MAX_TCP_SIZE)
+    return -1;
+  template->nb_records = nb_records;
+  template->records_len = nb_records * record_len;
+  template->records = malloc(template->records_len > 0 ? template->records_len : 1);
+  for (unsigned int i = 0; i < nb_records; i++) {
+    record = (unsigned char *) template->records + i * record_len;
+    /* Name pointer, class, TTL: same as the single A record */
+    memcpy(record, answer_record, 10);
+    record[10] = rdata_size >> 8;
+    record[11] = rdata_size & 0xff;
+    if (rdata_size == 4) {
+      memcpy(record + 12, answer_record + 12, 4);
+      continue;
+    }
+    /* TXT record: sequence of character strings of at most 255 bytes */
+    record[3] = 16;
+    record += 12;
+    left = rdata_size;
+    while (left > 0) {
+      size_t len = left - 1 > 255 ? 255 : left - 1;
+      *record = len;
+      memset(record + 1, 'x', len);
+      record += len + 1;
+      left -= len + 1;
+    }
+  }
+  return 0;
+}
+
+void dns_template_free(struct dns_template *template)
+{
+  free(template->records);
+  template->records = NULL;
+}
+
+size_t dns_make_answer_header(const struct dns_template *template, const char *query, size_t query_len,
+			      char *answer, size_t max_len)
+{
+  /* The question is at most DNS_MAX_QUESTION_SIZE bytes, so the whole
+     answer always fits in a DNS message over TCP. */
+  return _make_header(query, query_len, answer, max_len, template->nb_records, 0);
+}
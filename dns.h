@@ -0,0 +1,43 @@
+#include <stddef.h>
+#include <stdint.h>
+
+/* Size of the DNS header. */
+#define DNS_HEADER_SIZE 12
+
+/* Maximum size of the question section (maximum name length, type and
+   class). */
+#define DNS_MAX_QUESTION_SIZE (255 + 4)
+
+/* Maximum size of a DNS message over TCP (2-bytes length prefix). */
+#define DNS_MAX_TCP_SIZE 65535
+
+/* Precomputed answer section, appended as is to every answer.  Records
+   point to the question name, so they do not depend on the query. */
+struct dns_template {
+  char *records;
+  size_t records_len;
+  uint16_t nb_records;
+};
+
+/* Builds a DNS answer to [query] into [answer], which can hold
+   [max_len] bytes: the question is copied, and a single A record
+   (192.0.2.1, pointing to the question name) is appended.  Returns the
+   length of the answer, or 0 if [query] is not a DNS query with a single
+   question, or if the answer does not fit. */
+size_t dns_make_answer(const char *query, size_t query_len, char *answer, size_t max_len);
+
+/* Precomputes [nb_records] answer records with [rdata_size] bytes of data
+   each: A records (192.0.2.1) if [rdata_size] is 4, TXT records otherwise.
+   Returns 0 on success, or -1 if any answer (to a question of maximum
+   size) would not fit in a DNS message over TCP. */
+int dns_template_init(struct dns_template *template, unsigned int nb_records, size_t rdata_size);
+
+void dns_template_free(struct dns_template *template);
+
+/* Builds the header and question of the answer to [query] into [answer],
+   which can hold [max_len] bytes.  The full answer is made of these,
+   followed by the records of [template].  Returns the length of the
+   header and question, or 0 if [query] is not a DNS query with a single
+   question, or if they do not fit. */
+size_t dns_make_answer_header(const struct dns_template *template, const char *query, size_t query_len,
+			      char *answer, size_t max_len);
@@ -0,0 +1,102 @@
+#include <string.h>
+
+#include "histogram.h"
+#include "counters.h"
+
+
+static unsigned int _bucket_index(uint64_t value)
+{
+  unsigned int exponent;
+  if (value < HISTOGRAM_SUB_BUCKET_COUNT)
+    return value;
+  /* Shift the value so that it falls in the upper half of the
+     sub-buckets. */
+  exponent = 63 - __builtin_clzll(value) - (HISTOGRAM_SUB_BUCKET_BITS - 1);
+  return exponent * HISTOGRAM_SUB_BUCKET_HALF + (value >> exponent);
+}
+
+/* Returns the highest value that falls in the given bucket. */
+static uint64_t _bucket_highest_value(unsigned int index)
+{
+  unsigned int exponent;
+  uint64_t sub_bucket;
+  if (index < HISTOGRAM_SUB_BUCKET_COUNT)
+    return index;
+  exponent = index / HISTOGRAM_SUB_BUCKET_HALF - 1;
+  sub_bucket = index - exponent * HISTOGRAM_SUB_BUCKET_HALF;
+  return ((sub_bucket + 1) << exponent) - 1;
+}
+
+void histogram_init(struct histogram *h)
+{
+  for (unsigned int i = 0; i < HISTOGRAM_NB_BUCKETS; i++)
+    atomic_init(&h->counts[i], 0);
+  atomic_init(&h->total_count, 0);
+}
+
+void histogram_record(struct histogram *h, uint64_t value)
+{
+  RELAXED_ADD(h->counts[_bucket_index(value)], 1);
+  RELAXED_ADD(h->total_count, 1);
+}
+
+void histogram_add(struct histogram *dst, struct histogram *src)
+{
+  for (unsigned int i = 0; i < HISTOGRAM_NB_BUCKETS; i++)
+    RELAXED_ADD(dst->counts[i], RELAXED_LOAD(src->counts[i]));
+  RELAXED_ADD(dst->total_count, RELAXED_LOAD(src->total_count));
+}
+
+void histogram_subtract(struct histogram *dst, struct histogram *src)
+{
+  for (unsigned int i = 0; i < HISTOGRAM_NB_BUCKETS; i++)
+    RELAXED_ADD(dst->counts[i], - RELAXED_LOAD(src->counts[i]));
+  RELAXED_ADD(dst->total_count, - RELAXED_LOAD(src->total_count));
+}
+
+void histogram_copy(struct histogram *dst, struct histogram *src)
+{
+  histogram_init(dst);
+  histogram_add(dst, src);
+}
+
+uint64_t histogram_count(struct histogram *h)
+{
+  return RELAXED_LOAD(h->total_count);
+}
+
+uint64_t histogram_percentile(struct histogram *h, double percentile)
+{
+  uint64_t total = 0, target, cumulated = 0;
+  unsigned int last_nonempty = 0;
+  /* The total count may be slightly out of sync with buckets if the
+     writer is concurrently recording values: recompute it. */
+  for (unsigned int i = 0; i < HISTOGRAM_NB_BUCKETS; i++)
+    total += RELAXED_LOAD(h->counts[i]);
+  if (total == 0)
+    return 0;
+  target = (uint64_t) (percentile / 100. * total + 0.5);
+  if (target < 1)
+    target = 1;
+  for (unsigned int i = 0; i < HISTOGRAM_NB_BUCKETS; i++) {
+    uint64_t count = RELAXED_LOAD(h->counts[i]);
+    if (count == 0)
+      continue;
+    cumulated += count;
+    last_nonempty = i;
+    if (cumulated >= target)
+      return _bucket_highest_value(i);
+  }
+  return _bucket_highest_value(last_nonempty);
+}
+
+void histogram_print_summary(FILE *out, const char *label, struct histogram *h)
+{
+  fprintf(out, "%s: %lu samples, p50 %lu us, p90 %lu us, p99 %lu us, p99.9 %lu us, max %lu us\n",
+	  label, histogram_count(h),
+	  histogram_percentile(h, 50.),
+	  histogram_percentile(h, 90.),
+	  histogram_percentile(h, 99.),
+	  histogram_percentile(h, 99.9),
+	  histogram_percentile(h, 100.));
+}
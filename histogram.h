@@ -0,0 +1,52 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+/* Log-bucketed histogram of integer values (typically latencies in
+   microseconds), in the spirit of HdrHistogram.  Values below
+   2^HISTOGRAM_SUB_BUCKET_BITS are recorded exactly.  Above, each power of
+   two is split into 2^(HISTOGRAM_SUB_BUCKET_BITS - 1) buckets, so that the
+   relative error of any reported value is below 1/64 (~1.6%). */
+#define HISTOGRAM_SUB_BUCKET_BITS 7
+#define HISTOGRAM_SUB_BUCKET_COUNT (1 << HISTOGRAM_SUB_BUCKET_BITS)
+#define HISTOGRAM_SUB_BUCKET_HALF (HISTOGRAM_SUB_BUCKET_COUNT / 2)
+/* Enough buckets to cover all 64-bit values. */
+#define HISTOGRAM_NB_BUCKETS ((64 - HISTOGRAM_SUB_BUCKET_BITS + 2) * HISTOGRAM_SUB_BUCKET_HALF)
+
+/* A histogram has a single writer (the thread that records values), but
+   can be read at any time by other threads, e.g. to print periodic
+   summaries.  Counters are atomic so that such reads are well-defined,
+   but recording only uses relaxed loads and stores (no locked
+   instruction). */
+struct histogram {
+  _Atomic uint64_t counts[HISTOGRAM_NB_BUCKETS];
+  _Atomic uint64_t total_count;
+};
+
+void histogram_init(struct histogram *h);
+
+/* Records a value.  Must only be called by the writer thread. */
+void histogram_record(struct histogram *h, uint64_t value);
+
+/* Adds all values recorded in [src] to [dst].  Used to merge per-thread
+   histograms. */
+void histogram_add(struct histogram *dst, struct histogram *src);
+
+/* Removes all values recorded in [src] from [dst].  If [src] is an older
+   snapshot of [dst], [dst] then only contains values recorded since the
+   snapshot. */
+void histogram_subtract(struct histogram *dst, struct histogram *src);
+
+/* Copies [src] into [dst]. */
+void histogram_copy(struct histogram *dst, struct histogram *src);
+
+uint64_t histogram_count(struct histogram *h);
+
+/* Returns the value at the given percentile (between 0 and 100).  The
+   maximum is obtained with a percentile of 100.  Returns 0 for an empty
+   histogram. */
+uint64_t histogram_percentile(struct histogram *h, double percentile);
+
+/* Prints a one-line summary (count, p50, p90, p99, p99.9, max), prefixed
+   with [label]. */
+void histogram_print_summary(FILE *out, const char *label, struct histogram *h);
@@ -1,13 +1,18 @@
 #include "poisson.h"
 #include "utils.h"
 
+/* Maximum number of events handled by a merged-stream scheduler in a
+   single wakeup.  Only reached when the event loop is lagging behind. */
+#define POISSON_MAX_EVENTS_PER_WAKEUP 4096
 
 /* Array of all poisson processes.  Each process is allocated separately
-   to ensure stable memory addresses, even when we reallocate the array. */
-static struct poisson_process* *_processes;
-static size_t _processes_size;
+   to ensure stable memory addresses, even when we reallocate the array.
+   All state is thread-local: each thread running an event loop has its
+   own independent set of Poisson processes. */
+static __thread struct poisson_process* *_processes;
+static __thread size_t _processes_size;
 /* Next process ID available */
-static unsigned int _next_process_id;
+static __thread unsigned int _next_process_id;
 
 
 static struct poisson_process* _get_process(unsigned int process_id)
@@ -33,15 +38,68 @@ static int _increase_processes(size_t new_size)
   return 0;
 }
 
+/* Schedule the next wakeup of a process, at the absolute time given by
+   [next_event]. */
+static int _schedule_next(struct poisson_process *proc, const struct timespec *now)
+{
+  struct timespec delay;
+  struct timeval interval;
+  subtract_timespec(&delay, &proc->next_event, now);
+  timespec_to_timeval(&interval, &delay);
+  return event_add(proc->event, &interval);
+}
+
+static void poisson_merged_event(struct poisson_process *proc)
+{
+  struct timespec now;
+  unsigned int nb_events = 0;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  /* Run the callback once for every event that is due. */
+  while (proc->rate > 0 && compare_timespec(&proc->next_event, &now) <= 0) {
+    /* Don't starve I/O if we are very late: handle the remaining events
+       on the next wakeup, right after pending I/O. */
+    if (nb_events == POISSON_MAX_EVENTS_PER_WAKEUP)
+      break;
+    proc->current_event = proc->next_event;
+    timespec_add_sec(&proc->next_event, poisson_interarrival(proc->rate));
+    if (proc->callback != NULL) {
+      proc->callback(proc->callback_arg);
+    }
+    nb_events++;
+  }
+  /* Paused, poisson_set_rate() will restart the process. */
+  if (proc->rate <= 0)
+    return;
+  if (_schedule_next(proc, &now) != 0) {
+    fprintf(stderr, "Failed to schedule next query (Poisson process %u)\n", proc->process_id);
+  }
+}
+
 static void poisson_event(evutil_socket_t fd, short events, void *ctx)
 {
   struct poisson_process *proc = ctx;
-  static struct timeval interval;
-  /* Schedule next query */
-  generate_poisson_interarrival(&interval, proc->rate);
-  int ret = event_add(proc->event, &interval);
-  if (ret != 0) {
-    fprintf(stderr, "Failed to schedule next query (Poisson process %u)\n", proc->process_id);
+  struct timespec now;
+  if (proc->merged) {
+    poisson_merged_event(proc);
+    return;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  proc->current_event = proc->next_event;
+  /* Schedule next query, unless paused (poisson_set_rate() will restart
+     the process). */
+  if (proc->rate > 0) {
+    if (proc->absolute) {
+      /* Relative to the intended time of this event, so that delays in
+	 the event loop don't accumulate. */
+      timespec_add_sec(&proc->next_event, poisson_interarrival(proc->rate));
+    } else {
+      proc->next_event = now;
+      timespec_add_sec(&proc->next_event, poisson_interarrival(proc->rate));
+    }
+    int ret = _schedule_next(proc, &now);
+    if (ret != 0) {
+      fprintf(stderr, "Failed to schedule next query (Poisson process %u)\n", proc->process_id);
+    }
   }
   /* Run user-provided callback function */
   if (proc->callback != NULL) {
@@ -86,6 +144,9 @@ struct poisson_process* poisson_new(struct event_base *base)
   proc->rate = 1.;
   proc->callback = NULL;
   proc->callback_arg = NULL;
+  proc->merged = 0;
+  proc->absolute = 0;
+  proc->started = 0;
   proc->event = event_new(proc->evbase, -1, 0, poisson_event, proc);
   _next_process_id++;
   return proc;
@@ -126,12 +187,61 @@ int poisson_set_callback(struct poisson_process* proc, callback_fn callback, voi
   return 0;
 }
 
+/* Sets the rate of the process, in events/second.  The new rate applies
+   immediately, and a rate of 0 pauses the process until a positive rate
+   is set. */
 int poisson_set_rate(struct poisson_process* proc, double poisson_rate)
 {
+  struct timespec now;
+  double old_rate;
   if (proc == NULL) {
     return -1;
   }
+  old_rate = proc->rate;
   proc->rate = poisson_rate;
+  if (!proc->started || poisson_rate == old_rate)
+    return 0;
+  if (poisson_rate <= 0) {
+    event_del(proc->event);
+    return 0;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  /* Keep events that are already due (a scheduler catching up). */
+  if (old_rate > 0 && compare_timespec(&proc->next_event, &now) <= 0)
+    return 0;
+  /* Interarrival times are memoryless: the wait for the next event can
+     be redrawn at the new rate, instead of waiting for an event drawn at
+     the old rate. */
+  proc->next_event = now;
+  timespec_add_sec(&proc->next_event, poisson_interarrival(proc->rate));
+  return _schedule_next(proc, &now);
+}
+
+/* Sets the rate of all processes of the current thread. */
+void poisson_set_rate_all(double poisson_rate)
+{
+  for (unsigned int process_id = 0; process_id < _next_process_id; process_id++)
+    poisson_set_rate(_processes[process_id], poisson_rate);
+}
+
+/* Turns the process into a merged-stream scheduler. */
+int poisson_set_merged(struct poisson_process* proc)
+{
+  if (proc == NULL || proc->started) {
+    return -1;
+  }
+  proc->merged = 1;
+  proc->absolute = 1;
+  return 0;
+}
+
+/* Schedules events of the process against absolute intended times. */
+int poisson_set_absolute(struct poisson_process* proc)
+{
+  if (proc == NULL || proc->started) {
+    return -1;
+  }
+  proc->absolute = 1;
   return 0;
 }
 
@@ -139,21 +249,26 @@ int poisson_set_rate(struct poisson_process* proc, double poisson_rate)
    delay according to the poisson process. */
 int poisson_start_process(struct poisson_process* proc, struct timeval* initial_delay)
 {
-  struct timeval poisson_delay;
+  struct timespec now;
   if (proc == NULL) {
     return -1;
   }
+  proc->started = 1;
+  /* Keep track of the absolute time of the next event. */
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  proc->next_event = now;
   if (initial_delay != NULL) {
-    return event_add(proc->event, initial_delay);
+    timespec_add_sec(&proc->next_event, initial_delay->tv_sec + initial_delay->tv_usec / 1000000.);
+  } else if (proc->rate > 0) {
+    timespec_add_sec(&proc->next_event, poisson_interarrival(proc->rate));
   } else {
-    generate_poisson_interarrival(&poisson_delay, proc->rate);
-    return event_add(proc->event, &poisson_delay);
+    /* Paused until a positive rate is set. */
+    return 0;
   }
+  return _schedule_next(proc, &now);
 }
 
 unsigned int poisson_nb_processes()
 {
-  if (_next_process_id == 0)
-    return 0;
-  return _next_process_id - 1;
+  return _next_process_id;
 }
@@ -16,12 +16,27 @@ struct poisson_process {
   double rate;
   /* libevent base */
   struct event_base* evbase;
+  /* Whether this process is a merged-stream scheduler, see
+     poisson_set_merged(). */
+  char merged;
+  /* Whether events are scheduled against absolute intended times, see
+     poisson_set_absolute(). */
+  char absolute;
+  /* Whether the process has been started. */
+  char started;
+  /* Absolute time (CLOCK_MONOTONIC) at which the next event is due. */
+  struct timespec next_event;
+  /* Intended time (CLOCK_MONOTONIC) of the event being handled.  Can be
+     used by the callback to measure how late the event loop is. */
+  struct timespec current_event;
 };
 
 
 /* Initialize the Poisson framework.  The number of Poisson processes is
    indicative, and should be set to the expected number of processes to
-   avoid needless memory reallocations. */
+   avoid needless memory reallocations.  The framework state is
+   thread-local: each thread must call this function (and
+   poisson_destroy()) to manage its own set of processes. */
 int poisson_init(size_t nb_poisson_processes);
 
 /* Stop all events, and optionally free all callback arguments. */
@@ -37,10 +52,38 @@ int poisson_remove(char free_callback_arg);
 /* Sets the callback that will be called at Poisson-spaced time intervals */
 int poisson_set_callback(struct poisson_process* process, callback_fn callback, void* callback_arg);
 
+/* Sets the rate of the process, in events/second.  The new rate applies
+   immediately: the wait for the next event is redrawn at the new rate
+   (unless the event is already due).  A rate of 0 pauses the process
+   until a positive rate is set. */
 int poisson_set_rate(struct poisson_process* process, double poisson_rate);
 
+/* Sets the rate of all processes of the current thread. */
+void poisson_set_rate_all(double poisson_rate);
+
+/* Turns the process into a merged-stream scheduler.  Must be called
+   before starting the process.
+
+   Instead of running one libevent timer per Poisson process, a single
+   process drives the aggregate rate (a superposition of Poisson processes
+   is itself a Poisson process).  On each wakeup, the callback is called
+   once for every event that is due, and the timer is rearmed for the next
+   event, so that timer churn is O(1) regardless of the rate.  Events of
+   a merged-stream scheduler are always scheduled against absolute
+   intended times. */
+int poisson_set_merged(struct poisson_process* process);
+
+/* Schedules events against absolute intended times: each event is due
+   one interarrival time after the intended time of the previous event,
+   instead of after the moment the previous callback actually ran.  When
+   the event loop is busy, delays no longer add up, and late events are
+   sent as soon as possible to catch up with the target rate.  Must be
+   called before starting the process. */
+int poisson_set_absolute(struct poisson_process* process);
+
 /* Starts the process.  If [initial_delay] is NULL, generate an initial
    delay according to the poisson process. */
 int poisson_start_process(struct poisson_process* process, struct timeval* initial_delay);
 
+/* Returns the number of processes of the current thread. */
 unsigned int poisson_nb_processes();
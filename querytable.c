@@ -0,0 +1,170 @@
+#include <stdlib.h>
+
+#include "querytable.h"
+#include "counters.h"
+
+
+/* Tick of the timeout wheel matching [time] (CLOCK_MONOTONIC) */
+static uint64_t _tick(const struct timespec *time)
+{
+  return ((uint64_t) time->tv_sec * 1000 + time->tv_nsec / 1000000) / QUERY_TIMEOUT_TICK_MSEC;
+}
+
+static void _lose_query(struct query_tracker *tracker, struct outstanding_query *query)
+{
+  RELAXED_ADD(tracker->lost, 1);
+  if (tracker->lost_cb != NULL)
+    tracker->lost_cb(query->owner, tracker->lost_ctx);
+}
+
+static void _expire_query(struct timer_wheel_entry *entry, void *ctx)
+{
+  struct query_tracker *tracker = ctx;
+  struct outstanding_query *query = (struct outstanding_query *) entry;
+  query->state = QUERY_TIMED_OUT;
+  _lose_query(tracker, query);
+}
+
+/* Runs every tick while queries are pending. */
+static void _tracker_tick(evutil_socket_t fd, short events, void *ctx)
+{
+  struct query_tracker *tracker = ctx;
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  timer_wheel_advance(&tracker->wheel, _tick(&now), _expire_query, tracker);
+  if (tracker->wheel.count == 0)
+    event_del(tracker->event);
+}
+
+int query_tracker_init(struct query_tracker *tracker, struct event_base *base,
+		       uint32_t table_size, unsigned int timeout_ms,
+		       void (*lost_cb)(uint32_t owner, void *ctx), void *lost_ctx)
+{
+  struct timespec now;
+  if (table_size == 0 || table_size > QUERY_TABLE_MAX_SIZE || (table_size & (table_size - 1)) != 0)
+    return -1;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  timer_wheel_init(&tracker->wheel, _tick(&now));
+  tracker->event = event_new(base, -1, EV_PERSIST, _tracker_tick, tracker);
+  if (tracker->event == NULL)
+    return -1;
+  tracker->table_size = table_size;
+  tracker->timeout.tv_sec = timeout_ms / 1000;
+  tracker->timeout.tv_nsec = (timeout_ms % 1000) * 1000000;
+  /* Round up, so that queries never time out early. */
+  tracker->timeout_ticks = (timeout_ms + QUERY_TIMEOUT_TICK_MSEC - 1) / QUERY_TIMEOUT_TICK_MSEC + 1;
+  atomic_init(&tracker->sent, 0);
+  atomic_init(&tracker->answered, 0);
+  atomic_init(&tracker->lost, 0);
+  atomic_init(&tracker->late, 0);
+  atomic_init(&tracker->duplicate, 0);
+  atomic_init(&tracker->mismatched, 0);
+  tracker->lost_cb = lost_cb;
+  tracker->lost_ctx = lost_ctx;
+  return 0;
+}
+
+void query_tracker_free(struct query_tracker *tracker)
+{
+  if (tracker->event != NULL)
+    event_free(tracker->event);
+  tracker->event = NULL;
+}
+
+uint64_t query_tracker_pending(struct query_tracker *tracker)
+{
+  /* Not the size of the wheel, which is only safe to read from the
+     thread of the tracker. */
+  uint64_t lost = atomic_load_explicit(&tracker->lost, memory_order_relaxed);
+  uint64_t answered = atomic_load_explicit(&tracker->answered, memory_order_relaxed);
+  uint64_t sent = atomic_load_explicit(&tracker->sent, memory_order_relaxed);
+  /* Counters are read one at a time, while they are being updated. */
+  return sent > answered + lost ? sent - answered - lost : 0;
+}
+
+int query_table_init(struct query_table *table, struct query_tracker *tracker, uint32_t owner)
+{
+  /* Zeroed: all slots are free, and their timers are not in the wheel. */
+  table->slots = calloc(tracker->table_size, sizeof(struct outstanding_query));
+  table->next_seq = 0;
+  if (table->slots == NULL)
+    return -1;
+  for (uint32_t i = 0; i < tracker->table_size; i++)
+    table->slots[i].owner = owner;
+  return 0;
+}
+
+void query_table_free(struct query_table *table)
+{
+  free(table->slots);
+  table->slots = NULL;
+}
+
+struct outstanding_query *query_table_send(struct query_table *table, struct query_tracker *tracker,
+					   const struct timespec *intended, const struct timespec *now)
+{
+  struct outstanding_query *query = &table->slots[table->next_seq & (tracker->table_size - 1)];
+  struct timeval interval = {0, QUERY_TIMEOUT_TICK_MSEC * 1000};
+  uint64_t tick = _tick(now);
+  if (query->state == QUERY_PENDING) {
+    /* More queries in flight than the table holds: give up on the
+       oldest one. */
+    timer_wheel_remove(&tracker->wheel, &query->timeout);
+    _lose_query(tracker, query);
+  }
+  query->seq = table->next_seq++;
+  query->intended = *intended;
+  query->sent = *now;
+  query->state = QUERY_PENDING;
+  RELAXED_ADD(tracker->sent, 1);
+  if (tracker->wheel.count == 0) {
+    timer_wheel_reset(&tracker->wheel, tick);
+    event_add(tracker->event, &interval);
+  }
+  timer_wheel_add(&tracker->wheel, &query->timeout, tick + tracker->timeout_ticks);
+  return query;
+}
+
+/* Returns 1 if [now] is past the timeout of [query], 0 otherwise. */
+static int _is_late(struct query_tracker *tracker, struct outstanding_query *query,
+		    const struct timespec *now)
+{
+  time_t sec = now->tv_sec - query->sent.tv_sec - tracker->timeout.tv_sec;
+  long nsec = now->tv_nsec - query->sent.tv_nsec - tracker->timeout.tv_nsec;
+  while (nsec < 0) {
+    nsec += 1000000000;
+    sec--;
+  }
+  return sec > 0 || (sec == 0 && nsec > 0);
+}
+
+int query_table_answer(struct query_table *table, struct query_tracker *tracker, uint16_t id,
+		       const struct timespec *now, struct outstanding_query **query)
+{
+  struct outstanding_query *slot = &table->slots[id & (tracker->table_size - 1)];
+  if (slot->state == QUERY_FREE || (uint16_t) slot->seq != id) {
+    RELAXED_ADD(tracker->mismatched, 1);
+    return ANSWER_MISMATCH;
+  }
+  if (slot->state == QUERY_PENDING && _is_late(tracker, slot, now)) {
+    /* The wheel has a resolution of one tick: expire it right away. */
+    timer_wheel_remove(&tracker->wheel, &slot->timeout);
+    _expire_query(&slot->timeout, tracker);
+  }
+  switch (slot->state) {
+  case QUERY_PENDING:
+    timer_wheel_remove(&tracker->wheel, &slot->timeout);
+    slot->state = QUERY_ANSWERED;
+    RELAXED_ADD(tracker->answered, 1);
+    *query = slot;
+    return ANSWER_ON_TIME;
+  case QUERY_TIMED_OUT:
+    slot->state = QUERY_ANSWERED;
+    RELAXED_ADD(tracker->late, 1);
+    *query = slot;
+    return ANSWER_LATE;
+  default:
+    RELAXED_ADD(tracker->duplicate, 1);
+    return ANSWER_DUPLICATE;
+  }
+}
@@ -0,0 +1,113 @@
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <event2/event.h>
+
+#include "timerwheel.h"
+
+/* Outstanding-query table: each connection numbers its queries with a
+   64-bit sequence number, and keeps them in a table of slots indexed by
+   the low bits of the sequence number.  The DNS ID of a query is the low
+   16 bits of its sequence number, so the table size is a power of two,
+   at most 65536, and the slot of an answer is found from its ID alone.
+   Each pending query has a timeout in a timer wheel shared by all
+   connections of a thread (the tracker), and every answer is classified
+   against the state of its slot. */
+#define QUERY_TABLE_MAX_SIZE 65536
+
+/* Resolution of query timeouts */
+#define QUERY_TIMEOUT_TICK_MSEC 10
+
+/* State of a slot */
+#define QUERY_FREE 0
+#define QUERY_PENDING 1
+#define QUERY_ANSWERED 2
+#define QUERY_TIMED_OUT 3
+
+/* Classification of an answer */
+#define ANSWER_ON_TIME 0
+/* Answer to a query that already timed out */
+#define ANSWER_LATE 1
+/* Second answer to the same query */
+#define ANSWER_DUPLICATE 2
+/* The ID does not match any query of the table */
+#define ANSWER_MISMATCH 3
+
+struct outstanding_query {
+  /* Must be the first member, to find the query from its timer. */
+  struct timer_wheel_entry timeout;
+  uint64_t seq;
+  /* When the query should have been sent, according to the Poisson
+     schedule, and when it was actually sent (CLOCK_MONOTONIC). */
+  struct timespec intended;
+  struct timespec sent;
+  uint8_t state;
+  /* Owner of the table, as given to query_table_init() */
+  uint32_t owner;
+};
+
+struct query_table {
+  struct outstanding_query *slots;
+  uint64_t next_seq;
+};
+
+/* Timeouts and counters of all tables of a thread.  Counters are only
+   updated by that thread, but may be read by others. */
+struct query_tracker {
+  struct timer_wheel wheel;
+  /* Advances the wheel, only runs while queries are pending. */
+  struct event *event;
+  uint32_t table_size;
+  struct timespec timeout;
+  uint64_t timeout_ticks;
+  /* Queries sent, and answered before their timeout */
+  _Atomic uint64_t sent;
+  _Atomic uint64_t answered;
+  /* Queries that got no answer before their timeout, or whose slot was
+     needed by a new query while they were still pending. */
+  _Atomic uint64_t lost;
+  _Atomic uint64_t late;
+  _Atomic uint64_t duplicate;
+  _Atomic uint64_t mismatched;
+  /* Called with the owner of its table for each query counted as lost,
+     unless NULL.  It may run in the middle of query_table_send() or
+     query_table_answer() on that table, so it must not use it. */
+  void (*lost_cb)(uint32_t owner, void *ctx);
+  void *lost_ctx;
+};
+
+/* Sets up a tracker for tables of [table_size] slots (a power of two, at
+   most QUERY_TABLE_MAX_SIZE), with timeouts of [timeout_ms] milliseconds
+   driven by [base], and [lost_cb] (may be NULL) called with [lost_ctx]
+   for each lost query.  Returns 0 on success, -1 otherwise. */
+int query_tracker_init(struct query_tracker *tracker, struct event_base *base,
+		       uint32_t table_size, unsigned int timeout_ms,
+		       void (*lost_cb)(uint32_t owner, void *ctx), void *lost_ctx);
+
+void query_tracker_free(struct query_tracker *tracker);
+
+/* Returns the number of queries still waiting for an answer (and not
+   timed out yet).  May be called from any thread. */
+uint64_t query_tracker_pending(struct query_tracker *tracker);
+
+/* [owner] identifies the table for the lost_cb of [tracker].  Returns 0
+   on success, -1 otherwise. */
+int query_table_init(struct query_table *table, struct query_tracker *tracker, uint32_t owner);
+
+/* Frees a table.  The timeouts of its pending queries stay in the wheel
+   of the tracker, so tables are only freed along with their tracker. */
+void query_table_free(struct query_table *table);
+
+/* Returns the next query of [table], sent at [now] (which starts its
+   timeout) and intended for [intended].  Its DNS ID is the low 16 bits
+   of its sequence number. */
+struct outstanding_query *query_table_send(struct query_table *table, struct query_tracker *tracker,
+					   const struct timespec *intended, const struct timespec *now);
+
+/* Classifies an answer with DNS ID [id] received at [now], and returns
+   ANSWER_ON_TIME, ANSWER_LATE, ANSWER_DUPLICATE or ANSWER_MISMATCH.
+   Answers after the timeout of their query are late, even if the wheel
+   has not expired it yet.  For on-time and late answers, [query] is set
+   to the query being answered. */
+int query_table_answer(struct query_table *table, struct query_tracker *tracker, uint16_t id,
+		       const struct timespec *now, struct outstanding_query **query);
@@ -0,0 +1,154 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include "rttlog.h"
+
+/* How long the writer thread sleeps when all rings are empty. */
+#define RTTLOG_WRITER_SLEEP_USEC 1000
+
+
+static int _write_all(int fd, const char *buf, size_t len)
+{
+  ssize_t ret;
+  while (len > 0) {
+    ret = write(fd, buf, len);
+    if (ret == -1) {
+      if (errno == EINTR)
+	continue;
+      return -1;
+    }
+    buf += ret;
+    len -= ret;
+  }
+  return 0;
+}
+
+/* Writes all records currently available in the ring, in at most two
+   chunks (the ring may wrap around).  Returns the number of records
+   written. */
+static uint64_t _drain_ring(int fd, struct rttlog_ring *ring)
+{
+  uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+  uint64_t start, count, chunk;
+  count = head - tail;
+  if (count == 0)
+    return 0;
+  start = tail & (RTTLOG_RING_SIZE - 1);
+  chunk = count;
+  if (start + chunk > RTTLOG_RING_SIZE)
+    chunk = RTTLOG_RING_SIZE - start;
+  if (_write_all(fd, (char*) &ring->records[start], chunk * sizeof(struct rttlog_record)) != 0
+      || _write_all(fd, (char*) &ring->records[0], (count - chunk) * sizeof(struct rttlog_record)) != 0) {
+    perror("Failed to write RTT log");
+  }
+  atomic_store_explicit(&ring->tail, head, memory_order_release);
+  return count;
+}
+
+static void *_writer_main(void *ctx)
+{
+  struct rttlog *log = ctx;
+  uint64_t written;
+  int stopping;
+  while (1) {
+    /* Read the flag before draining, so that nothing appended before
+       rttlog_close() is missed. */
+    stopping = atomic_load(&log->stopping);
+    written = 0;
+    for (unsigned int i = 0; i < log->nb_rings; i++)
+      written += _drain_ring(log->fd, &log->rings[i]);
+    if (stopping)
+      break;
+    if (written == 0)
+      usleep(RTTLOG_WRITER_SLEEP_USEC);
+  }
+  return NULL;
+}
+
+struct rttlog *rttlog_open(const char *path, unsigned int nb_producers)
+{
+  struct rttlog *log = calloc(1, sizeof(struct rttlog));
+  int ret;
+  if (log == NULL)
+    return NULL;
+  log->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (log->fd == -1) {
+    perror("Failed to open RTT log");
+    free(log);
+    return NULL;
+  }
+  if (_write_all(log->fd, RTTLOG_MAGIC, RTTLOG_MAGIC_LEN) != 0) {
+    perror("Failed to write RTT log");
+    goto error;
+  }
+  log->nb_rings = nb_producers;
+  log->rings = calloc(nb_producers, sizeof(struct rttlog_ring));
+  if (log->rings == NULL) {
+    fprintf(stderr, "Failed to allocate RTT log rings\n");
+    goto error;
+  }
+  for (unsigned int i = 0; i < nb_producers; i++) {
+    log->rings[i].records = malloc(RTTLOG_RING_SIZE * sizeof(struct rttlog_record));
+    if (log->rings[i].records == NULL) {
+      fprintf(stderr, "Failed to allocate RTT log ring buffer\n");
+      goto error;
+    }
+    atomic_init(&log->rings[i].head, 0);
+    atomic_init(&log->rings[i].tail, 0);
+    atomic_init(&log->rings[i].dropped, 0);
+  }
+  atomic_init(&log->stopping, 0);
+  ret = pthread_create(&log->writer, NULL, _writer_main, log);
+  if (ret != 0) {
+    fprintf(stderr, "Failed to create RTT log writer thread: %s\n", strerror(ret));
+    goto error;
+  }
+  return log;
+
+ error:
+  /* Rings are zeroed by calloc(): unallocated buffers are NULL. */
+  if (log->rings != NULL) {
+    for (unsigned int i = 0; i < nb_producers; i++)
+      free(log->rings[i].records);
+    free(log->rings);
+  }
+  close(log->fd);
+  free(log);
+  return NULL;
+}
+
+void rttlog_append(struct rttlog *log, unsigned int producer, const struct rttlog_record *record)
+{
+  struct rttlog_ring *ring = &log->rings[producer];
+  uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+  if (head - tail >= RTTLOG_RING_SIZE) {
+    atomic_store_explicit(&ring->dropped,
+			  atomic_load_explicit(&ring->dropped, memory_order_relaxed) + 1,
+			  memory_order_relaxed);
+    return;
+  }
+  ring->records[head & (RTTLOG_RING_SIZE - 1)] = *record;
+  atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+uint64_t rttlog_close(struct rttlog *log)
+{
+  uint64_t dropped = 0;
+  atomic_store(&log->stopping, 1);
+  pthread_join(log->writer, NULL);
+  close(log->fd);
+  for (unsigned int i = 0; i < log->nb_rings; i++) {
+    dropped += atomic_load(&log->rings[i].dropped);
+    free(log->rings[i].records);
+  }
+  free(log->rings);
+  free(log);
+  return dropped;
+}
@@ -0,0 +1,68 @@
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+/* Binary log of queries and answers, as a compact alternative to the CSV
+   output of option -R.  The event loop appends fixed-size records to a
+   lock-free ring buffer, and a background thread writes them to disk in
+   large chunks.  Use rttlog2csv to convert a log file back to CSV. */
+
+/* Written at the beginning of the file, followed by records. */
+#define RTTLOG_MAGIC "RTTLOG01"
+#define RTTLOG_MAGIC_LEN 8
+
+/* Number of records in each ring buffer (must be a power of two). */
+#define RTTLOG_RING_SIZE (1 << 18)
+
+#define RTTLOG_TYPE_QUERY 'Q'
+#define RTTLOG_TYPE_ANSWER 'A'
+
+/* Fixed-size record, written as-is in the log file (host byte order). */
+struct rttlog_record {
+  /* CLOCK_REALTIME, in nanoseconds since the epoch */
+  uint64_t timestamp_ns;
+  uint32_t connection_id;
+  uint32_t query_id;
+  /* Queries only */
+  uint32_t poisson_id;
+  /* Answers only */
+  uint32_t rtt_us;
+  uint32_t schedule_lag_us;
+  /* RTTLOG_TYPE_QUERY or RTTLOG_TYPE_ANSWER */
+  uint8_t type;
+  uint8_t padding[3];
+};
+
+/* Single-producer single-consumer ring buffer.  Each thread producing
+   records has its own ring, so that producers never contend. */
+struct rttlog_ring {
+  struct rttlog_record *records;
+  /* Only written by the producer */
+  _Atomic uint64_t head;
+  /* Only written by the consumer (writer thread) */
+  _Atomic uint64_t tail;
+  /* Records dropped because the ring was full, only written by the
+     producer. */
+  _Atomic uint64_t dropped;
+};
+
+struct rttlog {
+  int fd;
+  pthread_t writer;
+  _Atomic int stopping;
+  unsigned int nb_rings;
+  struct rttlog_ring *rings;
+};
+
+/* Opens (and truncates) the log file, and starts the writer thread.
+   [nb_producers] is the number of threads that will append records.
+   Returns NULL in case of failure. */
+struct rttlog *rttlog_open(const char *path, unsigned int nb_producers);
+
+/* Appends a record to the ring of the given producer.  Never blocks: if
+   the writer thread lags behind, the record is dropped and counted. */
+void rttlog_append(struct rttlog *log, unsigned int producer, const struct rttlog_record *record);
+
+/* Writes all remaining records, stops the writer thread and closes the
+   file.  Returns the total number of dropped records. */
+uint64_t rttlog_close(struct rttlog *log);
@@ -0,0 +1,57 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rttlog.h"
+
+/* Converts a binary RTT log (option --rtt-log of the clients) to the CSV
+   format printed by option -R. */
+
+/* Number of records read at once. */
+#define BATCH_SIZE 4096
+
+int main(int argc, char** argv)
+{
+  static struct rttlog_record records[BATCH_SIZE];
+  char magic[RTTLOG_MAGIC_LEN];
+  size_t nb_records;
+  FILE *log;
+
+  if (argc != 2) {
+    fprintf(stderr, "usage: %s <rtt_log_file>\n", argv[0]);
+    fprintf(stderr, "Converts a binary RTT log to CSV, printed on stdout.\n");
+    return 1;
+  }
+  log = fopen(argv[1], "rb");
+  if (log == NULL) {
+    perror("Failed to open RTT log");
+    return 1;
+  }
+  if (fread(magic, 1, RTTLOG_MAGIC_LEN, log) != RTTLOG_MAGIC_LEN
+      || memcmp(magic, RTTLOG_MAGIC, RTTLOG_MAGIC_LEN) != 0) {
+    fprintf(stderr, "Error: %s is not an RTT log file\n", argv[1]);
+    return 1;
+  }
+
+  printf("type,timestamp,connection_id,query_id,poisson_id,poisson_interval_us,rtt_us,schedule_lag_us\n");
+  while ((nb_records = fread(records, sizeof(struct rttlog_record), BATCH_SIZE, log)) > 0) {
+    for (size_t i = 0; i < nb_records; i++) {
+      struct rttlog_record *r = &records[i];
+      if (r->type == RTTLOG_TYPE_QUERY) {
+	printf("Q,%lu.%.9lu,%u,%u,%u,,,%u\n",
+	       r->timestamp_ns / 1000000000, r->timestamp_ns % 1000000000,
+	       r->connection_id, r->query_id, r->poisson_id,
+	       r->schedule_lag_us);
+      } else if (r->type == RTTLOG_TYPE_ANSWER) {
+	printf("A,%lu.%.9lu,%u,%u,,,%u,%u\n",
+	       r->timestamp_ns / 1000000000, r->timestamp_ns % 1000000000,
+	       r->connection_id, r->query_id,
+	       r->rtt_us, r->schedule_lag_us);
+      } else {
+	fprintf(stderr, "Warning: skipping record with unknown type %u\n", r->type);
+      }
+    }
+  }
+  fclose(log);
+  return 0;
+}
@@ -4,7 +4,9 @@
 #include <getopt.h>
 #include <string.h>
 #include <errno.h>
+#include <limits.h>
 #include <math.h>
+#include <pthread.h>
 #include <arpa/inet.h>
 #include <event2/event.h>
 #include <event2/buffer.h>
@@ -14,6 +16,7 @@
 #include <sys/time.h>
 #include <sys/resource.h>
 #include <sys/socket.h>
+#include <sys/eventfd.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <netdb.h>
@@ -21,112 +24,408 @@
 #include <openssl/ssl.h>
 
 #include "common.h"
+#include "addrlist.h"
+#include "uring.h"
 
+/* Maximum number of worker threads (-T option). */
+#define MAX_THREADS 1024
+
+/* Default maximum number of connections being established at the same
+   time, on each worker (--max-connecting option). */
+#define MAX_CONNECTING_DEFAULT 1000
+
+/* Default fraction of connections that must be up before sending
+   queries (--ready-fraction), and default maximum time to wait for them,
+   in seconds (--ready-timeout). */
+#define READY_FRACTION_DEFAULT 1.0
+#define READY_TIMEOUT_DEFAULT 60
+
+/* Interval at which workers check whether load generation can start. */
+#define READY_CHECK_USEC 10000
+
+/* Minimum interval between two runs of the connection ramp-up timer.  At
+   high connection rates, several connections are started on each run. */
+#define RAMP_TICK_USEC 1000
+
+/* Size of a query, including its length prefix */
+#define QUERY_SIZE 31
+
+/* libevent engine: maximum number of queries written by a single
+   sendmsg() call when flushing the queries of a tick. */
+#define FLUSH_IOVECS 64
+
+/* Closed loop (--concurrency): maximum number of queries in flight per
+   connection. */
+#define MAX_CONCURRENCY 32768
+
+/* Number of chains of the input buffer looked at, at once, when framing
+   answers.  Must be at least 4, so that a message header always fits. */
+#define PEEK_IOVECS 16
+
+/* State of a TCP connection */
+#define CONN_CONNECTING 1
+#define CONN_UP         2
+#define CONN_FAILED     3
+#define CONN_CLOSED     4
+
+/* I/O engines (-E option) */
+#define ENGINE_LIBEVENT 0
+#define ENGINE_URING    1
+
+/* io_uring engine: size of the submission queue, provided receive
+   buffers (the number of buffers must be a power of two), and size of
+   the buffers used for sends.  All are per worker. */
+#define URING_ENTRIES 4096
+#define URING_NB_BUFFERS 4096
+#define URING_BUFFER_SIZE 4096
+#define URING_SEND_SIZE 4096
+
+/* io_uring engine: the type of request is stored in the upper 32 bits of
+   user_data, and the index of the connection in its worker in the lower
+   32 bits. */
+#define URING_RECV 1
+#define URING_SEND 2
+#define URING_USER_DATA(_type, _conn) (((uint64_t) (_type) << 32) | (uint32_t) (_conn))
+#define URING_TYPE(_user_data) ((_user_data) >> 32)
+#define URING_CONN(_user_data) ((uint32_t) ((_user_data) & 0xffffffff))
+
+struct worker;
 
 struct tcp_connection {
   /* The actual connection, encapsulated in a bufferevent. */
   struct bufferevent *bev;
   /* Optional openssl context */
   SSL *ssl;
-  /* ID of the connection, mostly for logging purpose. */
+  /* ID of the connection, mostly for logging purpose.  Unique across
+     all worker threads. */
   uint32_t connection_id;
-  /* Current query ID, incremented for each query and used to index the
-     query_timestamps array. */
-  uint16_t query_id;
-  /* Used to remember when we sent the last [max_queries_in_flight]
-     queries, to compute a RTT. */
-  struct timespec* query_timestamps;
+  /* Queries sent on this connection that may still get an answer. */
+  struct query_table queries;
+  /* Worker thread handling this connection. */
+  struct worker *worker;
+  /* CONN_CONNECTING, CONN_UP, CONN_FAILED or CONN_CLOSED */
+  short state;
+  /* Index of this connection in the up_connections array of its worker,
+     only valid when the connection is up. */
+  uint32_t up_index;
+  /* io_uring engine: received data not framed yet, queries not sent yet,
+     buffer of the send in flight (NULL if none) and its length, and
+     whether the connection is in the dirty list of its worker. */
+  struct evbuffer *rx;
+  struct evbuffer *tx;
+  char *tx_slot;
+  int tx_len;
+  char dirty;
+  /* libevent engine: queries staged during the current tick, as a list
+     in the staged array of the worker (1 + index of the first and last
+     query, 0 if none). */
+  uint32_t staged_head;
+  uint32_t staged_tail;
+};
+
+/* Closed loop with a think time: query to send on [conn] at [due]. */
+struct think_entry {
+  struct tcp_connection *conn;
+  struct timespec due;
+};
+
+/* Query staged until the end of the tick (libevent engine) */
+struct staged_query {
+  /* 1 + index of the next query of the same connection, 0 if none */
+  uint32_t next;
+  char data[QUERY_SIZE];
+};
+
+/* Each worker thread runs its own event loop, with its own shard of TCP
+   connections and its own Poisson processes.  Both the connections and
+   the query rate are split evenly across workers. */
+struct worker {
+  unsigned int worker_id;
+  pthread_t thread;
+  /* Shard of TCP connections handled by this worker. */
+  struct tcp_connection *connections;
+  struct bufferevent **bufevents;
+  uint32_t nb_conn;
+  /* Global ID of the first connection of the shard. */
+  uint32_t first_conn_id;
+  /* Connections that are currently up: queries are only sent on them.
+     Their number is also read by live statistics, along with the number
+     of connections that went down. */
+  struct tcp_connection **up_connections;
+  _Atomic uint32_t nb_up;
+  _Atomic uint32_t nb_closed;
+  /* Connection ramp-up: number of connections started so far, number of
+     connections currently being established, and outcome. */
+  uint32_t nb_started;
+  uint32_t nb_connecting;
+  uint32_t nb_connected;
+  _Atomic uint32_t nb_failed;
+  struct timespec ramp_start;
+  struct event *ramp_event;
+  /* Number of Poisson processes started by this worker. */
+  unsigned int nb_poisson_processes;
+  /* Counters, only updated by the worker thread itself, but also read by
+     the capacity search and by live statistics. */
+  _Atomic unsigned long queries_sent;
+  _Atomic unsigned long answers_received;
+  _Atomic unsigned long bytes_received;
+  /* RTTs of all answers received by this worker (--hist). */
+  struct histogram rtt_histogram;
+  /* Schedule lag of all queries sent by this worker (live statistics) */
+  struct histogram lag_histogram;
+  /* Timeouts of the queries of all connections, and loss counters */
+  struct query_tracker tracker;
+  /* io_uring engine state: the ring signals completions through
+     ring_fd, which is watched by the event loop. */
+  struct uring ring;
+  struct uring_buf_ring buf_ring;
+  int ring_fd;
+  struct event *ring_event;
+  /* Connections with queries queued during the current tick, sent
+     together by flush_event at the end of the tick. */
+  struct event *flush_event;
+  struct tcp_connection **dirty;
+  uint32_t nb_dirty;
+  /* libevent engine: queries staged during the current tick, and
+     statistics about the writes that sent them. */
+  struct staged_query *staged;
+  uint32_t nb_staged;
+  uint32_t staged_size;
+  unsigned long nb_direct_writes;
+  unsigned long direct_bytes;
+  unsigned long deferred_bytes;
+  /* Closed loop: whether queries are being sent, queries waiting for the
+     end of their think time (a FIFO, since the think time is fixed), and
+     how long queries were sent for. */
+  short closed_loop_running;
+  struct think_entry *thinking;
+  uint32_t think_head;
+  uint32_t nb_thinking;
+  uint32_t think_size;
+  struct event *think_event;
+  struct timespec load_start;
+  struct timespec load_end;
+  /* Send buffers that are not in flight (at most one per connection). */
+  char **free_slots;
+  uint32_t nb_free_slots;
+  /* Statistics, kept after the ring is torn down. */
+  unsigned long nb_completions;
+  unsigned long nb_enter;
 };
 
 struct callback_data {
   struct poisson_process* process;
-  struct tcp_connection* connections;
+  struct worker* worker;
 };
 
-/* Array of all TCP connections */
-struct tcp_connection *connections;
+static struct worker *workers;
+static unsigned int nb_threads = 1;
+/* Worker of the current thread. */
+static __thread struct worker *current_worker;
+/* Synchronises all workers before they start sending queries. */
+static pthread_barrier_t connected_barrier;
+/* Connection readiness across all workers: number of connections that
+   are up (TCP connected or TLS handshake complete) and that failed. */
+static _Atomic unsigned long int global_nb_connected;
+static _Atomic unsigned long int global_nb_failed;
+/* Set by the first worker that decides that load generation can start:
+   1 to start, -1 to give up. */
+static _Atomic int load_start_decision;
+/* Startup time, used as the deadline reference for --ready-timeout. */
+static struct timespec startup_time;
 
-/* Like sleep(), blocks for the given number of seconds, but run the event
-   loop in the meantime. */
-static void event_sleep(unsigned int seconds)
-{
-  struct timeval tv;
-  tv.tv_sec = seconds;
-  tv.tv_usec = 0;
-  event_base_loopexit(base, &tv);
-  event_base_dispatch(base);
-}
+/* Parameters shared (read-only) by all workers. */
+/* Server endpoints (host and port pairs), used in turn by successive
+   connections. */
+struct server_endpoint {
+  struct sockaddr_storage addr;
+  socklen_t len;
+};
+static struct server_endpoint *servers;
+static unsigned int nb_servers;
+static short use_tls = 0;
+/* libevent engine: coalesce the queries of a tick (disabled with TLS). */
+static short use_coalescing = 1;
+/* Closed loop (--concurrency): number of queries kept in flight on each
+   connection (0 for the open-loop Poisson schedule), and time between an
+   answer and the next query, in microseconds (--think-time). */
+static unsigned int concurrency = 0;
+static unsigned long int think_time = 0;
+static int engine = ENGINE_LIBEVENT;
+/* Whether we use a single merged-stream Poisson scheduler per thread. */
+static short use_merged = 0;
+static SSL_CTX *ssl_ctx = NULL;
+static unsigned long int duration = 0;
+static unsigned long int new_conn_rate = 1000;
+/* Maximum number of connections being established at the same time, on
+   each worker. */
+static unsigned long int max_connecting = MAX_CONNECTING_DEFAULT;
+/* Start sending queries once this fraction of connections is up and
+   either every connection has succeeded or failed, or the ready timeout
+   has expired. */
+static double ready_fraction = READY_FRACTION_DEFAULT;
+/* Local source addresses, used in turn by successive connections
+   (--bind option). */
+static short use_bind = 0;
+static struct addrlist bind_addresses;
+static unsigned long int ready_timeout = READY_TIMEOUT_DEFAULT;
+static unsigned long int random_seed = 42;
+/* Interval between two new connections on a given worker, in microseconds. */
+static unsigned long int new_conn_interval;
+/* Total number of Poisson processes, across all workers. */
+static unsigned int nb_poisson_processes;
+/* Initial total query rate, across all workers. */
+static unsigned int initial_query_rate;
+static unsigned int nb_commands;
+static struct command *commands;
+static struct rateslope_command *rateslope_commands;
 
-static void event_usleep(unsigned int usec)
+static void closed_loop_answered(struct tcp_connection *conn);
+
+/* Copies [len] bytes at offset [offset] of the chains [vec] into [dst],
+   where [*index] is a chain that starts at or before [offset], at offset
+   [*vec_start].  Moves [*index] and [*vec_start] to the chain that
+   contains [offset].  Returns 0 if the chains end before [len] bytes. */
+static int peek_copy(const struct evbuffer_iovec *vec, int nvec, int *index, size_t *vec_start,
+		     size_t offset, unsigned char *dst, size_t len)
 {
-  struct timeval tv;
-  tv.tv_sec = usec / 1000000;
-  tv.tv_usec = usec % 1000000;
-  event_base_loopexit(base, &tv);
-  event_base_dispatch(base);
+  int i;
+  size_t start, pos, chunk;
+  while (*index < nvec && offset >= *vec_start + vec[*index].iov_len) {
+    *vec_start += vec[*index].iov_len;
+    (*index)++;
+  }
+  i = *index;
+  start = *vec_start;
+  while (len > 0) {
+    if (i == nvec)
+      return 0;
+    pos = offset - start;
+    chunk = vec[i].iov_len - pos < len ? vec[i].iov_len - pos : len;
+    memcpy(dst, (char*) vec[i].iov_base + pos, chunk);
+    dst += chunk;
+    offset += chunk;
+    len -= chunk;
+    start += vec[i].iov_len;
+    i++;
+  }
+  return 1;
 }
 
-static void readcb(struct bufferevent *bev, void *ctx)
+/* Accounts for all complete DNS messages in [input], received on the
+   given connection, and leaves any incomplete message in place.  Shared
+   by all I/O engines.  Messages are framed in place, through the chains
+   of the buffer, and drained all at once. */
+static void process_answers(struct tcp_connection *params, struct evbuffer *input)
 {
-  struct tcp_connection *params = ctx;
-  unsigned char* input_ptr;
+  struct evbuffer_iovec vec[PEEK_IOVECS];
+  int nvec, index;
+  size_t vec_start;
+  unsigned char header[4];
+  /* Offset of the current message in [input] */
+  size_t offset = 0;
   uint16_t dns_len;
   uint16_t query_id;
-  struct timespec* query_timestamp;
-  struct timespec now, rtt;
+  struct outstanding_query *query;
+  int outcome;
+  struct timespec now, rtt, lag;
   /* Used for logging, because "now" uses a monotonic clock. */
   struct timespec now_realtime;
-  /* Retrieve response (or mirrored message), and make sure it is a
-     complete DNS message.  We retrieve the query ID to compute the
-     RTT. */
-  struct evbuffer *input = bufferevent_get_input(bev);
-  debug("Entering readcb\n");
-  /* Loop until we cannot read a complete DNS message. */
-  while (1) {
-    if (print_rtt) {
-      clock_gettime(CLOCK_MONOTONIC, &now);
-      clock_gettime(CLOCK_REALTIME, &now_realtime);
+  /* Retrieve responses (or mirrored messages), and make sure they are
+     complete DNS messages.  We retrieve the query ID to compute the
+     RTT.  All of them were received at the same time. */
+  struct worker *worker = params->worker;
+  size_t input_len = evbuffer_get_length(input);
+  if (input_len < 4) {
+    if (input_len > 0) {
+      debug("Short read with size %lu, aborting for now\n", input_len);
     }
-    size_t input_len = evbuffer_get_length(input);
-    if (input_len < 4) {
-      if (input_len > 0) {
-	debug("Short read with size %lu, aborting for now\n", input_len);
+    return;
+  }
+  /* Needed to classify answers, even without RTTs. */
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if (print_rtt) {
+    clock_gettime(CLOCK_REALTIME, &now_realtime);
+  }
+  nvec = evbuffer_peek(input, -1, NULL, vec, PEEK_IOVECS);
+  if (nvec > PEEK_IOVECS)
+    nvec = PEEK_IOVECS;
+  index = 0;
+  vec_start = 0;
+  /* Loop until we cannot read a complete DNS message. */
+  while (input_len - offset >= 4) {
+    if (!peek_copy(vec, nvec, &index, &vec_start, offset, header, 4)) {
+      if (offset > 0) {
+	/* The header is past the chains we looked at: drop the messages
+	   handled so far, and look at the next chains. */
+	evbuffer_drain(input, offset);
+	input_len -= offset;
+	offset = 0;
+	nvec = evbuffer_peek(input, -1, NULL, vec, PEEK_IOVECS);
+	if (nvec > PEEK_IOVECS)
+	  nvec = PEEK_IOVECS;
+	index = 0;
+	vec_start = 0;
+	continue;
       }
-      return;
+      /* Only with lots of tiny chains */
+      evbuffer_copyout(input, header, 4);
     }
-    input_ptr = evbuffer_pullup(input, 4);
-    DO_NTOHS(dns_len, input_ptr);
-    DO_NTOHS(query_id, input_ptr + 2);
+    DO_NTOHS(dns_len, header);
+    DO_NTOHS(query_id, header + 2);
     debug("Input buffer length: %lu ; DNS length: %hu ; Query ID: %hu\n",
-	  input_len, dns_len, query_id);
-    if (input_len < dns_len + 2) {
+	  input_len - offset, dns_len, query_id);
+    if (input_len - offset < dns_len + 2) {
       /* Incomplete message */
       debug("Incomplete DNS reply for query ID %hu (%lu bytes out of %hu), aborting for now\n",
-	    query_id, input_len - 2, dns_len);
-      return;
+	    query_id, input_len - offset - 2, dns_len);
+      break;
     }
     /* We are now certain to have a complete DNS message. */
-    /* Compute RTT, in microseconds */
-    if (print_rtt) {
-      query_timestamp = &params->query_timestamps[query_id % max_queries_in_flight];
-      subtract_timespec(&rtt, &now, query_timestamp);
-      /* CSV format: type (Answer), timestamp at the time of reception
-	 (answer), connection ID, query ID, unused, unused, computed RTT in µs */
-      printf("A,%lu.%.9lu,%u,%u,,,%lu\n",
-	     now_realtime.tv_sec, now_realtime.tv_nsec,
-	     params->connection_id,
-	     query_id,
-	     (rtt.tv_nsec / 1000) + (1000000 * rtt.tv_sec));
+    RELAXED_ADD(worker->answers_received, 1);
+    RELAXED_ADD(worker->bytes_received, dns_len + 2);
+    outcome = query_table_answer(&params->queries, &worker->tracker, query_id, &now, &query);
+    if (outcome == ANSWER_ON_TIME || outcome == ANSWER_LATE) {
+      /* Compute RTT, in microseconds.  Late answers are logged, but not
+	 counted in latency percentiles. */
+      if (print_rtt || use_histogram)
+	subtract_timespec(&rtt, &now, &query->sent);
+      if (use_histogram && outcome == ANSWER_ON_TIME) {
+	histogram_record(&worker->rtt_histogram, (rtt.tv_nsec / 1000) + (1000000 * rtt.tv_sec));
+      }
+      if (print_rtt) {
+	subtract_timespec(&lag, &query->sent, &query->intended);
+	log_answer(worker->worker_id, &now_realtime, params->connection_id, query->seq, &rtt, &lag);
+      }
     }
-    /* Discard the DNS message (including the 2-bytes length prefix) */
-    evbuffer_drain(input, dns_len + 2);
+    /* Skip the DNS message (including the 2-bytes length prefix) */
+    offset += dns_len + 2;
+    /* The slot of a late answer was already freed when its query was
+       lost, see query_lost(). */
+    if (concurrency > 0 && outcome == ANSWER_ON_TIME)
+      closed_loop_answered(params);
   }
+  /* Discard all complete messages at once */
+  evbuffer_drain(input, offset);
+}
+
+static void readcb(struct bufferevent *bev, void *ctx)
+{
+  debug("Entering readcb\n");
+  process_answers(ctx, bufferevent_get_input(bev));
 }
 
-static void send_query(struct tcp_connection* conn)
+static void mark_dirty(struct tcp_connection *conn);
+static void stage_query(struct tcp_connection *conn, const char *query);
+
+/* Sends a query on the given connection.  [intended] is the time at
+   which the query should have been sent, according to the Poisson
+   schedule.  Returns the query, as recorded in the table of the
+   connection. */
+static struct outstanding_query *send_query(struct tcp_connection* conn, const struct timespec *intended)
 {
   /* DNS query for example.com (with type A) */
-  static char data[] = {
+  char data[QUERY_SIZE] = {
     0x00, 0x1d, /* Size */
     0xff, 0xff, /* Query ID */
     0x01, 0x00, 0x00, 0x01, 0x00, 0x00,
@@ -134,110 +433,1162 @@ static void send_query(struct tcp_connection* conn)
     0x6d, 0x70, 0x6c, 0x65, 0x03, 0x63, 0x6f, 0x6d,
     0x00, 0x00, 0x01, 0x00, 0x01
   };
-  struct bufferevent *bev = conn->bev;
-  struct evbuffer *output = bufferevent_get_output(bev);
-  /* Copy query ID */
-  DO_HTONS(data + 2, conn->query_id);
-  /* Record timestamp */
-  clock_gettime(CLOCK_MONOTONIC, &conn->query_timestamps[conn->query_id % max_queries_in_flight]);
-  evbuffer_add(output, data, sizeof(data));
-  conn->query_id += 1;
+  struct outstanding_query *query;
+  struct timespec now;
+  /* Record the query, and use the low bits of its sequence number as ID */
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  query = query_table_send(&conn->queries, &conn->worker->tracker, intended, &now);
+  record_schedule_lag(&conn->worker->lag_histogram, &now, intended);
+  DO_HTONS(data + 2, (uint16_t) query->seq);
+  if (engine == ENGINE_URING) {
+    /* Sent with the other queries of this tick, see uring_flush_queries() */
+    evbuffer_add(conn->tx, data, sizeof(data));
+    mark_dirty(conn);
+  } else if (use_coalescing) {
+    /* Likewise, see flush_queries() */
+    stage_query(conn, data);
+  } else {
+    evbuffer_add(bufferevent_get_output(conn->bev), data, sizeof(data));
+  }
+  RELAXED_ADD(conn->worker->queries_sent, 1);
+  return query;
+}
+
+static void send_query_callback(void *ctx)
+{
+  struct timespec now_realtime, lag;
+  struct tcp_connection *connection;
+  struct outstanding_query *query;
+  struct callback_data *data = ctx;
+  struct worker *worker = data->worker;
+  if (worker->nb_up == 0)
+    return;
+  /* Select a TCP connection of this worker uniformly at random among
+     those that are up, and send a query on it. */
+  connection = worker->up_connections[thread_lrand48() % worker->nb_up];
+  query = send_query(connection, &data->process->current_event);
+  if (print_rtt) {
+    clock_gettime(CLOCK_REALTIME, &now_realtime);
+    subtract_timespec(&lag, &query->sent, &query->intended);
+    /* Poisson IDs are interleaved across workers to keep them unique. */
+    log_query(worker->worker_id, &now_realtime, connection->connection_id, query->seq,
+	      data->process->process_id * nb_threads + worker->worker_id, &lag);
+  }
+}
+
+/* Closed loop: sends a query on [conn] right away. */
+static void closed_loop_send(struct tcp_connection *conn)
+{
+  struct timespec now, now_realtime, lag = {0, 0};
+  struct outstanding_query *query;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  query = send_query(conn, &now);
+  if (print_rtt) {
+    clock_gettime(CLOCK_REALTIME, &now_realtime);
+    log_query(conn->worker->worker_id, &now_realtime, conn->connection_id, query->seq, 0, &lag);
+  }
+}
+
+/* Closed loop: fills the window of a connection that just came up. */
+static void closed_loop_prime(struct tcp_connection *conn)
+{
+  for (unsigned int i = 0; i < concurrency; i++)
+    closed_loop_send(conn);
+}
+
+/* Sends the queries whose think time is over. */
+static void think_time_cb(evutil_socket_t fd, short events, void *ctx)
+{
+  struct worker *worker = ctx;
+  struct think_entry *entry;
+  struct timespec now, delay;
+  struct timeval timeout;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  while (worker->nb_thinking > 0) {
+    entry = &worker->thinking[worker->think_head];
+    if (compare_timespec(&entry->due, &now) > 0) {
+      subtract_timespec(&delay, &entry->due, &now);
+      timespec_to_timeval(&timeout, &delay);
+      event_add(worker->think_event, &timeout);
+      return;
+    }
+    if (entry->conn->state == CONN_UP)
+      closed_loop_send(entry->conn);
+    worker->think_head = (worker->think_head + 1) % worker->think_size;
+    worker->nb_thinking--;
+  }
+}
+
+/* Closed loop: called for each answer, sends the next query on the same
+   connection, right away or after the think time. */
+static void closed_loop_answered(struct tcp_connection *conn)
+{
+  struct worker *worker = conn->worker;
+  struct think_entry *entry;
+  struct timeval timeout = {think_time / 1000000, think_time % 1000000};
+  uint32_t old_size, tail;
+  if (!worker->closed_loop_running || conn->state != CONN_UP)
+    return;
+  if (think_time == 0) {
+    closed_loop_send(conn);
+    return;
+  }
+  if (worker->nb_thinking == worker->think_size) {
+    /* Grow the FIFO, and move its wrapped part after the old end. */
+    old_size = worker->think_size;
+    worker->think_size = old_size == 0 ? 1024 : 2 * old_size;
+    worker->thinking = realloc(worker->thinking, worker->think_size * sizeof(struct think_entry));
+    memcpy(worker->thinking + old_size, worker->thinking, worker->think_head * sizeof(struct think_entry));
+  }
+  tail = (worker->think_head + worker->nb_thinking) % worker->think_size;
+  entry = &worker->thinking[tail];
+  entry->conn = conn;
+  clock_gettime(CLOCK_MONOTONIC, &entry->due);
+  timespec_add_sec(&entry->due, think_time / 1000000.);
+  worker->nb_thinking++;
+  if (worker->nb_thinking == 1)
+    event_add(worker->think_event, &timeout);
+}
+
+static void closed_loop_lost(evutil_socket_t fd, short events, void *ctx)
+{
+  closed_loop_answered(ctx);
+}
+
+/* Closed loop: called by the tracker for each query that timed out, or
+   that was evicted from the table of its connection.  It no longer holds
+   a slot of the window, so it is replaced like an answered query, but
+   from the event loop: the tracker may be sending or answering a query
+   on the same connection. */
+static void query_lost(uint32_t conn_id, void *ctx)
+{
+  struct worker *worker = ctx;
+  struct timeval now = {0, 0};
+  event_base_once(base, -1, EV_TIMEOUT, closed_loop_lost, &worker->connections[conn_id], &now);
+}
+
+static unsigned long thread_queries_sent()
+{
+  return RELAXED_LOAD(current_worker->queries_sent);
+}
+
+static void read_thread_counters(unsigned int thread, struct thread_counters *counters)
+{
+  struct worker *worker = &workers[thread];
+  counters->sent = RELAXED_LOAD(worker->queries_sent);
+  counters->answers = RELAXED_LOAD(worker->answers_received);
+  counters->bytes_sent = counters->sent * QUERY_SIZE;
+  counters->bytes_received = RELAXED_LOAD(worker->bytes_received);
+  counters->conn_up = RELAXED_LOAD(worker->nb_up);
+  counters->conn_down = RELAXED_LOAD(worker->nb_failed) + RELAXED_LOAD(worker->nb_closed);
+}
+
+static unsigned long total_queries_sent()
+{
+  unsigned long total = 0;
+  for (unsigned int i = 0; i < nb_threads; i++)
+    total += RELAXED_LOAD(workers[i].queries_sent);
+  return total;
+}
+
+static void add_poisson_sender()
+{
+  struct poisson_process *process = poisson_new(base);
+  struct callback_data *callback_arg = malloc(sizeof(struct callback_data));
+  callback_arg->process = process;
+  callback_arg->worker = current_worker;
+  poisson_set_callback(process, send_query_callback, callback_arg);
+  poisson_set_rate(process, poisson_rate);
+  if (use_absolute)
+    poisson_set_absolute(process);
+  int ret = poisson_start_process(process, NULL);
+  if (ret != 0) {
+    fprintf(stderr, "Failed to start Poisson process %u\n", process->process_id);
+  }
+}
+
+static void connection_settled(struct worker *worker, int success);
+
+static void add_up_connection(struct tcp_connection *conn)
+{
+  struct worker *worker = conn->worker;
+  conn->up_index = worker->nb_up;
+  worker->up_connections[worker->nb_up++] = conn;
+}
+
+static void remove_up_connection(struct tcp_connection *conn)
+{
+  struct worker *worker = conn->worker;
+  struct tcp_connection *last = worker->up_connections[--worker->nb_up];
+  worker->up_connections[conn->up_index] = last;
+  last->up_index = conn->up_index;
+  RELAXED_ADD(worker->nb_closed, 1);
+}
+
+/* io_uring engine.  Connections are established by libevent as usual,
+   and handed over to the ring of their worker once up.  Queries are
+   queued on their connection, and at the end of each tick, all
+   connections with queued queries are flushed with one send each,
+   submitted together with a single io_uring_enter() call.  Answers are
+   received through multishot receives into a ring of provided buffers,
+   and the ring reports completions to the event loop through an
+   eventfd. */
+
+static void uring_connection_closed(struct tcp_connection *conn, int error);
+
+static void uring_arm_recv(struct tcp_connection *conn)
+{
+  struct worker *worker = conn->worker;
+  struct io_uring_sqe *sqe = uring_get_sqe(&worker->ring);
+  if (sqe == NULL) {
+    /* Submit what is queued, and retry */
+    uring_submit_and_wait(&worker->ring, 0);
+    sqe = uring_get_sqe(&worker->ring);
+  }
+  if (sqe == NULL) {
+    /* The connection would never read answers again: take it down, so
+       that it gets no more queries and is counted as down. */
+    fprintf(stderr, "io_uring submission queue full, closing connection %u\n",
+	    conn->connection_id);
+    shutdown(bufferevent_getfd(conn->bev), SHUT_RDWR);
+    uring_connection_closed(conn, 0);
+    return;
+  }
+  uring_prep_multishot_recv(sqe, bufferevent_getfd(conn->bev), worker->buf_ring.bgid,
+			    URING_USER_DATA(URING_RECV, conn - worker->connections));
+}
+
+/* Hands a connection that just came up over from libevent to the ring. */
+static void uring_attach_connection(struct tcp_connection *conn)
+{
+  bufferevent_disable(conn->bev, EV_READ|EV_WRITE);
+  conn->rx = evbuffer_new();
+  conn->tx = evbuffer_new();
+  uring_arm_recv(conn);
+  uring_submit_and_wait(&conn->worker->ring, 0);
+}
+
+/* Schedules a send on the given connection at the end of the tick.
+   Shared by both engines. */
+static void mark_dirty(struct tcp_connection *conn)
+{
+  struct worker *worker = conn->worker;
+  if (conn->dirty)
+    return;
+  conn->dirty = 1;
+  worker->dirty[worker->nb_dirty++] = conn;
+  if (worker->nb_dirty == 1)
+    event_active(worker->flush_event, EV_TIMEOUT, 0);
+}
+
+/* libevent engine: queues a query on the given connection until the end
+   of the tick. */
+static void stage_query(struct tcp_connection *conn, const char *query)
+{
+  struct worker *worker = conn->worker;
+  struct staged_query *staged;
+  if (worker->nb_staged == worker->staged_size) {
+    worker->staged_size = worker->staged_size == 0 ? 64 : 2 * worker->staged_size;
+    worker->staged = realloc(worker->staged, worker->staged_size * sizeof(struct staged_query));
+  }
+  staged = &worker->staged[worker->nb_staged++];
+  memcpy(staged->data, query, QUERY_SIZE);
+  staged->next = 0;
+  if (conn->staged_head == 0)
+    conn->staged_head = worker->nb_staged;
+  else
+    worker->staged[conn->staged_tail - 1].next = worker->nb_staged;
+  conn->staged_tail = worker->nb_staged;
+  mark_dirty(conn);
+}
+
+/* libevent engine: writes queries to the given connection.  When nothing
+   is waiting in its output buffer, they are written straight to the
+   socket, and only what the socket does not take right away goes
+   through the bufferevent. */
+static void write_queries(struct tcp_connection *conn, struct iovec *iov, int nb_iov)
+{
+  struct worker *worker = conn->worker;
+  struct evbuffer *output = bufferevent_get_output(conn->bev);
+  struct msghdr msg;
+  ssize_t written = 0;
+  size_t len;
+  if (evbuffer_get_length(output) == 0) {
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = nb_iov;
+    written = sendmsg(bufferevent_getfd(conn->bev), &msg, MSG_NOSIGNAL);
+    worker->nb_direct_writes++;
+    /* Errors are reported by the bufferevent, on its next write. */
+    if (written < 0)
+      written = 0;
+    worker->direct_bytes += written;
+  }
+  for (int i = 0; i < nb_iov; i++) {
+    if ((size_t) written >= iov[i].iov_len) {
+      written -= iov[i].iov_len;
+      continue;
+    }
+    len = iov[i].iov_len - written;
+    evbuffer_add(output, (char*) iov[i].iov_base + written, len);
+    worker->deferred_bytes += len;
+    written = 0;
+  }
+}
+
+/* libevent engine: sends the queries staged on all dirty connections,
+   with one write per connection. */
+static void flush_queries(evutil_socket_t fd, short events, void *ctx)
+{
+  struct worker *worker = ctx;
+  struct tcp_connection *conn;
+  struct staged_query *staged;
+  struct iovec iov[FLUSH_IOVECS];
+  int nb_iov;
+  for (uint32_t i = 0; i < worker->nb_dirty; i++) {
+    conn = worker->dirty[i];
+    conn->dirty = 0;
+    nb_iov = 0;
+    /* Queries of connections that went down are dropped. */
+    for (uint32_t q = conn->staged_head; q != 0 && conn->state == CONN_UP; q = staged->next) {
+      staged = &worker->staged[q - 1];
+      iov[nb_iov].iov_base = staged->data;
+      iov[nb_iov].iov_len = QUERY_SIZE;
+      if (++nb_iov == FLUSH_IOVECS) {
+	write_queries(conn, iov, nb_iov);
+	nb_iov = 0;
+      }
+    }
+    if (nb_iov > 0)
+      write_queries(conn, iov, nb_iov);
+    conn->staged_head = 0;
+  }
+  worker->nb_dirty = 0;
+  worker->nb_staged = 0;
+}
+
+/* Sends the queries queued on all dirty connections, and submits them in
+   a single system call (along with any other pending request). */
+static void uring_flush_queries(evutil_socket_t fd, short events, void *ctx)
+{
+  struct worker *worker = ctx;
+  struct tcp_connection *conn;
+  struct io_uring_sqe *sqe;
+  char *slot;
+  for (uint32_t i = 0; i < worker->nb_dirty; i++) {
+    conn = worker->dirty[i];
+    conn->dirty = 0;
+    /* At most one send in flight per connection, so that queries are not
+       reordered: the rest is sent once it completes. */
+    if (conn->tx_slot != NULL || conn->state != CONN_UP || evbuffer_get_length(conn->tx) == 0)
+      continue;
+    /* If the ring is full, queries stay queued until the next flush of
+       this connection. */
+    sqe = uring_get_sqe(&worker->ring);
+    if (sqe == NULL)
+      continue;
+    if (worker->nb_free_slots > 0)
+      slot = worker->free_slots[--worker->nb_free_slots];
+    else
+      slot = malloc(URING_SEND_SIZE);
+    conn->tx_slot = slot;
+    conn->tx_len = evbuffer_remove(conn->tx, slot, URING_SEND_SIZE);
+    uring_prep_send(sqe, bufferevent_getfd(conn->bev), slot, conn->tx_len,
+		    MSG_WAITALL | MSG_NOSIGNAL, URING_USER_DATA(URING_SEND, conn - worker->connections));
+  }
+  worker->nb_dirty = 0;
+  uring_submit_and_wait(&worker->ring, 0);
+}
+
+static void uring_connection_closed(struct tcp_connection *conn, int error)
+{
+  if (error < 0)
+    fprintf(stderr, "Connection error: %s\n", strerror(-error));
+  if (conn->state == CONN_UP) {
+    conn->state = CONN_CLOSED;
+    remove_up_connection(conn);
+  }
+}
+
+static void uring_handle_recv(struct tcp_connection *conn, int res, unsigned int flags)
+{
+  struct worker *worker = conn->worker;
+  uint16_t bid;
+  if (res > 0) {
+    bid = flags >> IORING_CQE_BUFFER_SHIFT;
+    evbuffer_add(conn->rx, uring_buf_ring_buffer(&worker->buf_ring, bid), res);
+    uring_buf_ring_recycle(&worker->buf_ring, bid);
+    process_answers(conn, conn->rx);
+  } else if (res != -ENOBUFS) {
+    uring_connection_closed(conn, res);
+    return;
+  }
+  /* The kernel stops a multishot receive when it runs out of buffers. */
+  if (!(flags & IORING_CQE_F_MORE) && conn->state == CONN_UP)
+    uring_arm_recv(conn);
+}
+
+static void uring_handle_send(struct tcp_connection *conn, int res)
+{
+  struct worker *worker = conn->worker;
+  char *slot = conn->tx_slot;
+  conn->tx_slot = NULL;
+  if (res < 0)
+    uring_connection_closed(conn, res);
+  else if (res < conn->tx_len)
+    /* Should not happen with MSG_WAITALL: send the rest first next time */
+    evbuffer_prepend(conn->tx, slot + res, conn->tx_len - res);
+  worker->free_slots[worker->nb_free_slots++] = slot;
+  if (conn->state == CONN_UP && evbuffer_get_length(conn->tx) > 0)
+    mark_dirty(conn);
+}
+
+/* Called by the event loop when the ring has new completions. */
+static void uring_completion_cb(evutil_socket_t fd, short events, void *ctx)
+{
+  struct worker *worker = ctx;
+  struct io_uring_cqe *cqe;
+  struct tcp_connection *conn;
+  uint64_t value;
+  /* Reset the eventfd before looking at completions, so that none is
+     missed. */
+  if (read(fd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+    perror("Failed to read io_uring eventfd");
+  while ((cqe = uring_peek_cqe(&worker->ring)) != NULL) {
+    worker->nb_completions++;
+    conn = &worker->connections[URING_CONN(cqe->user_data)];
+    if (URING_TYPE(cqe->user_data) == URING_RECV)
+      uring_handle_recv(conn, cqe->res, cqe->flags);
+    else
+      uring_handle_send(conn, cqe->res);
+    uring_cqe_seen(&worker->ring);
+  }
+  /* Submit new sends and re-armed receives */
+  uring_flush_queries(-1, EV_TIMEOUT, worker);
+}
+
+/* Sets up the io_uring engine of the current worker.  Returns 0 on
+   success. */
+static int uring_worker_init(struct worker *worker)
+{
+  int ret;
+  ret = uring_init(&worker->ring, URING_ENTRIES, 0);
+  if (ret < 0) {
+    fprintf(stderr, "Couldn't create io_uring: %s\n", strerror(-ret));
+    return -1;
+  }
+  ret = uring_buf_ring_init(&worker->ring, &worker->buf_ring, 0, URING_NB_BUFFERS, URING_BUFFER_SIZE);
+  if (ret < 0) {
+    fprintf(stderr, "Couldn't register io_uring provided buffers: %s\n", strerror(-ret));
+    return -1;
+  }
+  worker->ring_fd = eventfd(0, EFD_NONBLOCK);
+  ret = uring_register_eventfd(&worker->ring, worker->ring_fd);
+  if (ret < 0) {
+    fprintf(stderr, "Couldn't register io_uring eventfd: %s\n", strerror(-ret));
+    return -1;
+  }
+  worker->ring_event = event_new(base, worker->ring_fd, EV_READ|EV_PERSIST, uring_completion_cb, worker);
+  event_add(worker->ring_event, NULL);
+  worker->flush_event = event_new(base, -1, 0, uring_flush_queries, worker);
+  worker->dirty = calloc(worker->nb_conn, sizeof(struct tcp_connection*));
+  worker->free_slots = calloc(worker->nb_conn, sizeof(char*));
+  return 0;
+}
+
+/* Must be called before free_connections(). */
+static void uring_worker_free(struct worker *worker)
+{
+  struct tcp_connection *conn;
+  event_free(worker->ring_event);
+  event_free(worker->flush_event);
+  worker->nb_enter = worker->ring.nb_enter;
+  uring_buf_ring_free(&worker->ring, &worker->buf_ring);
+  uring_exit(&worker->ring);
+  close(worker->ring_fd);
+  for (uint32_t conn_id = 0; conn_id < worker->nb_conn; conn_id++) {
+    conn = &worker->connections[conn_id];
+    if (conn->rx != NULL)
+      evbuffer_free(conn->rx);
+    if (conn->tx != NULL)
+      evbuffer_free(conn->tx);
+    free(conn->tx_slot);
+  }
+  for (uint32_t i = 0; i < worker->nb_free_slots; i++)
+    free(worker->free_slots[i]);
+  free(worker->free_slots);
+  free(worker->dirty);
+}
+
+static void eventcb(struct bufferevent *bev, short events, void *ptr)
+{
+  struct tcp_connection *conn = ptr;
+  struct worker *worker = conn->worker;
+  if (events & BEV_EVENT_CONNECTED) {
+    /* TCP connection established, or TLS handshake completed. */
+    if (conn->state == CONN_CONNECTING) {
+      conn->state = CONN_UP;
+      add_up_connection(conn);
+      /* May tear the connection down again if the ring is full */
+      if (engine == ENGINE_URING)
+	uring_attach_connection(conn);
+      if (worker->closed_loop_running && conn->state == CONN_UP)
+	closed_loop_prime(conn);
+      worker->nb_connecting--;
+      connection_settled(worker, 1);
+    }
+    return;
+  }
+  if (events & BEV_EVENT_ERROR) {
+    perror("Connection error");
+  }
+  if (events & (BEV_EVENT_EOF | BEV_EVENT_ERROR)) {
+    if (conn->state == CONN_CONNECTING) {
+      conn->state = CONN_FAILED;
+      worker->nb_connecting--;
+      connection_settled(worker, 0);
+    } else if (conn->state == CONN_UP) {
+      conn->state = CONN_CLOSED;
+      remove_up_connection(conn);
+    }
+    bufferevent_disable(bev, EV_READ|EV_WRITE);
+  }
+}
+
+/* Create an event base for the current thread, with custom options. */
+static struct event_base *new_event_base()
+{
+  struct event_config *ev_cfg;
+  struct event_base *ev_base;
+  ev_cfg = event_config_new();
+  if (!ev_cfg) {
+    fprintf(stderr, "Couldn't allocate event base config\n");
+    return NULL;
+  }
+  int flags = 0;
+  /* Small performance boost: locks are useless since each event base is
+     only used by a single thread. */
+  flags |= EVENT_BASE_FLAG_NOLOCK;
+  /* epoll performance improvement */
+  flags |= EVENT_BASE_FLAG_EPOLL_USE_CHANGELIST;
+  /* Prevent libevent from using CLOCK_MONOTONIC_COARSE (introduced in
+     libevent 2.1.5) */
+#if LIBEVENT_VERSION_NUMBER >= 0x02010500
+    flags |= EVENT_BASE_FLAG_PRECISE_TIMER;
+#else
+    info("Warning: libevent before 2.1.5 has very low timer resolution (1 ms)\n");
+    info("Warning: You will likely obtain bursty request patterns\n");
+#endif
+  event_config_set_flag(ev_cfg, flags);
+  ev_base = event_base_new_with_config(ev_cfg);
+  event_config_free(ev_cfg);
+  if (!ev_base) {
+    fprintf(stderr, "Couldn't create event base\n");
+    return NULL;
+  }
+  return ev_base;
+}
+
+/* Starts a non-blocking connection to the server.  Completion is
+   reported to eventcb(). */
+static void start_connection(struct worker *worker, uint32_t conn_id)
+{
+  struct tcp_connection *conn = &worker->connections[conn_id];
+  const struct server_endpoint *server;
+  struct bufferevent *bev;
+  int sock;
+  int on = 1;
+  int ret;
+  SSL *ssl = NULL;
+
+  conn->connection_id = worker->first_conn_id + conn_id;
+  conn->worker = worker;
+  conn->state = CONN_FAILED;
+  server = &servers[conn->connection_id % nb_servers];
+  errno = 0;
+  sock = socket(server->addr.ss_family, SOCK_STREAM, 0);
+  if (sock == -1) {
+    perror("Failed to create socket");
+    connection_settled(worker, 0);
+    return;
+  }
+  ret = evutil_make_socket_nonblocking(sock);
+  if (ret != 0) {
+    perror("Failed to set socket to non-blocking mode");
+    close(sock);
+    connection_settled(worker, 0);
+    return;
+  }
+  /* Disable Nagle */
+  setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+  if (use_bind) {
+    /* Pick the source address, but let the kernel choose the source port
+       at connect time: ports are then only unique per (source, destination)
+       pair instead of per source address.  Connections cycle through all
+       servers before moving to the next source address, so that every
+       (source, server) pair is used. */
+    struct sockaddr_storage local;
+    socklen_t local_len;
+    local_len = addrlist_get(&bind_addresses, conn->connection_id / nb_servers, 0, &local);
+    setsockopt(sock, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &on, sizeof(on));
+    ret = bind(sock, (struct sockaddr*)&local, local_len);
+    if (ret != 0) {
+      perror("Failed to bind to source address");
+      close(sock);
+      connection_settled(worker, 0);
+      return;
+    }
+  }
+
+  if (use_tls) {
+    ssl = SSL_new(ssl_ctx);
+    if (ssl == NULL) {
+      perror("Failed to initialise openssl object");
+      close(sock);
+      connection_settled(worker, 0);
+      return;
+    }
+    /* The TLS handshake starts as soon as the socket is writable, i.e.
+       once the TCP connection is established. */
+    ret = connect(sock, (struct sockaddr*)&server->addr, server->len);
+    if (ret != 0 && errno != EINPROGRESS) {
+      perror("Failed to connect to host");
+      SSL_free(ssl);
+      close(sock);
+      connection_settled(worker, 0);
+      return;
+    }
+    bev = bufferevent_openssl_socket_new(base, sock, ssl, BUFFEREVENT_SSL_CONNECTING,
+					 BEV_OPT_DEFER_CALLBACKS | BEV_OPT_CLOSE_ON_FREE);
+  } else {
+    bev = bufferevent_socket_new(base, sock, BEV_OPT_CLOSE_ON_FREE);
+  }
+  if (bev == NULL) {
+    perror("Failed to create socket-based bufferevent");
+    if (ssl != NULL)
+      SSL_free(ssl);
+    close(sock);
+    connection_settled(worker, 0);
+    return;
+  }
+
+  worker->bufevents[conn_id] = bev;
+  conn->ssl = ssl;
+  conn->bev = bev;
+  query_table_init(&conn->queries, &worker->tracker, conn_id);
+  conn->state = CONN_CONNECTING;
+  worker->nb_connecting++;
+  bufferevent_setcb(bev, readcb, NULL, eventcb, conn);
+  bufferevent_enable(bev, EV_READ|EV_WRITE);
+
+  if (!use_tls) {
+    ret = bufferevent_socket_connect(bev, (struct sockaddr*)&server->addr, server->len);
+    if (ret != 0) {
+      /* eventcb() may or may not have been called already */
+      if (conn->state == CONN_CONNECTING) {
+	perror("Failed to connect to host");
+	conn->state = CONN_FAILED;
+	worker->nb_connecting--;
+	connection_settled(worker, 0);
+      }
+    }
+  }
+}
+
+/* Stops the ramp-up timer once all connections have been started. */
+static void check_ramp_done(struct worker *worker)
+{
+  if (worker->ramp_event == NULL || worker->nb_started < worker->nb_conn)
+    return;
+  event_free(worker->ramp_event);
+  worker->ramp_event = NULL;
+}
+
+/* Decides, based on the readiness of connections across all workers,
+   whether load generation can start.  Returns the decision: 0 if we must
+   keep waiting, 1 to start, -1 to give up. */
+static int check_load_start()
+{
+  struct timespec now, elapsed;
+  unsigned long int nb_up, nb_failed;
+  int decision = 0, expected = 0;
+  int deadline_reached;
+
+  if (load_start_decision != 0)
+    return load_start_decision;
+  nb_up = global_nb_connected;
+  nb_failed = global_nb_failed;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  subtract_timespec(&elapsed, &now, &startup_time);
+  deadline_reached = ready_timeout > 0 && elapsed.tv_sec >= ready_timeout;
+  if (nb_up == nb_conn) {
+    decision = 1;
+  } else if (nb_up + nb_failed == nb_conn || deadline_reached) {
+    /* No point in waiting any longer */
+    if (nb_up > 0 && (double) nb_up >= ready_fraction * (double) nb_conn)
+      decision = 1;
+    else
+      decision = -1;
+  }
+  if (decision == 0 || !atomic_compare_exchange_strong(&load_start_decision, &expected, decision))
+    return load_start_decision;
+
+  /* We are the worker that took the decision, log it. */
+  if (decision == 1) {
+    info("Ready to send queries after %lu.%.3lu s: %lu/%u connections up, %lu failed, %lu pending\n",
+	 elapsed.tv_sec, elapsed.tv_nsec / 1000000, nb_up, nb_conn, nb_failed,
+	 nb_conn - nb_up - nb_failed);
+    if (nb_failed > 0)
+      fprintf(stderr, "Warning: %lu connections failed to come up\n", nb_failed);
+  } else {
+    fprintf(stderr, "Error: only %lu/%u connections up after %lu.%.3lu s (%lu failed, ready fraction %.3f)\n",
+	    nb_up, nb_conn, elapsed.tv_sec, elapsed.tv_nsec / 1000000, nb_failed, ready_fraction);
+  }
+  return decision;
+}
+
+/* Records the outcome of a connection attempt, locally and globally. */
+static void connection_settled(struct worker *worker, int success)
+{
+  if (success) {
+    worker->nb_connected++;
+    global_nb_connected++;
+  } else {
+    worker->nb_failed++;
+    global_nb_failed++;
+  }
+  check_ramp_done(worker);
+  if (load_start_decision == 0 && check_load_start() != 0)
+    event_base_loopbreak(base);
+}
+
+/* Periodically checks whether other workers decided to start the load,
+   or whether the ready timeout expired. */
+static void ready_tick(evutil_socket_t fd, short events, void *ctx)
+{
+  if (check_load_start() != 0)
+    event_base_loopbreak(base);
+}
+
+/* Periodically starts new connections, paced by [new_conn_rate] and
+   limited to [max_connecting] connections being established at the same
+   time. */
+static void ramp_tick(evutil_socket_t fd, short events, void *ctx)
+{
+  struct worker *worker = ctx;
+  struct timespec now, elapsed;
+  uint64_t due;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  subtract_timespec(&elapsed, &now, &worker->ramp_start);
+  /* How many connections should have been started by now */
+  due = 1 + (elapsed.tv_sec * 1000000 + elapsed.tv_nsec / 1000) / new_conn_interval;
+  while (worker->nb_started < worker->nb_conn && worker->nb_started < due
+	 && worker->nb_connecting < max_connecting) {
+    start_connection(worker, worker->nb_started);
+    worker->nb_started++;
+    /* Progress output, roughly once per second */
+    if (worker->nb_started % new_conn_rate == 0)
+      debug("[thread %u] Started %u connections so far (%u connected, %u failed)...\n",
+	    worker->worker_id, worker->nb_started, worker->nb_connected, worker->nb_failed);
+  }
+  check_ramp_done(worker);
+}
+
+/* Opens the shard of TCP connections of the given worker, running the
+   event loop until load generation can start.  Connections that are
+   still pending at that point keep being established in the background.
+   Returns the load start decision (see check_load_start()). */
+static int open_connections(struct worker *worker)
+{
+  struct timeval tick = {0, 0};
+  struct timeval ready_check = {0, READY_CHECK_USEC};
+  struct event *ready_event;
+
+  worker->bufevents = calloc(worker->nb_conn, sizeof(struct bufferevent*));
+  worker->connections = calloc(worker->nb_conn, sizeof(struct tcp_connection));
+  worker->up_connections = calloc(worker->nb_conn, sizeof(struct tcp_connection*));
+  clock_gettime(CLOCK_MONOTONIC, &worker->ramp_start);
+  timeval_add_us(&tick, new_conn_interval > RAMP_TICK_USEC ? new_conn_interval : RAMP_TICK_USEC);
+  worker->ramp_event = event_new(base, -1, EV_PERSIST, ramp_tick, worker);
+  event_add(worker->ramp_event, &tick);
+  ready_event = event_new(base, -1, EV_PERSIST, ready_tick, worker);
+  event_add(ready_event, &ready_check);
+  ramp_tick(-1, EV_TIMEOUT, worker);
+  if (check_load_start() == 0)
+    event_base_dispatch(base);
+  event_free(ready_event);
+
+  debug("[thread %u] %u connections up, %u failed, %u pending, %u not started yet\n",
+	worker->worker_id, worker->nb_connected, worker->nb_failed,
+	worker->nb_connecting, worker->nb_conn - worker->nb_started);
+  return check_load_start();
+}
+
+static void free_connections(struct worker *worker)
+{
+  if (worker->ramp_event != NULL)
+    event_free(worker->ramp_event);
+  for (unsigned long int conn_id = 0; conn_id < worker->nb_conn; conn_id++) {
+    if (worker->bufevents[conn_id] == NULL)
+      continue;
+    /* With BEV_OPT_CLOSE_ON_FREE, this also frees the SSL object. */
+    bufferevent_free(worker->bufevents[conn_id]);
+    query_table_free(&worker->connections[conn_id].queries);
+  }
+  free(worker->bufevents);
+  free(worker->connections);
+  free(worker->up_connections);
+}
+
+static void *worker_main(void *ctx)
+{
+  struct worker *worker = ctx;
+  struct timeval initial_timeout;
+  struct timeval duration_timeval;
+  struct poisson_process *process;
+  struct callback_data *callback_arg;
+  int ret;
+
+  current_worker = worker;
+  thread_srand48(random_seed + worker->worker_id);
+  base = new_event_base();
+  if (base == NULL) {
+    exit(1);
+  }
+  /* Before the start barrier, see stats_start() below */
+  if (query_tracker_init(&worker->tracker, base, query_table_size, query_timeout,
+			 concurrency > 0 ? query_lost : NULL, worker) != 0) {
+    fprintf(stderr, "Failed to set up query timeouts\n");
+    exit(1);
+  }
+  if (nb_poisson_processes > 0 && !use_merged) {
+    rate_share = (double) worker->nb_poisson_processes / (double) nb_poisson_processes;
+  } else {
+    rate_share = 1. / (double) nb_threads;
+  }
+  poisson_init(use_merged ? 1 : worker->nb_poisson_processes);
+  if (stdin_commands == 1) {
+    /* Set initial rate for each Poisson process */
+    poisson_rate = (double) commands[0].query_rate / (double) nb_poisson_processes;
+  }
+  if (engine == ENGINE_URING && uring_worker_init(worker) != 0) {
+    exit(1);
+  }
+  if (engine == ENGINE_LIBEVENT && use_coalescing) {
+    worker->flush_event = event_new(base, -1, 0, flush_queries, worker);
+    worker->dirty = calloc(worker->nb_conn, sizeof(struct tcp_connection*));
+  }
+
+  /* Wait until enough connections are up (or the ready timeout expired),
+     across all workers. */
+  if (open_connections(worker) != 1) {
+    exit(1);
+  }
+
+  /* Make sure all workers start sending queries at the same time. */
+  pthread_barrier_wait(&connected_barrier);
+  clock_gettime(CLOCK_MONOTONIC, &worker->load_start);
+
+  if (concurrency > 0) {
+    /* Closed loop: no Poisson process, answers trigger new queries. */
+    debug("[thread %u] Keeping %u queries in flight on %u connections...\n",
+	  worker->worker_id, concurrency, worker->nb_up);
+    worker->think_event = event_new(base, -1, 0, think_time_cb, worker);
+    worker->closed_loop_running = 1;
+    for (uint32_t i = 0; i < worker->nb_up; i++)
+      closed_loop_prime(worker->up_connections[i]);
+  }
+
+  if (concurrency > 0) {
+    /* Nothing to schedule */
+  } else if (use_merged) {
+    /* A single process drives the aggregate rate of this worker.  Its
+       first wait is drawn at that rate, and it starts paused if the
+       first rate is 0. */
+    merged_process = poisson_new(base);
+    callback_arg = malloc(sizeof(struct callback_data));
+    callback_arg->process = merged_process;
+    callback_arg->worker = worker;
+    poisson_set_merged(merged_process);
+    poisson_set_callback(merged_process, send_query_callback, callback_arg);
+    poisson_set_rate(merged_process, rate_share * initial_query_rate);
+    debug("[thread %u] Starting merged-stream scheduler at %f qps...\n",
+	  worker->worker_id, merged_process->rate);
+    ret = poisson_start_process(merged_process, NULL);
+    if (ret != 0) {
+      fprintf(stderr, "Failed to start merged-stream scheduler\n");
+    }
+  } else {
+    debug("[thread %u] Starting %u Poisson processes generating queries...\n",
+	  worker->worker_id, worker->nb_poisson_processes);
+  }
+  for (int i = 0; !use_merged && i < worker->nb_poisson_processes; i++) {
+    generate_poisson_interarrival(&initial_timeout, poisson_rate);
+    debug("initial timeout %ld s %ld us\n", initial_timeout.tv_sec, initial_timeout.tv_usec);
+    process = poisson_new(base);
+    callback_arg = malloc(sizeof(struct callback_data));
+    callback_arg->process = process;
+    callback_arg->worker = worker;
+    poisson_set_callback(process, send_query_callback, callback_arg);
+    poisson_set_rate(process, poisson_rate);
+    if (use_absolute)
+      poisson_set_absolute(process);
+    ret = poisson_start_process(process, &initial_timeout);
+    if (ret != 0) {
+      fprintf(stderr, "Failed to start Poisson process %u\n", process->process_id);
+    }
+  }
+
+  /* Rate slopes change the rate of the schedulers themselves. */
+  if (stdin_rateslope_commands == 0 && concurrency == 0)
+    rate_controller_start(rate_share * initial_query_rate);
+  /* Worker 0 drives the capacity search, other workers follow it. */
+  if (search.slo_us > 0 && worker->worker_id == 0)
+    search_start();
+
+  /* Worker 0 prints periodic RTT summaries for all workers, starting
+     when queries are sent. */
+  if (use_histogram && worker->worker_id == 0) {
+    start_rtt_histogram_reports(-1, EV_TIMEOUT, NULL);
+  }
+  /* Likewise for live statistics.  They read the trackers of all
+     workers, which are set up before the start barrier. */
+  if (use_stats && worker->worker_id == 0)
+    stats_start();
+
+  /* Schedule stop event. */
+  if (duration > 0) {
+    duration_timeval.tv_sec = duration;
+    duration_timeval.tv_usec = 0;
+    if (concurrency == 0)
+      start_phase();
+    event_base_once(base, -1, EV_TIMEOUT, end_of_run, NULL, &duration_timeval);
+  }
+
+  /* Schedule changes of query rate. */
+  if (stdin_commands == 1) {
+    struct timeval delay_timeval = {0, 0};
+    struct event *change_rate_ev;
+    for (int i = 0; i < nb_commands; ++i) {
+      change_rate_ev = event_new(base, -1, 0, change_query_rate, &commands[i]);
+      event_add(change_rate_ev, &delay_timeval);
+      timeval_add_ms(&delay_timeval, commands[i].duration_ms);
+    }
+    event_base_once(base, -1, EV_TIMEOUT, end_of_run, NULL, &delay_timeval);
+  }
+
+  /* Schedule changes of query rate slope. */
+  if (stdin_rateslope_commands == 1) {
+    struct timeval delay_timeval = {0, 0};
+    struct event *change_rate_slope_ev;
+    for (int i = 0; i < nb_commands; ++i) {
+      change_rate_slope_ev = event_new(base, -1, 0, change_query_rate_slope, &rateslope_commands[i]);
+      event_add(change_rate_slope_ev, &delay_timeval);
+      timeval_add_ms(&delay_timeval, rateslope_commands[i].duration_ms);
+    }
+    event_base_loopexit(base, &delay_timeval);
+  }
+
+  debug("[thread %u] Starting event loop\n", worker->worker_id);
+  event_base_dispatch(base);
+  clock_gettime(CLOCK_MONOTONIC, &worker->load_end);
+
+  rate_controller_stop();
+  if (search.slo_us > 0 && worker->worker_id == 0)
+    search_stop();
+  if (use_stats && worker->worker_id == 0)
+    stats_stop();
+  if (use_histogram && worker->worker_id == 0)
+    stop_rtt_histogram_reports();
+  if (concurrency > 0) {
+    event_free(worker->think_event);
+    free(worker->thinking);
+  }
+  if (engine == ENGINE_URING)
+    uring_worker_free(worker);
+  if (engine == ENGINE_LIBEVENT && use_coalescing) {
+    event_free(worker->flush_event);
+    free(worker->dirty);
+    free(worker->staged);
+  }
+  free_connections(worker);
+  query_tracker_free(&worker->tracker);
+  poisson_destroy(1);
+  event_base_free(base);
+  return NULL;
 }
 
-static void send_query_callback(void *ctx)
+/* Print per-thread counters, and the merged total. */
+static void print_worker_stats()
 {
-  static struct timespec now_realtime;
-  struct tcp_connection *connection;
-  struct callback_data *data = ctx;
-  /* Select a TCP connection uniformly at random and send a query on it. */
-  connection = &data->connections[lrand48() % nb_conn];
-  if (print_rtt) {
-    clock_gettime(CLOCK_REALTIME, &now_realtime);
-    /* CSV format: type (Query), timestamp, connection ID, query ID, Poisson ID, poisson interval (in µs), unused. */
-    printf("Q,%lu.%.9lu,%u,%u,%u,,\n",
-	   now_realtime.tv_sec, now_realtime.tv_nsec,
-	   connection->connection_id,
-	   connection->query_id,
-	   data->process->process_id);
+  unsigned long total_sent = 0, total_received = 0;
+  struct timespec elapsed;
+  double duration;
+  for (unsigned int i = 0; i < nb_threads; i++) {
+    info("Thread %u: %u connections (%u failed, %u up at the end), %lu queries sent, %lu answers received\n",
+	 i, workers[i].nb_conn, workers[i].nb_failed, workers[i].nb_up,
+	 workers[i].queries_sent, workers[i].answers_received);
+    if (engine == ENGINE_URING)
+      info("Thread %u: %lu io_uring completions for %lu io_uring_enter() calls\n",
+	   i, workers[i].nb_completions, workers[i].nb_enter);
+    if (engine == ENGINE_LIBEVENT && use_coalescing)
+      info("Thread %u: %.3f direct writes per query, %.0f bytes per direct write, %lu bytes left to bufferevents\n",
+	   i, workers[i].queries_sent == 0 ? 0. : (double) workers[i].nb_direct_writes / workers[i].queries_sent,
+	   workers[i].nb_direct_writes == 0 ? 0. : (double) workers[i].direct_bytes / workers[i].nb_direct_writes,
+	   workers[i].deferred_bytes);
+    total_sent += workers[i].queries_sent;
+    total_received += workers[i].answers_received;
+  }
+  info("Total: %lu queries sent, %lu answers received\n", total_sent, total_received);
+  print_query_counters(total_sent);
+  if (concurrency > 0) {
+    /* Threads start together, and run for the same duration. */
+    subtract_timespec(&elapsed, &workers[0].load_end, &workers[0].load_start);
+    duration = elapsed.tv_sec + elapsed.tv_nsec / 1000000000.;
+    fprintf(stderr, "Closed loop: %u queries in flight per connection, think time %lu us: %.0f answers per second\n",
+	    concurrency, think_time, duration > 0 ? total_received / duration : 0.);
   }
-  send_query(connection);
 }
 
-static void add_poisson_sender()
+/* Resolves [host], and checks that we can connect to it on [port] with a
+   blocking connect.  Stores the first working address into [server].
+   Returns 0 on success, -1 on failure. */
+static int resolve_server(const char *host, uint16_t port, struct server_endpoint *server)
 {
-  struct poisson_process *process = poisson_new(base);
-  struct callback_data *callback_arg = malloc(sizeof(struct callback_data));
-  callback_arg->process = process;
-  callback_arg->connections = connections;
-  poisson_set_callback(process, send_query_callback, callback_arg);
-  poisson_set_rate(process, poisson_rate);
-  int ret = poisson_start_process(process, NULL);
+  struct addrinfo hints;
+  struct addrinfo *res_list, *res;
+  char port_s[NI_MAXSERV];
+  char host_s[NI_MAXHOST];
+  int sock;
+  int ret;
+
+  memset(&hints, 0, sizeof(struct addrinfo));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = 0;
+  hints.ai_protocol = 0;
+
+  snprintf(port_s, NI_MAXSERV, "%u", port);
+  ret = getaddrinfo(host, port_s, &hints, &res_list);
   if (ret != 0) {
-    fprintf(stderr, "Failed to start Poisson process %u\n", process->process_id);
+    fprintf(stderr, "Error in getaddrinfo: %s\n", gai_strerror(ret));
+    return -1;
   }
-}
 
-static void eventcb(struct bufferevent *bev, short events, void *ptr)
-{
-  if (events & BEV_EVENT_ERROR) {
-    perror("Connection error");
+  for (res = res_list; res != NULL; res = res->ai_next) {
+    /* Source addresses must belong to the same family as the server. */
+    if (use_bind && !addrlist_has_only_family(&bind_addresses, res->ai_family))
+      continue;
+    sock = socket(res->ai_family, res->ai_socktype,
+		  res->ai_protocol);
+    if (sock == -1)
+      continue;
+
+    getnameinfo(res->ai_addr, res->ai_addrlen, host_s, NI_MAXHOST,
+		NULL, 0, NI_NUMERICHOST);
+    info("Trying to connect to %s port %s...\n", host_s, port_s);
+    if (connect(sock, res->ai_addr, res->ai_addrlen) != -1) {
+      info("Success!\n");
+      close(sock);
+      break;
+    } else {
+      perror("Failed to connect");
+      close(sock);
+    }
+  }
+
+  /* No address succeeded */
+  if (res == NULL) {
+    if (use_bind)
+      fprintf(stderr, "Note: only server addresses of the same family as --bind addresses are tried\n");
+    fprintf(stderr, "Could not connect to host %s\n", host);
+    freeaddrinfo(res_list);
+    return -1;
   }
+
+  /* Copy working server */
+  memset(server, 0, sizeof(struct server_endpoint));
+  memcpy(&server->addr, res->ai_addr, res->ai_addrlen);
+  server->len = res->ai_addrlen;
+  freeaddrinfo(res_list);
+  return 0;
 }
 
 void usage(char* progname) {
-  fprintf(stderr, "usage: %s [-h] [-v] [-R] [-s random_seed] [-t duration]  [--stdin]  [--stdin-rateslope]  [--tls]  [-n new_conn_rate]  -p <port>  -r <rate>  -c <nb_conn>  <host>\n",
+  fprintf(stderr, "usage: %s [-h] [-v] [-R] [-s random_seed] [-t duration]  [-T threads]  [-E engine]  [--stdin]  [--stdin-rateslope]  [--merged]  [--absolute]  [--hist interval]  [--rtt-log file]  [--tls]  [-n new_conn_rate]  [--max-connecting n]  [--ready-fraction f]  [--ready-timeout s]  [--bind addr-list|CIDR]  [--no-coalesce]  [--concurrency k [--think-time us]]  [--search p99_us [--search-loss f] [--search-step s] [--search-warmup s]]  [--timeout ms]  [--stats ms]  [--stats-port port]  -p <port|first_port-last_port>  -r <rate>  -c <nb_conn>  <host[,host...]>\n",
 	  progname);
   fprintf(stderr, "Connects to the specified host and port, with the chosen number of TCP or TLS connections.\n");
+  fprintf(stderr, "With several hosts and/or a port range, connections are spread round-robin across all (host, port) endpoints.\n");
   fprintf(stderr, "[rate] is the total number of writes per second towards the server, accross all TCP connections.\n");
   fprintf(stderr, "Each write is 31 bytes.\n");
   fprintf(stderr, "[new_conn_rate] is the number of new connections to open per second when starting the client.\n");
+  fprintf(stderr, "Connections are established asynchronously, with at most [--max-connecting] connections\n");
+  fprintf(stderr, "(TCP or TLS handshakes) in progress at the same time on each thread (default %d).\n", MAX_CONNECTING_DEFAULT);
+  fprintf(stderr, "Queries are sent as soon as all connections are up.  Otherwise, once all connections have either\n");
+  fprintf(stderr, "succeeded or failed, or after [--ready-timeout] seconds (default %d, 0 to wait forever), queries are\n", READY_TIMEOUT_DEFAULT);
+  fprintf(stderr, "sent if at least [--ready-fraction] of the connections are up (default %.1f), and the client exits otherwise.\n", READY_FRACTION_DEFAULT);
+  fprintf(stderr, "With option '--bind', connections use the given local source addresses in turn, for instance\n");
+  fprintf(stderr, "'127.0.0.0/8' or '::1,fd00::/112', to open more connections than ephemeral ports allow.\n");
+  fprintf(stderr, "With option '--concurrency', queries are sent in a closed loop instead of at [rate]: each connection\n");
+  fprintf(stderr, "keeps k queries in flight, and sends a new query for each answer or lost query, right away or after\n");
+  fprintf(stderr, "[--think-time] microseconds.  The number of answers per second is printed at exit.\n");
   fprintf(stderr, "With option '-R', print RTT samples as CSV: connection ID, reception timestamp, RTT in microseconds.\n");
   fprintf(stderr, "With option '-t', only send queries for the given amount of seconds.\n");
   fprintf(stderr, "With option '--stdin', the program ignores 'rate' and 'duration' and expects them\n");
   fprintf(stderr, "to be given on stdin as a sequence of '<duration_ms> <rate>' lines, with a first line giving the number of subsequent lines.\n");
+  fprintf(stderr, "Each rate is applied right away, and the target and achieved rates of each line (or of the whole run\n");
+  fprintf(stderr, "with '-t') are printed on stderr.\n");
   fprintf(stderr, "With option '--stdin-rateslope', the program starts from 'rate' qps, and expects\n");
   fprintf(stderr, "a sequence of '<duration_ms> <slope>' lines to be given on stdin, where each\n");
   fprintf(stderr, "'slope' in qps/s indicates how much to increase or decrease the query rate. The first line\n");
   fprintf(stderr, "must give the number of subsequent lines.\n");
+  fprintf(stderr, "With option '--merged', each thread uses a single timer that drives the aggregate Poisson\n");
+  fprintf(stderr, "query rate, instead of one timer per Poisson process.\n");
+  fprintf(stderr, "With option '--absolute', queries are scheduled against absolute intended send times, so that\n");
+  fprintf(stderr, "delays in the event loop don't add up (this is always the case with '--merged').\n");
+  fprintf(stderr, "The 'schedule_lag_us' CSV column gives how late each query was sent compared to its intended time.\n");
+  fprintf(stderr, "With option '--hist', keep in-memory RTT histograms, and print latency percentiles on stderr\n");
+  fprintf(stderr, "every 'interval' seconds (0 for never) and at exit.  This is much cheaper than '-R'.\n");
+  fprintf(stderr, "With option '--rtt-log', queries and answers are written to the given file as fixed-size binary\n");
+  fprintf(stderr, "records (by a background thread), instead of CSV on stdout.  Use rttlog2csv to convert it to CSV.\n");
+  fprintf(stderr, "With option '--search', look for the highest rate with a p99 RTT of at most 'p99_us' microseconds\n");
+  fprintf(stderr, "and at most a fraction '--search-loss' of unanswered queries (default 0.001): starting at [rate], the\n");
+  fprintf(stderr, "rate is doubled until a step fails, then bisected.  Each step lasts '--search-warmup' seconds (default 2,\n");
+  fprintf(stderr, "not measured) plus '--search-step' seconds (default 10).  The capacity found is printed on stderr.\n");
+  fprintf(stderr, "Queries without an answer after '--timeout' milliseconds (default %u) are counted as lost.  Answers\n",
+	  QUERY_TIMEOUT_MSEC_DEFAULT);
+  fprintf(stderr, "that come later are logged, but not counted in histograms.  Loss, late, duplicate and mismatched\n");
+  fprintf(stderr, "answer counters are printed on stderr at exit.\n");
+  fprintf(stderr, "With option '--stats', print live statistics on stderr every 'ms' milliseconds: rates of queries, answers\n");
+  fprintf(stderr, "and bytes, queries in flight and lost, connections, schedule lag and RTT percentiles.  With option\n");
+  fprintf(stderr, "'--stats-port', serve the same counters (totals since the start) in the Prometheus text format on\n");
+  fprintf(stderr, "http://127.0.0.1:<port>/metrics.\n");
   fprintf(stderr, "Option '-s' allows to choose a random seed (unsigned int) to determine times of transmission.  By default, the seed is set to 42\n");
+  fprintf(stderr, "With option '-T', run the given number of worker threads, each with its own event loop.\n");
+  fprintf(stderr, "Connections and query rate are split evenly across threads.  By default, a single thread is used.\n");
+  fprintf(stderr, "Option '-E' selects the I/O engine: 'libevent' (default, bufferevents), or 'uring', where the queries\n");
+  fprintf(stderr, "of each scheduler tick are sent in a single io_uring_enter() call and answers are received with multishot\n");
+  fprintf(stderr, "receives (Linux 6.0 or later, not compatible with '--tls').\n");
+  fprintf(stderr, "With the libevent engine, the queries of each scheduler tick are written with one sendmsg() per\n");
+  fprintf(stderr, "connection, straight to the socket when its output buffer is empty ('--no-coalesce' to write\n");
+  fprintf(stderr, "each query to its bufferevent instead, always the case with '--tls').\n");
 }
 
 int main(int argc, char** argv)
 {
-  struct event_config *ev_cfg;
-  struct bufferevent **bufevents;
-  struct addrinfo hints;
-  struct addrinfo *res_list, *res;
-  struct sockaddr_storage *server;
-  struct timeval initial_timeout;
-  struct timeval duration_timeval;
-  /* Optional stdin-based commands */
-  unsigned int nb_commands;
-  struct command *commands;
-  struct rateslope_command *rateslope_commands;
   unsigned int min_query_rate = 0xffffffff;
   unsigned int max_query_rate = 0;
   /* Used to change the limit of open files */
   struct rlimit limit_openfiles;
-  int server_len;
-  int sock;
-  int bufev_fd;
-  int on = 1;
   int ret;
   int opt;
-  short use_tls = 0;
-  unsigned long int duration = 0, new_conn_rate = 1000, random_seed = 42;
-  unsigned long int new_conn_interval;
-  unsigned long int conn_id;
-  unsigned int nb_poisson_processes;
-  struct poisson_process *process;
-  struct callback_data *callback_arg;
   char *host = NULL, *port = NULL;
-  char host_s[NI_MAXHOST];
-  char port_s[NI_MAXSERV];
-  /* TLS handling */
-  SSL *ssl = NULL;
-  SSL_CTX *ssl_ctx = NULL;
+  char *rtt_log_path = NULL;
+  char *hosts, *saveptr;
+  uint16_t first_port, last_port;
+  unsigned int nb_ports, nb_hosts;
+  unsigned long port_arg;
 
   verbose = 0;
   print_rtt = 0;
@@ -248,9 +1599,27 @@ int main(int argc, char** argv)
     {"stdin",            no_argument, NULL, 0},
     {"stdin-rateslope",  no_argument, NULL, 0},
     {"tls",              no_argument, NULL, 0},
+    {"merged",           no_argument, NULL, 0},
+    {"absolute",         no_argument, NULL, 0},
+    {"hist",             required_argument, NULL, 0},
+    {"rtt-log",          required_argument, NULL, 0},
+    {"max-connecting",   required_argument, NULL, 0},
+    {"ready-fraction",   required_argument, NULL, 0},
+    {"ready-timeout",    required_argument, NULL, 0},
+    {"bind",             required_argument, NULL, 0},
+    {"no-coalesce",      no_argument, NULL, 0},
+    {"concurrency",      required_argument, NULL, 0},
+    {"think-time",       required_argument, NULL, 0},
+    {"search",           required_argument, NULL, 0},
+    {"search-loss",      required_argument, NULL, 0},
+    {"search-step",      required_argument, NULL, 0},
+    {"search-warmup",    required_argument, NULL, 0},
+    {"timeout",          required_argument, NULL, 0},
+    {"stats",            required_argument, NULL, 0},
+    {"stats-port",       required_argument, NULL, 0},
     {NULL,               0,           NULL, 0}
   };
-  while ((opt = getopt_long(argc, argv, "p:r:c:n:vRs:t:h", long_options, &option_index)) != -1) {
+  while ((opt = getopt_long(argc, argv, "p:r:c:n:vRs:t:T:E:h", long_options, &option_index)) != -1) {
     switch (opt) {
     case 0: /* long option */
       if (option_index == 0) { /* --stdin */
@@ -262,6 +1631,69 @@ int main(int argc, char** argv)
       if (option_index == 2) { /* --tls */
 	use_tls = 1;
       }
+      if (option_index == 3) { /* --merged */
+	use_merged = 1;
+      }
+      if (option_index == 4) { /* --absolute */
+	use_absolute = 1;
+      }
+      if (option_index == 5) { /* --hist */
+	use_histogram = 1;
+	histogram_interval = strtoul(optarg, NULL, 10);
+      }
+      if (option_index == 6) { /* --rtt-log */
+	rtt_log_path = optarg;
+      }
+      if (option_index == 7) { /* --max-connecting */
+	max_connecting = strtoul(optarg, NULL, 10);
+      }
+      if (option_index == 8) { /* --ready-fraction */
+	ready_fraction = strtod(optarg, NULL);
+      }
+      if (option_index == 9) { /* --ready-timeout */
+	ready_timeout = strtoul(optarg, NULL, 10);
+      }
+      if (option_index == 10) { /* --bind */
+	if (addrlist_parse(&bind_addresses, optarg) != 0)
+	  return 1;
+	use_bind = 1;
+      }
+      if (option_index == 11) { /* --no-coalesce */
+	use_coalescing = 0;
+      }
+      if (option_index == 12) { /* --concurrency */
+	concurrency = strtoul(optarg, NULL, 10);
+      }
+      if (option_index == 13) { /* --think-time */
+	think_time = strtoul(optarg, NULL, 10);
+      }
+      if (option_index == 14) { /* --search */
+	search.slo_us = strtoul(optarg, NULL, 10);
+      }
+      if (option_index == 15) { /* --search-loss */
+	search.max_loss = strtod(optarg, NULL);
+      }
+      if (option_index == 16) { /* --search-step */
+	search.step_duration = strtoul(optarg, NULL, 10);
+      }
+      if (option_index == 17) { /* --search-warmup */
+	search.warmup = strtoul(optarg, NULL, 10);
+      }
+      if (option_index == 18) { /* --timeout */
+	query_timeout = strtoul(optarg, NULL, 10);
+      }
+      if (option_index == 19) { /* --stats */
+	stats_interval = strtoul(optarg, NULL, 10);
+      }
+      if (option_index == 20) { /* --stats-port */
+	port_arg = strtoul(optarg, NULL, 10);
+	if (port_arg == 0 || port_arg > 65535) {
+	  fprintf(stderr, "Error: invalid statistics port\n");
+	  usage(argv[0]);
+	  return 1;
+	}
+	stats_port = port_arg;
+      }
       break;
     case 'p': /* TCP port */
       port = optarg;
@@ -288,6 +1720,20 @@ int main(int argc, char** argv)
     case 't': /* Duration */
       duration = strtoul(optarg, NULL, 10);
       break;
+    case 'T': /* Number of worker threads */
+      nb_threads = strtoul(optarg, NULL, 10);
+      break;
+    case 'E': /* I/O engine */
+      if (strcmp(optarg, "libevent") == 0) {
+	engine = ENGINE_LIBEVENT;
+      } else if (strcmp(optarg, "uring") == 0) {
+	engine = ENGINE_URING;
+      } else {
+	fprintf(stderr, "Unknown engine '%s'\n", optarg);
+	usage(argv[0]);
+	return 1;
+      }
+      break;
     case 'h': /* help */
       usage(argv[0]);
       return 0;
@@ -298,7 +1744,19 @@ int main(int argc, char** argv)
     }
   }
 
-  if (optind >= argc || port == NULL || (max_query_rate == 0 && stdin_commands == 0) || nb_conn == 0) {
+  if (concurrency > 0 && (max_query_rate != 0 || stdin_commands || stdin_rateslope_commands || use_merged)) {
+    fprintf(stderr, "Error: --concurrency is not compatible with -r, --stdin, --stdin-rateslope or --merged\n");
+    usage(argv[0]);
+    return 1;
+  }
+  if (concurrency > MAX_CONCURRENCY) {
+    fprintf(stderr, "Error: at most %d queries in flight per connection\n", MAX_CONCURRENCY);
+    usage(argv[0]);
+    return 1;
+  }
+  if (concurrency > 0)
+    min_query_rate = 0;
+  if (optind >= argc || port == NULL || (max_query_rate == 0 && stdin_commands == 0 && concurrency == 0) || nb_conn == 0) {
     fprintf(stderr, "Error: missing mandatory arguments\n");
     usage(argv[0]);
     return 1;
@@ -313,6 +1771,61 @@ int main(int argc, char** argv)
     usage(argv[0]);
     return 1;
   }
+  if (search.slo_us > 0 && (duration != 0 || stdin_commands || stdin_rateslope_commands || concurrency > 0)) {
+    fprintf(stderr, "Error: --search is not compatible with -t, --stdin, --stdin-rateslope or --concurrency\n");
+    usage(argv[0]);
+    return 1;
+  }
+  if (search.slo_us > 0 && search.step_duration == 0) {
+    fprintf(stderr, "Error: search steps must last at least one second\n");
+    usage(argv[0]);
+    return 1;
+  }
+  if (search.slo_us > 0 && min_query_rate > UINT_MAX >> SEARCH_MAX_DOUBLINGS) {
+    /* The search may double the start rate SEARCH_MAX_DOUBLINGS times. */
+    fprintf(stderr, "Error: search start rate must be at most %u qps\n", UINT_MAX >> SEARCH_MAX_DOUBLINGS);
+    usage(argv[0]);
+    return 1;
+  }
+  if (search.slo_us > 0) {
+    /* The search starts at [rate], and needs RTT histograms. */
+    search.start_rate = min_query_rate;
+    max_query_rate = min_query_rate << SEARCH_MAX_DOUBLINGS;
+    use_histogram = 1;
+  }
+  if (nb_threads == 0 || nb_threads > MAX_THREADS || nb_threads > nb_conn) {
+    fprintf(stderr, "Error: number of threads must be between 1 and min(%d, nb_conn)\n", MAX_THREADS);
+    usage(argv[0]);
+    return 1;
+  }
+  if (new_conn_rate == 0 || max_connecting == 0) {
+    fprintf(stderr, "Error: new connection rate and maximum number of connecting sockets must be positive\n");
+    usage(argv[0]);
+    return 1;
+  }
+  if (engine == ENGINE_URING && use_tls) {
+    fprintf(stderr, "Error: the io_uring engine does not support --tls\n");
+    usage(argv[0]);
+    return 1;
+  }
+  /* TLS connections must write through their bufferevent. */
+  if (use_tls)
+    use_coalescing = 0;
+  if (ready_fraction < 0. || ready_fraction > 1.) {
+    fprintf(stderr, "Error: ready fraction must be between 0 and 1\n");
+    usage(argv[0]);
+    return 1;
+  }
+  if (query_timeout == 0) {
+    fprintf(stderr, "Error: query timeout must be positive\n");
+    usage(argv[0]);
+    return 1;
+  }
+  if (stats_interval > 0 || stats_port > 0) {
+    /* Latency percentiles come from the RTT histograms. */
+    use_stats = 1;
+    use_histogram = 1;
+  }
   host = argv[optind];
 
   if (stdin_commands == 1) {
@@ -337,40 +1850,35 @@ int main(int argc, char** argv)
       return ret;
   }
 
-  srand48(random_seed);
-
   if (use_tls) {
     /* Initialise TLS client */
     ssl_ctx = SSL_CTX_new(TLS_client_method());
     SSL_CTX_set_min_proto_version(ssl_ctx, TLS1_1_VERSION);
   }
 
-  /* Compute maximum number of queries in flight.  Use a "safety factor"
-     of 8 to account for the worst case. */
-  double in_flight = 8 * (double) MAX_RTT_MSEC * (double) max_query_rate / (double) nb_conn / 1000.;
-  if (in_flight > 65534) {
-    max_queries_in_flight = 65535;
-  } else if (in_flight < 20) {
-    /* Use a minimum value to account for the worst case (burstiness on a
-       single TCP connection) */
-    max_queries_in_flight = 20;
-  } else {
-    max_queries_in_flight = ceil(in_flight);
-  }
-  debug("max queries in flight (per conn): %hu\n", max_queries_in_flight);
+  /* Size of the outstanding-query table of each connection */
+  query_table_size = compute_query_table_size(max_query_rate);
+  /* Closed loop: at most [concurrency] queries in flight, but answers
+     may come back out of order. */
+  while (query_table_size < 4 * concurrency && query_table_size < QUERY_TABLE_MAX_SIZE)
+    query_table_size *= 2;
+  debug("Outstanding-query table size (per conn): %u\n", query_table_size);
 
   /* How many Poisson processes do we need. */
   nb_poisson_processes = POISSON_PROCESS_PERIOD_MSEC * min_query_rate / 1000;
-  debug("Will spawn %d independent Poisson processes\n", nb_poisson_processes);
+  if (!use_merged)
+    debug("Will spawn %d independent Poisson processes\n", nb_poisson_processes);
+  initial_query_rate = stdin_commands ? commands[0].query_rate : min_query_rate;
 
-  if (stdin_commands == 1) {
-    /* Set initial rate for each Poisson process */
-    poisson_rate = (double) commands[0].query_rate / (double) nb_poisson_processes;
-    info("Initial Poisson rate: %f\n", poisson_rate);
+  if (stdin_commands == 1 && !use_merged) {
+    info("Initial Poisson rate: %f\n", (double) commands[0].query_rate / (double) nb_poisson_processes);
   }
 
-  /* Interval between two new connections, in microseconds. */
-  new_conn_interval = 1000000 / new_conn_rate;
+  /* Interval between two new connections on a given worker, in
+     microseconds.  Workers open their connections in parallel. */
+  new_conn_interval = 1000000 * nb_threads / new_conn_rate;
+  if (new_conn_interval == 0)
+    new_conn_interval = 1;
 
   /* Set maximum number of open files (set soft limit to hard limit) */
   ret = getrlimit(RLIMIT_NOFILE, &limit_openfiles);
@@ -389,239 +1897,120 @@ int main(int argc, char** argv)
 	    nb_conn, limit_openfiles.rlim_cur);
   }
 
-  if (print_rtt) {
-    printf("type,timestamp,connection_id,query_id,poisson_id,poisson_interval_us,rtt_us\n");
+  if (rtt_log_path != NULL) {
+    /* One ring buffer per worker thread */
+    rtt_log = rttlog_open(rtt_log_path, nb_threads);
+    if (rtt_log == NULL) {
+      return 1;
+    }
+    print_rtt = 1;
+  } else if (print_rtt) {
+    printf("type,timestamp,connection_id,query_id,poisson_id,poisson_interval_us,rtt_us,schedule_lag_us\n");
   }
 
-  /* Connect to server */
-  memset(&hints, 0, sizeof(struct addrinfo));
-  hints.ai_family = AF_UNSPEC;
-  hints.ai_socktype = SOCK_STREAM;
-  hints.ai_flags = 0;
-  hints.ai_protocol = 0;
-
-  ret = getaddrinfo(host, port, &hints, &res_list);
-  if (ret != 0) {
-    fprintf(stderr, "Error in getaddrinfo: %s\n", gai_strerror(ret));
+  /* Resolve and probe each server host, then build the list of server
+     endpoints: each host, on each port of the range. */
+  if (addrlist_parse_port_range(port, &first_port, &last_port) != 0) {
     return 1;
   }
-
-  for (res = res_list; res != NULL; res = res->ai_next) {
-    sock = socket(res->ai_family, res->ai_socktype,
-		  res->ai_protocol);
-    if (sock == -1)
-      continue;
-
-    getnameinfo(res->ai_addr, res->ai_addrlen, host_s, NI_MAXHOST,
-		port_s, NI_MAXSERV, NI_NUMERICHOST | NI_NUMERICSERV);
-    info("Trying to connect to %s port %s...\n", host_s, port_s);
-    if (connect(sock, res->ai_addr, res->ai_addrlen) != -1) {
-      info("Success!\n");
-      close(sock);
-      break;
-    } else {
-      perror("Failed to connect");
-      close(sock);
+  nb_ports = last_port - first_port + 1;
+  nb_hosts = 1;
+  for (const char *c = host; *c != '\0'; c++)
+    if (*c == ',')
+      nb_hosts++;
+  servers = calloc(nb_hosts * nb_ports, sizeof(struct server_endpoint));
+  nb_servers = 0;
+  hosts = strdup(host);
+  for (char *h = strtok_r(hosts, ",", &saveptr); h != NULL; h = strtok_r(NULL, ",", &saveptr)) {
+    if (resolve_server(h, first_port, &servers[nb_servers]) != 0)
+      return 1;
+    for (unsigned int p = 1; p < nb_ports; p++) {
+      servers[nb_servers + p] = servers[nb_servers];
+      addrlist_set_port(&servers[nb_servers + p].addr, first_port + p);
     }
+    nb_servers += nb_ports;
   }
-
-  /* No address succeeded */
-  if (res == NULL) {
-    fprintf(stderr, "Could not connect to host\n");
+  free(hosts);
+  if (nb_servers == 0) {
+    fprintf(stderr, "Error: no server host given\n");
     return 1;
   }
 
-  /* Copy working server */
-  server = malloc(sizeof(struct sockaddr_storage));
-  memcpy(server, res->ai_addr, sizeof(struct sockaddr_storage));
-  server_len = res->ai_addrlen;
-  freeaddrinfo(res_list);
-
-  /* Create event base with custom options */
-  ev_cfg = event_config_new();
-  if (!ev_cfg) {
-    fprintf(stderr, "Couldn't allocate event base config\n");
-    return 1;
-  }
-  int flags = 0;
-  /* Small performance boost: locks are useless since we are not
-     multi-threaded. */
-  flags |= EVENT_BASE_FLAG_NOLOCK;
-  /* epoll performance improvement */
-  flags |= EVENT_BASE_FLAG_EPOLL_USE_CHANGELIST;
-  /* Prevent libevent from using CLOCK_MONOTONIC_COARSE (introduced in
-     libevent 2.1.5) */
-#if LIBEVENT_VERSION_NUMBER >= 0x02010500
-    flags |= EVENT_BASE_FLAG_PRECISE_TIMER;
-#else
-    info("Warning: libevent before 2.1.5 has very low timer resolution (1 ms)\n");
-    info("Warning: You will likely obtain bursty request patterns\n");
-#endif
-  event_config_set_flag(ev_cfg, flags);
-  base = event_base_new_with_config(ev_cfg);
-  event_config_free(ev_cfg);
-  if (!base) {
-    fprintf(stderr, "Couldn't create event base\n");
-    return 1;
+  /* Split connections and Poisson processes across workers. */
+  workers = calloc(nb_threads, sizeof(struct worker));
+  rtt_histograms = calloc(nb_threads, sizeof(struct histogram*));
+  nb_rtt_histograms = nb_threads;
+  query_trackers = calloc(nb_threads, sizeof(struct query_tracker*));
+  nb_query_trackers = nb_threads;
+  lag_histograms = calloc(nb_threads, sizeof(struct histogram*));
+  uint32_t first_conn_id = 0;
+  for (unsigned int i = 0; i < nb_threads; i++) {
+    workers[i].worker_id = i;
+    histogram_init(&workers[i].rtt_histogram);
+    rtt_histograms[i] = &workers[i].rtt_histogram;
+    query_trackers[i] = &workers[i].tracker;
+    histogram_init(&workers[i].lag_histogram);
+    lag_histograms[i] = &workers[i].lag_histogram;
+    workers[i].first_conn_id = first_conn_id;
+    workers[i].nb_conn = nb_conn / nb_threads + (i < nb_conn % nb_threads ? 1 : 0);
+    workers[i].nb_poisson_processes = nb_poisson_processes / nb_threads
+      + (i < nb_poisson_processes % nb_threads ? 1 : 0);
+    first_conn_id += workers[i].nb_conn;
   }
 
-  /* Connect again, but using libevent, and multiple times. */
-  info("Opening %u connections to host %s port %s...\n", nb_conn, host_s, port_s);
-  bufevents = malloc(nb_conn * sizeof(struct bufferevent*));
-  connections = malloc(nb_conn * sizeof(struct tcp_connection));
-  for (conn_id = 0; conn_id < nb_conn; conn_id++) {
-    errno = 0;
-    /* Create and connect socket */
-    sock = socket(server->ss_family, SOCK_STREAM, 0);
-    if (sock == -1) {
-      perror("Failed to create socket");
-      break;
-    }
-
-    ret = connect(sock, (struct sockaddr*)server, server_len);
-    if (ret != 0) {
-      perror("Failed to connect to host");
-      break;
-    }
-    ret = evutil_make_socket_nonblocking(sock);
-    if (ret != 0) {
-      perror("Failed to set socket to non-blocking mode");
-      break;
-    }
-
-    if (use_tls) {
-      ssl = SSL_new(ssl_ctx);
-      if (ssl == NULL) {
-	perror("Failed to initialise openssl object");
-	break;
-      }
-      bufevents[conn_id] = bufferevent_openssl_socket_new(base, sock,
-							  ssl, BUFFEREVENT_SSL_CONNECTING,
-							  BEV_OPT_DEFER_CALLBACKS | BEV_OPT_CLOSE_ON_FREE);
-    } else {
-      bufevents[conn_id] = bufferevent_socket_new(base, sock, 0);
-    }
-
-    if (bufevents[conn_id] == NULL) {
-      perror("Failed to create socket-based bufferevent");
-      break;
-    }
-
-    /* Disable Nagle */
-    bufev_fd = bufferevent_getfd(bufevents[conn_id]);
-    if (bufev_fd == -1) {
-      info("Failed to disable Nagle on connection %ld (can't get file descriptor)\n", conn_id);
-    } else {
-      setsockopt(bufev_fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
-    }
-    connections[conn_id].connection_id = conn_id;
-    connections[conn_id].ssl = ssl;
-    connections[conn_id].query_id = 0;
-    connections[conn_id].bev = bufevents[conn_id];
-    connections[conn_id].query_timestamps = malloc(max_queries_in_flight * sizeof(struct timespec));
-    bufferevent_setcb(bufevents[conn_id], readcb, NULL, eventcb, &connections[conn_id]);
-    bufferevent_enable(bufevents[conn_id], EV_READ|EV_WRITE);
-
-    /* Progress output, roughly once per second */
-    if (conn_id % new_conn_rate == 0)
-      debug("Opened %ld connections so far...\n", conn_id);
-
-    /* Wait a bit between each connection to avoid overwhelming the server. */
-    event_usleep(new_conn_interval);
+  info("Opening %u connections to host %s port %s (%u endpoints) with %u thread(s)...\n",
+       nb_conn, host, port, nb_servers, nb_threads);
+  if (use_bind) {
+    info("Using %lu source addresses\n", bind_addresses.nb_addresses);
   }
-  info("Opened %ld connections to host %s port %s\n", conn_id, host_s, port_s);
-
-  /* Leave some time for all connections to connect */
-  if (use_tls) {
-    event_sleep(3 + nb_conn / 200);
-  } else {
-    event_sleep(3 + nb_conn / 5000);
+  if (duration > 0) {
+    info("Queries will be sent during %ld seconds.\n", duration);
   }
-
-  info("Starting %u Poisson processes generating queries...\n", nb_poisson_processes);
-  for (int i = 0; i < nb_poisson_processes; i++) {
-    generate_poisson_interarrival(&initial_timeout, poisson_rate);
-    /* Add 5 seconds to avoid missing query deadline even before we start
-       the event loop.  Without this, the first queries all go out at the
-       same time, creating a large burst. */
-    initial_timeout.tv_sec += 5;
-    debug("initial timeout %ld s %ld us\n", initial_timeout.tv_sec, initial_timeout.tv_usec);
-    process = poisson_new(base);
-    callback_arg = malloc(sizeof(struct callback_data));
-    callback_arg->process = process;
-    callback_arg->connections = connections;
-    poisson_set_callback(process, send_query_callback, callback_arg);
-    poisson_set_rate(process, poisson_rate);
-    ret = poisson_start_process(process, &initial_timeout);
+  if (stdin_commands == 1)
+    init_phases(commands, nb_commands, 0, nb_threads);
+  else if (duration > 0 && concurrency == 0)
+    init_phases(NULL, 0, min_query_rate, nb_threads);
+  pthread_barrier_init(&connected_barrier, NULL, nb_threads);
+  clock_gettime(CLOCK_MONOTONIC, &startup_time);
+  for (unsigned int i = 0; i < nb_threads; i++) {
+    ret = pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]);
     if (ret != 0) {
-      fprintf(stderr, "Failed to start Poisson process %u\n", process->process_id);
+      fprintf(stderr, "Failed to create worker thread: %s\n", strerror(ret));
+      return 1;
     }
   }
-
-  /* Schedule stop event. */
-  if (duration > 0) {
-    info("Scheduling stop event in %ld seconds.\n", duration);
-    /* Account for the 5 seconds delay on all events */
-    duration_timeval.tv_sec = 5 + duration;
-    duration_timeval.tv_usec = 0;
-    event_base_loopexit(base, &duration_timeval);
+  for (unsigned int i = 0; i < nb_threads; i++) {
+    pthread_join(workers[i].thread, NULL);
   }
-
-  /* Schedule changes of query rate. */
-  if (stdin_commands == 1) {
-    debug("Scheduling query rate changes according to stdin commands.\n");
-    /* Accounts for 5-seconds delay on all events */
-    struct timeval delay_timeval = {5, 0};
-    struct event *change_rate_ev;
-    for (int i = 0; i < nb_commands; ++i) {
-      change_rate_ev = event_new(base, -1, 0, change_query_rate, &commands[i].query_rate);
-      event_add(change_rate_ev, &delay_timeval);
-      timeval_add_ms(&delay_timeval, commands[i].duration_ms);
-    }
-    event_base_loopexit(base, &delay_timeval);
+  print_worker_stats();
+  if (use_histogram) {
+    print_rtt_histogram_total();
   }
-
-  /* Schedule changes of query rate slope. */
-  if (stdin_rateslope_commands == 1) {
-    debug("Scheduling query rate slope changes according to stdin commands.\n");
-    /* Accounts for 5-seconds delay on all events */
-    struct timeval delay_timeval = {5, 0};
-    struct event *change_rate_slope_ev;
-    for (int i = 0; i < nb_commands; ++i) {
-      change_rate_slope_ev = event_new(base, -1, 0, change_query_rate_slope, &rateslope_commands[i]);
-      event_add(change_rate_slope_ev, &delay_timeval);
-      timeval_add_ms(&delay_timeval, rateslope_commands[i].duration_ms);
+  if (rtt_log != NULL) {
+    uint64_t dropped = rttlog_close(rtt_log);
+    if (dropped > 0) {
+      fprintf(stderr, "Warning: %lu records dropped from the RTT log (writer too slow)\n", dropped);
     }
-    event_base_loopexit(base, &delay_timeval);
   }
 
-  info("Starting event loop\n");
-  event_base_dispatch(base);
-
   /* Free all the things */
+  pthread_barrier_destroy(&connected_barrier);
   if (stdin_commands == 1) {
     free(commands);
   }
   if (stdin_rateslope_commands == 1) {
     free(rateslope_commands);
   }
-  for (conn_id = 0; conn_id < nb_conn; conn_id++) {
-    if (bufevents[conn_id] == NULL)
-      break;
-    bufferevent_free(bufevents[conn_id]);
-    if (connections[conn_id].query_timestamps != NULL) {
-      free(connections[conn_id].query_timestamps);
-    }
-    if (use_tls) {
-      SSL_free(connections[conn_id].ssl);
-    }
-  }
   if (use_tls) {
     SSL_CTX_free(ssl_ctx);
   }
-  free(bufevents);
-  free(connections);
-  poisson_destroy(1);
-  event_base_free(base);
+  free(phase_stats);
+  free(rtt_histograms);
+  free(query_trackers);
+  free(lag_histograms);
+  free(workers);
+  free(servers);
+  if (use_bind)
+    addrlist_free(&bind_addresses);
   return 0;
 }
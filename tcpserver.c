@@ -1,79 +1,1325 @@
+/* For accept4() */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <getopt.h>
 #include <string.h>
 #include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <arpa/inet.h>
 #include <event2/event.h>
 #include <event2/buffer.h>
 #include <event2/bufferevent.h>
-#include <event2/listener.h>
+#include <event2/thread.h>
 #include <sys/time.h>
 #include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+
+#include "addrlist.h"
+#include "counters.h"
+#include "dns.h"
+#include "delay.h"
+#include "timerwheel.h"
+#include "uring.h"
 
 #define MAX_OPENFILES_DEFAULT 1024 * 1024
 #define MAX_OPENFILES_TARGET  1024 * 1024 * 256
 
+/* Maximum number of worker threads (-T option). */
+#define MAX_THREADS 1024
+
+/* Maximum number of listening sockets per worker (listen addresses times
+   ports). */
+#define MAX_LISTENERS 65536
+
+/* Backlog of listening sockets */
+#define LISTEN_BACKLOG 8192
+
+/* DNS mode: answer records smaller than this are copied into the output
+   buffer of each connection, since referencing them would cost more. */
+#define DNS_COPY_THRESHOLD 256
+
+/* Delayed replies (-D option): resolution of the timer wheels. */
+#define DELAY_TICK_USEC 100
+
+/* Maximum number of connections accepted per wakeup of a listening
+   socket, so that established connections are not starved during a
+   ramp-up. */
+#define ACCEPT_BATCH 64
+
+/* I/O engines (-E option) */
+#define ENGINE_LIBEVENT 0
+#define ENGINE_URING    1
+#define ENGINE_LEAN     2
+
+/* io_uring engine: size of the submission queue, and provided buffers
+   (per worker).  The number of buffers must be a power of two. */
+#define URING_ENTRIES 4096
+#define URING_NB_BUFFERS 4096
+#define URING_BUFFER_SIZE 4096
+/* Maximum number of sends linked together on a connection. */
+#define URING_MAX_LINKED_SENDS 16
+
+/* io_uring engine: the type of request is stored in the upper byte of
+   user_data, the buffer ID in the next 16 bits, and the file descriptor
+   in the lower 32 bits. */
+#define URING_ACCEPT 1
+#define URING_RECV   2
+#define URING_SEND   3
+#define URING_STOP   4
+#define URING_USER_DATA(_type, _bid, _fd) \
+    (((uint64_t) (_type) << 56) | ((uint64_t) (_bid) << 32) | (uint32_t) (_fd))
+#define URING_TYPE(_user_data) ((_user_data) >> 56)
+#define URING_BID(_user_data) (((_user_data) >> 32) & 0xffff)
+#define URING_FD(_user_data) ((int) ((_user_data) & 0xffffffff))
+
+/* Lean engine: size of the buffers of the pool (and of the receive
+   buffer), and maximum number of events handled per epoll_wait() call. */
+#define LEAN_BUFFER_SIZE 16384
+#define LEAN_MAX_EVENTS 256
+
+/* Lean engine: kind of file descriptor */
+#define LEAN_FREE     0
+#define LEAN_CONN     1
+#define LEAN_LISTENER 2
+#define LEAN_STOP     3
+
+/* State of a file descriptor handled by the lean engine: 16 bytes per
+   connection.  Received data is echoed back right away from the receive
+   buffer of the worker; only what the socket does not accept is copied
+   to a buffer of the pool, held until it is sent.  The table is shared
+   by all workers, so each connection records the worker it belongs to. */
+struct lean_conn {
+  char *buf;
+  uint16_t buf_start;
+  uint16_t buf_end;
+  uint8_t kind;
+  uint16_t worker_id;
+};
+
+/* State of a connection handled by the io_uring engine, indexed by file
+   descriptor. */
+struct uring_conn {
+  /* Whether the file descriptor is an open connection. */
+  char open;
+  /* Received buffers waiting to be echoed back, as a FIFO of buffer IDs
+     linked through worker->buf_next (-1 if empty). */
+  int32_t pending_head;
+  int32_t pending_tail;
+  /* Number of sends submitted and not completed yet. */
+  uint32_t sends_in_flight;
+  /* Whether the multishot recv is still armed. */
+  char recv_armed;
+  /* Whether the connection must be closed once all sends completed. */
+  char closing;
+  /* Whether the connection is in the list of connections with pending
+     data to send. */
+  char dirty;
+  /* Whether the multishot recv waits to be rearmed: in the rearm list
+     (no submission entry was available), or in the starved list (no
+     provided buffer was). */
+  char rearm;
+  char starved;
+  /* Next connection in the starved list (-1 if last) */
+  int32_t starved_next;
+};
+
+/* State of a connection whose messages are framed (DNS mode or delayed
+   replies).  With delayed replies, it outlives the connection until all
+   its pending replies expired. */
+struct framed_conn {
+  struct worker *worker;
+  /* NULL once the connection is closed */
+  struct bufferevent *bev;
+  uint32_t nb_pending;
+};
+
+/* Reply held in the timer wheel of a worker */
+struct pending_reply {
+  struct timer_wheel_entry entry;
+  struct framed_conn *conn;
+  uint32_t len;
+  char data[];
+};
+
+/* Each worker thread runs its own event loop, with its own listening
+   sockets bound to the same addresses and ports (SO_REUSEPORT).  The
+   kernel then spreads incoming connections across all workers. */
+struct worker {
+  unsigned int worker_id;
+  pthread_t thread;
+  struct event_base *base;
+  /* One listening socket per (listen address, port) pair, and with the
+     libevent engine, the events watching them. */
+  int *listen_fds;
+  struct event **listen_events;
+  unsigned int nb_listeners;
+  /* io_uring engine state */
+  struct uring ring;
+  struct uring_buf_ring buf_ring;
+  /* Per-fd connection state, grown on demand */
+  struct uring_conn *conns;
+  unsigned int conns_size;
+  /* Per-buffer state: next buffer in the pending FIFO, and data length */
+  int32_t *buf_next;
+  uint32_t *buf_len;
+  /* Connections with pending data, to send at the end of the iteration */
+  int *dirty_fds;
+  unsigned int nb_dirty;
+  /* Requests that could not get a submission entry, retried after the
+     next submission: stop read, multishot accepts and recvs. */
+  char stop_armed;
+  char *listen_armed;
+  unsigned int nb_listen_unarmed;
+  int *rearm_fds;
+  unsigned int nb_rearm;
+  /* Connections whose recv stopped for lack of provided buffers, as a
+     FIFO linked through starved_next, and number of buffers held until
+     they are echoed back. */
+  int32_t starved_head;
+  int32_t starved_tail;
+  unsigned int nb_bufs_held;
+  /* Written by the main thread to stop the worker */
+  int stop_fd;
+  uint64_t stop_value;
+  unsigned long nb_completions;
+  /* Lean engine state: epoll instance, receive buffer, and pool of
+     buffers holding data that could not be echoed back yet. */
+  int epoll_fd;
+  char *lean_rx;
+  char **free_bufs;
+  unsigned int nb_free_bufs;
+  unsigned int nb_bufs;
+  unsigned int free_bufs_size;
+  /* Highest file descriptor accepted by this worker */
+  int lean_max_fd;
+  /* Counters, only updated by the worker thread itself.  Connection
+     counters are also read by the main thread for periodic reports. */
+  _Atomic unsigned long accepted_conn;
+  _Atomic unsigned long closed_conn;
+  unsigned long bytes_echoed;
+  /* DNS mode: answers sent, and messages that are not DNS queries. */
+  unsigned long dns_answers;
+  unsigned long dns_invalid;
+  /* Delayed replies: timer wheel, driven by a timer that only runs while
+     replies are pending, and random state to draw delays. */
+  struct timer_wheel wheel;
+  struct event *wheel_event;
+  struct drand48_data rand_state;
+  unsigned long delayed_replies;
+  unsigned long peak_pending;
+};
+
+static struct worker *workers;
+static unsigned int nb_threads = 1;
+static int engine = ENGINE_LIBEVENT;
+/* DNS mode (-d option): answers are made of a header and question built
+   for each query, followed by the precomputed records of the template. */
+static short dns_mode = 0;
+static struct dns_template dns_template;
+/* Distribution of reply delays (-D option) */
+static short use_delay = 0;
+static struct delay_dist delay_dist;
+/* Log one accepted connection out of [log_accept_interval] (0: never). */
+static unsigned long log_accept_interval = 0;
+/* Lean engine: per-fd state, shared by all workers since a file
+   descriptor belongs to a single worker at a time.  It is sized for the
+   maximum number of open files, but pages only use memory once touched. */
+static struct lean_conn *lean_conns;
+static size_t lean_conns_size;
+
 static void readcb(struct bufferevent *bev, void *ctx)
 {
   /* This callback is invoked when there is data to read on bev. */
+  struct worker *worker = ctx;
   struct evbuffer *input = bufferevent_get_input(bev);
   struct evbuffer *output = bufferevent_get_output(bev);
 
+  worker->bytes_echoed += evbuffer_get_length(input);
   /* Copy all the data from the input buffer to the output buffer. */
   evbuffer_add_buffer(output, input);
 }
 
+/* Writes a reply: an echoed message, or the header and question of a DNS
+   answer followed by the records of the template.  Records are shared by
+   all answers, and added by reference when large enough, so that large
+   answers are written without copying them. */
+static void send_reply(struct bufferevent *bev, const char *reply, size_t len)
+{
+  struct evbuffer *output = bufferevent_get_output(bev);
+  evbuffer_add(output, reply, len);
+  if (!dns_mode)
+    return;
+  if (dns_template.records_len < DNS_COPY_THRESHOLD)
+    evbuffer_add(output, dns_template.records, dns_template.records_len);
+  else
+    evbuffer_add_reference(output, dns_template.records, dns_template.records_len, NULL, NULL);
+}
+
+/* Current tick of the timer wheels */
+static uint64_t wheel_now()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return ((uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000) / DELAY_TICK_USEC;
+}
+
+static void expire_reply(struct timer_wheel_entry *entry, void *ctx)
+{
+  struct pending_reply *reply = (struct pending_reply *) entry;
+  struct framed_conn *conn = reply->conn;
+  conn->nb_pending--;
+  if (conn->bev != NULL)
+    send_reply(conn->bev, reply->data, reply->len);
+  else if (conn->nb_pending == 0)
+    free(conn);
+  free(reply);
+}
+
+/* Runs every tick while replies are pending. */
+static void wheel_tick(evutil_socket_t fd, short events, void *ctx)
+{
+  struct worker *worker = ctx;
+  timer_wheel_advance(&worker->wheel, wheel_now(), expire_reply, worker);
+  if (worker->wheel.count == 0)
+    event_del(worker->wheel_event);
+}
+
+/* Holds a reply for [delay] microseconds (rounded up to a tick). */
+static void delay_reply(struct framed_conn *conn, const char *reply, size_t len, uint64_t delay)
+{
+  struct worker *worker = conn->worker;
+  struct pending_reply *pending = malloc(sizeof(struct pending_reply) + len);
+  struct timeval tick = {0, DELAY_TICK_USEC};
+  uint64_t now = wheel_now();
+  pending->conn = conn;
+  pending->len = len;
+  memcpy(pending->data, reply, len);
+  conn->nb_pending++;
+  if (worker->wheel.count == 0) {
+    timer_wheel_reset(&worker->wheel, now);
+    event_add(worker->wheel_event, &tick);
+  }
+  timer_wheel_add(&worker->wheel, &pending->entry, now + (delay + DELAY_TICK_USEC - 1) / DELAY_TICK_USEC);
+  worker->delayed_replies++;
+  if (worker->wheel.count > worker->peak_pending)
+    worker->peak_pending = worker->wheel.count;
+}
+
+/* Handles each complete length-prefixed message: in DNS mode, builds an
+   answer, otherwise echoes the message.  The reply is held for a random
+   delay with option '-D'. */
+static void framed_readcb(struct bufferevent *bev, void *ctx)
+{
+  struct framed_conn *conn = ctx;
+  struct worker *worker = conn->worker;
+  struct evbuffer *input = bufferevent_get_input(bev);
+  unsigned char prefix[2];
+  char answer[2 + DNS_HEADER_SIZE + DNS_MAX_QUESTION_SIZE];
+  unsigned char *query;
+  const char *reply;
+  size_t input_len, msg_len, query_len, header_len, answer_len, reply_len;
+  uint64_t delay = 0;
+  double u;
+  while (1) {
+    input_len = evbuffer_get_length(input);
+    if (input_len < 2)
+      return;
+    evbuffer_copyout(input, prefix, 2);
+    msg_len = (prefix[0] << 8) | prefix[1];
+    if (input_len < msg_len + 2)
+      return;
+    if (dns_mode) {
+      /* We only need the header and question, and must not parse past
+	 what was pulled up. */
+      query_len = msg_len < DNS_HEADER_SIZE + DNS_MAX_QUESTION_SIZE ?
+	msg_len : DNS_HEADER_SIZE + DNS_MAX_QUESTION_SIZE;
+      query = evbuffer_pullup(input, 2 + query_len);
+      header_len = dns_make_answer_header(&dns_template, (char*) query + 2, query_len,
+					  answer + 2, sizeof(answer) - 2);
+      if (header_len == 0) {
+	worker->dns_invalid++;
+	evbuffer_drain(input, msg_len + 2);
+	continue;
+      }
+      answer_len = header_len + dns_template.records_len;
+      answer[0] = answer_len >> 8;
+      answer[1] = answer_len & 0xff;
+      reply = answer;
+      reply_len = 2 + header_len;
+      worker->dns_answers++;
+    } else {
+      /* Echo the message with its length prefix */
+      reply = (char*) evbuffer_pullup(input, msg_len + 2);
+      reply_len = msg_len + 2;
+      worker->bytes_echoed += reply_len;
+    }
+    if (use_delay) {
+      drand48_r(&worker->rand_state, &u);
+      delay = delay_dist_sample(&delay_dist, u);
+    }
+    if (delay > 0)
+      delay_reply(conn, reply, reply_len, delay);
+    else
+      send_reply(bev, reply, reply_len);
+    evbuffer_drain(input, msg_len + 2);
+  }
+}
+
+static void framed_eventcb(struct bufferevent *bev, short events, void *ctx)
+{
+  struct framed_conn *conn = ctx;
+  if (events & BEV_EVENT_ERROR)
+    perror("Error from bufferevent");
+  if (events & (BEV_EVENT_EOF | BEV_EVENT_ERROR)) {
+    bufferevent_free(bev);
+    RELAXED_ADD(conn->worker->closed_conn, 1);
+    /* Pending replies are dropped when they expire. */
+    conn->bev = NULL;
+    if (conn->nb_pending == 0)
+      free(conn);
+  }
+}
+
 static void eventcb(struct bufferevent *bev, short events, void *ctx)
 {
+  struct worker *worker = ctx;
   if (events & BEV_EVENT_ERROR)
     perror("Error from bufferevent");
   if (events & (BEV_EVENT_EOF | BEV_EVENT_ERROR)) {
     bufferevent_free(bev);
+    RELAXED_ADD(worker->closed_conn, 1);
   }
 }
 
-static void accept_conn_cb(struct evconnlistener *listener,
-			   evutil_socket_t fd, struct sockaddr *address,
-			   int socklen, void *ctx)
+/* Logs one accepted connection out of [log_accept_interval] (-l option):
+   synchronous output for every connection would slow down accepts.
+   Must be called before counting the connection. */
+static void log_accept(struct worker *worker, int fd)
 {
+  struct sockaddr_storage address;
+  socklen_t socklen = sizeof(address);
   char host[NI_MAXHOST];
   char port[NI_MAXSERV];
-  getnameinfo(address, socklen, host, NI_MAXHOST, port, NI_MAXSERV,
+  if (log_accept_interval == 0 || RELAXED_LOAD(worker->accepted_conn) % log_accept_interval != 0)
+    return;
+  if (getpeername(fd, (struct sockaddr*)&address, &socklen) != 0)
+    return;
+  getnameinfo((struct sockaddr*)&address, socklen, host, NI_MAXHOST, port, NI_MAXSERV,
 	      NI_NUMERICHOST | NI_NUMERICSERV);
-  printf("Got new connection from %s:%s\n", host, port);
-  /* Setup a bufferevent */
-  struct event_base *base = evconnlistener_get_base(listener);
-  struct bufferevent *bev = bufferevent_socket_new(base, fd, BEV_OPT_CLOSE_ON_FREE);
-  bufferevent_setcb(bev, readcb, NULL, eventcb, NULL);
-  bufferevent_enable(bev, EV_READ|EV_WRITE);
+  printf("[thread %u] Got new connection from %s:%s\n", worker->worker_id, host, port);
+}
+
+/* Drains the backlog of a listening socket, by batches of at most
+   ACCEPT_BATCH connections per wakeup. */
+static void accept_conn_cb(evutil_socket_t listen_fd, short events, void *ctx)
+{
+  struct worker *worker = ctx;
+  struct bufferevent *bev;
+  struct framed_conn *conn;
+  int fd;
+  int on = 1;
+  for (unsigned int i = 0; i < ACCEPT_BATCH; i++) {
+    fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK);
+    if (fd < 0) {
+      if (errno == ECONNABORTED || errno == EINTR)
+	continue;
+      if (errno == EAGAIN)
+	return;
+      fprintf(stderr, "Got an error %d (%s) on the listener. "
+	      "Shutting down.\n", errno, strerror(errno));
+      event_base_loopexit(worker->base, NULL);
+      /* Wake up the main thread so that the other workers stop too. */
+      kill(getpid(), SIGTERM);
+      return;
+    }
+    log_accept(worker, fd);
+    RELAXED_ADD(worker->accepted_conn, 1);
+    /* Delayed replies are written one by one: without this, Nagle's
+       algorithm holds them until the client ACKs the previous one. */
+    if (use_delay)
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    /* Setup a bufferevent */
+    bev = bufferevent_socket_new(worker->base, fd, BEV_OPT_CLOSE_ON_FREE);
+    if (dns_mode || use_delay) {
+      conn = malloc(sizeof(struct framed_conn));
+      conn->worker = worker;
+      conn->bev = bev;
+      conn->nb_pending = 0;
+      bufferevent_setcb(bev, framed_readcb, NULL, framed_eventcb, conn);
+    } else {
+      bufferevent_setcb(bev, readcb, NULL, eventcb, worker);
+    }
+    bufferevent_enable(bev, EV_READ|EV_WRITE);
+  }
+}
+
+static void *worker_main(void *ctx)
+{
+  struct worker *worker = ctx;
+  event_base_dispatch(worker->base);
+  return NULL;
+}
+
+/* Opens a non-blocking listening socket. */
+static int open_listen_socket(struct sockaddr *addr, socklen_t addr_len)
+{
+  int on = 1;
+  int sock = socket(addr->sa_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  if (sock == -1)
+    return -1;
+  setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  /* Each worker binds its own sockets to the same addresses and ports. */
+  if (nb_threads > 1)
+    setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+  if (bind(sock, addr, addr_len) != 0 || listen(sock, LISTEN_BACKLOG) != 0) {
+    close(sock);
+    return -1;
+  }
+  return sock;
+}
+
+/* Opens the listening sockets of a worker.  Returns 0 on success. */
+static int open_listen_sockets(struct worker *worker, struct addrlist *listen_addresses,
+			       uint16_t first_port, unsigned int nb_ports)
+{
+  struct sockaddr_storage sin;
+  socklen_t sin_len;
+  worker->listen_fds = calloc(worker->nb_listeners, sizeof(int));
+  for (unsigned int l = 0; l < worker->nb_listeners; l++) {
+    sin_len = addrlist_get(listen_addresses, l / nb_ports, first_port + l % nb_ports, &sin);
+    worker->listen_fds[l] = open_listen_socket((struct sockaddr*)&sin, sin_len);
+    if (worker->listen_fds[l] == -1) {
+      perror("Couldn't create listener");
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/* Submission entries may still be unavailable after submitting the
+   queue, e.g. if io_uring_enter() fails with EBUSY while completions
+   overflow.  Requests are then retried after the next submission, by
+   uring_retry_arms(). */
+
+static void uring_defer_recv(struct worker *worker, int fd)
+{
+  if (worker->conns[fd].rearm)
+    return;
+  worker->conns[fd].rearm = 1;
+  worker->rearm_fds[worker->nb_rearm++] = fd;
+}
+
+static void uring_arm_recv(struct worker *worker, int fd)
+{
+  struct io_uring_sqe *sqe = uring_get_sqe(&worker->ring);
+  if (sqe == NULL) {
+    uring_defer_recv(worker, fd);
+    return;
+  }
+  uring_prep_multishot_recv(sqe, fd, worker->buf_ring.bgid, URING_USER_DATA(URING_RECV, 0, fd));
+  worker->conns[fd].recv_armed = 1;
+}
+
+static void uring_arm_accept(struct worker *worker, unsigned int l)
+{
+  struct io_uring_sqe *sqe = uring_get_sqe(&worker->ring);
+  if (sqe == NULL) {
+    worker->listen_armed[l] = 0;
+    worker->nb_listen_unarmed++;
+    return;
+  }
+  uring_prep_multishot_accept(sqe, worker->listen_fds[l],
+			      URING_USER_DATA(URING_ACCEPT, 0, worker->listen_fds[l]));
+  worker->listen_armed[l] = 1;
+}
+
+static void uring_arm_stop(struct worker *worker)
+{
+  struct io_uring_sqe *sqe = uring_get_sqe(&worker->ring);
+  worker->stop_armed = sqe != NULL;
+  if (sqe != NULL)
+    uring_prep_read(sqe, worker->stop_fd, &worker->stop_value,
+		    sizeof(worker->stop_value), URING_USER_DATA(URING_STOP, 0, worker->stop_fd));
+}
+
+static void uring_maybe_close(struct worker *worker, int fd);
+
+static void uring_retry_arms(struct worker *worker)
+{
+  unsigned int nb_rearm = worker->nb_rearm;
+  if (!worker->stop_armed)
+    uring_arm_stop(worker);
+  if (worker->nb_listen_unarmed > 0) {
+    worker->nb_listen_unarmed = 0;
+    for (unsigned int l = 0; l < worker->nb_listeners; l++) {
+      if (!worker->listen_armed[l])
+	uring_arm_accept(worker, l);
+    }
+  }
+  /* Failed arms are added back at the start of the list, behind the
+     current position. */
+  worker->nb_rearm = 0;
+  for (unsigned int i = 0; i < nb_rearm; i++) {
+    int fd = worker->rearm_fds[i];
+    worker->conns[fd].rearm = 0;
+    if (worker->conns[fd].closing)
+      uring_maybe_close(worker, fd);
+    else if (!worker->conns[fd].recv_armed)
+      uring_arm_recv(worker, fd);
+  }
+}
+
+/* Out of provided buffers: rearming the recv right away would only get
+   ENOBUFS again, so the connection waits for a buffer to be recycled. */
+static void uring_starve(struct worker *worker, int fd)
+{
+  struct uring_conn *conn = &worker->conns[fd];
+  if (worker->nb_bufs_held < URING_NB_BUFFERS) {
+    /* Buffers were recycled meanwhile */
+    uring_arm_recv(worker, fd);
+    return;
+  }
+  conn->starved = 1;
+  conn->starved_next = -1;
+  if (worker->starved_tail == -1)
+    worker->starved_head = fd;
+  else
+    worker->conns[worker->starved_tail].starved_next = fd;
+  worker->starved_tail = fd;
+}
+
+/* Gives buffer [bid] back to the kernel, and rearms the recv of the
+   connection that has been starved for the longest time. */
+static void uring_recycle(struct worker *worker, uint16_t bid)
+{
+  int fd;
+  uring_buf_ring_recycle(&worker->buf_ring, bid);
+  worker->nb_bufs_held--;
+  while ((fd = worker->starved_head) != -1) {
+    struct uring_conn *conn = &worker->conns[fd];
+    worker->starved_head = conn->starved_next;
+    if (worker->starved_head == -1)
+      worker->starved_tail = -1;
+    conn->starved = 0;
+    if (!conn->closing) {
+      uring_arm_recv(worker, fd);
+      return;
+    }
+    /* Closed with the rearm list, not from here */
+    uring_defer_recv(worker, fd);
+  }
+}
+
+static void uring_mark_dirty(struct worker *worker, int fd)
+{
+  if (worker->conns[fd].dirty)
+    return;
+  worker->conns[fd].dirty = 1;
+  worker->dirty_fds[worker->nb_dirty++] = fd;
+}
+
+/* Closes the connection once nothing refers to it anymore: no armed
+   recv, no send in flight. */
+static void uring_maybe_close(struct worker *worker, int fd)
+{
+  struct uring_conn *conn = &worker->conns[fd];
+  if (!conn->closing || conn->recv_armed || conn->sends_in_flight > 0 || conn->dirty
+      || conn->rearm || conn->starved)
+    return;
+  /* Give back buffers that were never sent */
+  while (conn->pending_head != -1) {
+    int32_t bid = conn->pending_head;
+    conn->pending_head = worker->buf_next[bid];
+    uring_recycle(worker, bid);
+  }
+  close(fd);
+  memset(conn, 0, sizeof(*conn));
+  conn->pending_head = conn->pending_tail = -1;
+  RELAXED_ADD(worker->closed_conn, 1);
+}
+
+static void uring_handle_accept(struct worker *worker, struct io_uring_cqe *cqe)
+{
+  int fd = cqe->res;
+  if (!(cqe->flags & IORING_CQE_F_MORE)) {
+    /* The multishot accept stopped, rearm it. */
+    for (unsigned int l = 0; l < worker->nb_listeners; l++) {
+      if (worker->listen_fds[l] == URING_FD(cqe->user_data))
+	uring_arm_accept(worker, l);
+    }
+  }
+  if (fd < 0) {
+    fprintf(stderr, "[thread %u] Error accepting connection: %s\n", worker->worker_id, strerror(-fd));
+    return;
+  }
+  if ((unsigned int) fd >= worker->conns_size) {
+    unsigned int new_size = worker->conns_size * 2 > (unsigned int) fd ? worker->conns_size * 2 : fd + 1;
+    worker->conns = realloc(worker->conns, new_size * sizeof(struct uring_conn));
+    worker->dirty_fds = realloc(worker->dirty_fds, new_size * sizeof(int));
+    worker->rearm_fds = realloc(worker->rearm_fds, new_size * sizeof(int));
+    memset(&worker->conns[worker->conns_size], 0,
+	   (new_size - worker->conns_size) * sizeof(struct uring_conn));
+    worker->conns_size = new_size;
+  }
+  memset(&worker->conns[fd], 0, sizeof(struct uring_conn));
+  worker->conns[fd].pending_head = worker->conns[fd].pending_tail = -1;
+  worker->conns[fd].open = 1;
+  log_accept(worker, fd);
+  RELAXED_ADD(worker->accepted_conn, 1);
+  uring_arm_recv(worker, fd);
+}
+
+static void uring_handle_recv(struct worker *worker, struct io_uring_cqe *cqe)
+{
+  int fd = URING_FD(cqe->user_data);
+  struct uring_conn *conn = &worker->conns[fd];
+  uint16_t bid;
+  if (!(cqe->flags & IORING_CQE_F_MORE))
+    conn->recv_armed = 0;
+  if (cqe->res > 0 && (cqe->flags & IORING_CQE_F_BUFFER)) {
+    /* Queue the buffer, it is sent (and recycled) later */
+    bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    worker->nb_bufs_held++;
+    worker->buf_len[bid] = cqe->res;
+    worker->buf_next[bid] = -1;
+    if (conn->pending_tail == -1)
+      conn->pending_head = bid;
+    else
+      worker->buf_next[conn->pending_tail] = bid;
+    conn->pending_tail = bid;
+    if (conn->sends_in_flight == 0)
+      uring_mark_dirty(worker, fd);
+    if (!conn->recv_armed && !conn->closing)
+      uring_arm_recv(worker, fd);
+  } else if (cqe->res == -ENOBUFS) {
+    /* Out of provided buffers: retry once sends complete and recycle
+       them. */
+    if (!conn->recv_armed && !conn->closing)
+      uring_starve(worker, fd);
+  } else {
+    /* EOF or error */
+    if (cqe->res < 0 && cqe->res != -ECONNRESET)
+      fprintf(stderr, "Error on connection: %s\n", strerror(-cqe->res));
+    conn->closing = 1;
+  }
+  uring_maybe_close(worker, fd);
+}
+
+static void uring_handle_send(struct worker *worker, struct io_uring_cqe *cqe)
+{
+  int fd = URING_FD(cqe->user_data);
+  struct uring_conn *conn = &worker->conns[fd];
+  conn->sends_in_flight--;
+  uring_recycle(worker, URING_BID(cqe->user_data));
+  if (cqe->res > 0) {
+    worker->bytes_echoed += cqe->res;
+  } else if (!conn->closing) {
+    /* The peer is gone: stop the multishot recv too. */
+    conn->closing = 1;
+    shutdown(fd, SHUT_RDWR);
+  }
+  if (conn->sends_in_flight == 0 && conn->pending_head != -1 && !conn->closing)
+    uring_mark_dirty(worker, fd);
+  uring_maybe_close(worker, fd);
+}
+
+/* Sends the pending buffers of each dirty connection, as a chain of
+   linked sends so that they complete in order. */
+static void uring_flush_sends(struct worker *worker)
+{
+  unsigned int nb_dirty = worker->nb_dirty;
+  worker->nb_dirty = 0;
+  for (unsigned int i = 0; i < nb_dirty; i++) {
+    int fd = worker->dirty_fds[i];
+    struct uring_conn *conn = &worker->conns[fd];
+    struct io_uring_sqe *sqe = NULL;
+    if (conn->sends_in_flight > 0) {
+      conn->dirty = 0;
+      continue;
+    }
+    /* A chain must not be split across two submissions. */
+    if (uring_sq_space(&worker->ring) < URING_MAX_LINKED_SENDS)
+      uring_submit_and_wait(&worker->ring, 0);
+    if (uring_sq_space(&worker->ring) < URING_MAX_LINKED_SENDS) {
+      /* Still full: keep the connection dirty, and retry after the next
+	 submission. */
+      worker->dirty_fds[worker->nb_dirty++] = fd;
+      continue;
+    }
+    conn->dirty = 0;
+    while (conn->pending_head != -1 && conn->sends_in_flight < URING_MAX_LINKED_SENDS) {
+      int32_t bid = conn->pending_head;
+      conn->pending_head = worker->buf_next[bid];
+      if (conn->pending_head == -1)
+	conn->pending_tail = -1;
+      if (sqe != NULL)
+	sqe->flags |= IOSQE_IO_LINK;
+      sqe = uring_get_sqe(&worker->ring);
+      /* MSG_WAITALL: short sends are retried by the kernel instead of
+	 breaking the chain. */
+      uring_prep_send(sqe, fd, uring_buf_ring_buffer(&worker->buf_ring, bid),
+		      worker->buf_len[bid], MSG_WAITALL | MSG_NOSIGNAL,
+		      URING_USER_DATA(URING_SEND, bid, fd));
+      conn->sends_in_flight++;
+    }
+    if (conn->closing)
+      uring_maybe_close(worker, fd);
+  }
+}
+
+/* Event loop of the io_uring engine: a single io_uring_enter() call both
+   submits new requests and waits for completions. */
+static void *uring_worker_main(void *ctx)
+{
+  struct worker *worker = ctx;
+  struct io_uring_cqe *cqe;
+  int stop = 0;
+  for (unsigned int l = 0; l < worker->nb_listeners; l++)
+    uring_arm_accept(worker, l);
+  uring_arm_stop(worker);
+  while (!stop) {
+    uring_submit_and_wait(&worker->ring, 1);
+    uring_retry_arms(worker);
+    while ((cqe = uring_peek_cqe(&worker->ring)) != NULL) {
+      worker->nb_completions++;
+      switch (URING_TYPE(cqe->user_data)) {
+      case URING_ACCEPT:
+	uring_handle_accept(worker, cqe);
+	break;
+      case URING_RECV:
+	uring_handle_recv(worker, cqe);
+	break;
+      case URING_SEND:
+	uring_handle_send(worker, cqe);
+	break;
+      case URING_STOP:
+	stop = 1;
+	break;
+      }
+      uring_cqe_seen(&worker->ring);
+    }
+    uring_flush_sends(worker);
+  }
+  return NULL;
+}
+
+/* Sets up the io_uring engine of a worker: ring, provided buffers and
+   listening sockets.  Returns 0 on success. */
+static int uring_worker_init(struct worker *worker, struct addrlist *listen_addresses,
+			     uint16_t first_port, unsigned int nb_ports)
+{
+  int ret;
+  ret = uring_init(&worker->ring, URING_ENTRIES, 0);
+  if (ret < 0) {
+    fprintf(stderr, "Couldn't create io_uring: %s\n", strerror(-ret));
+    return -1;
+  }
+  ret = uring_buf_ring_init(&worker->ring, &worker->buf_ring, 0, URING_NB_BUFFERS, URING_BUFFER_SIZE);
+  if (ret < 0) {
+    fprintf(stderr, "Couldn't register io_uring provided buffers: %s\n", strerror(-ret));
+    return -1;
+  }
+  worker->buf_next = calloc(URING_NB_BUFFERS, sizeof(int32_t));
+  worker->buf_len = calloc(URING_NB_BUFFERS, sizeof(uint32_t));
+  worker->conns_size = 1024;
+  worker->conns = calloc(worker->conns_size, sizeof(struct uring_conn));
+  worker->dirty_fds = calloc(worker->conns_size, sizeof(int));
+  worker->rearm_fds = calloc(worker->conns_size, sizeof(int));
+  worker->starved_head = worker->starved_tail = -1;
+  worker->stop_fd = eventfd(0, 0);
+  ret = open_listen_sockets(worker, listen_addresses, first_port, nb_ports);
+  worker->listen_armed = calloc(worker->nb_listeners, sizeof(char));
+  return ret;
+}
+
+static void uring_worker_free(struct worker *worker)
+{
+  for (unsigned int fd = 0; fd < worker->conns_size; fd++) {
+    if (worker->conns[fd].open)
+      close(fd);
+  }
+  for (unsigned int l = 0; l < worker->nb_listeners; l++)
+    close(worker->listen_fds[l]);
+  close(worker->stop_fd);
+  uring_buf_ring_free(&worker->ring, &worker->buf_ring);
+  uring_exit(&worker->ring);
+  free(worker->listen_fds);
+  free(worker->conns);
+  free(worker->dirty_fds);
+  free(worker->rearm_fds);
+  free(worker->listen_armed);
+  free(worker->buf_next);
+  free(worker->buf_len);
+}
+
+/* Lean engine: a raw epoll loop, with as little user-space state per
+   connection as possible, to measure what the kernel alone costs at
+   millions of connections. */
+
+static char *lean_get_buffer(struct worker *worker)
+{
+  if (worker->nb_free_bufs > 0)
+    return worker->free_bufs[--worker->nb_free_bufs];
+  /* Make sure the free list can hold every buffer of the pool */
+  if (worker->nb_bufs == worker->free_bufs_size) {
+    worker->free_bufs_size = worker->free_bufs_size == 0 ? 64 : 2 * worker->free_bufs_size;
+    worker->free_bufs = realloc(worker->free_bufs, worker->free_bufs_size * sizeof(char*));
+  }
+  worker->nb_bufs++;
+  return malloc(LEAN_BUFFER_SIZE);
+}
+
+static void lean_put_buffer(struct worker *worker, char *buf)
+{
+  worker->free_bufs[worker->nb_free_bufs++] = buf;
+}
+
+static void lean_watch(struct worker *worker, int fd, int op, uint32_t events)
+{
+  struct epoll_event ev;
+  ev.events = events;
+  ev.data.fd = fd;
+  if (epoll_ctl(worker->epoll_fd, op, fd, &ev) != 0)
+    perror("epoll_ctl");
+}
+
+static void lean_close(struct worker *worker, int fd)
+{
+  struct lean_conn *conn = &lean_conns[fd];
+  if (conn->buf != NULL)
+    lean_put_buffer(worker, conn->buf);
+  /* Reset the state before closing: as soon as it is closed, the file
+     descriptor can be reused by another worker. */
+  memset(conn, 0, sizeof(*conn));
+  close(fd);
+  RELAXED_ADD(worker->closed_conn, 1);
+}
+
+static void lean_accept(struct worker *worker, int listen_fd)
+{
+  int fd;
+  for (unsigned int i = 0; i < ACCEPT_BATCH; i++) {
+    fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK);
+    if (fd < 0) {
+      if (errno == ECONNABORTED || errno == EINTR)
+	continue;
+      if (errno != EAGAIN)
+	fprintf(stderr, "[thread %u] Error accepting connection: %s\n", worker->worker_id, strerror(errno));
+      return;
+    }
+    if ((size_t) fd >= lean_conns_size) {
+      fprintf(stderr, "[thread %u] File descriptor %d over the limit of open files\n", worker->worker_id, fd);
+      close(fd);
+      continue;
+    }
+    lean_conns[fd].kind = LEAN_CONN;
+    lean_conns[fd].worker_id = worker->worker_id;
+    if (fd > worker->lean_max_fd)
+      worker->lean_max_fd = fd;
+    log_accept(worker, fd);
+    RELAXED_ADD(worker->accepted_conn, 1);
+    lean_watch(worker, fd, EPOLL_CTL_ADD, EPOLLIN);
+  }
+}
+
+/* Echoes back what is available on the connection. */
+static void lean_read(struct worker *worker, int fd)
+{
+  struct lean_conn *conn = &lean_conns[fd];
+  ssize_t len, sent;
+  len = recv(fd, worker->lean_rx, LEAN_BUFFER_SIZE, 0);
+  if (len <= 0) {
+    if (len < 0 && (errno == EAGAIN || errno == EINTR))
+      return;
+    /* EOF or error */
+    if (len < 0 && errno != ECONNRESET)
+      fprintf(stderr, "Error on connection: %s\n", strerror(errno));
+    lean_close(worker, fd);
+    return;
+  }
+  sent = send(fd, worker->lean_rx, len, MSG_NOSIGNAL);
+  if (sent < 0) {
+    if (errno != EAGAIN) {
+      lean_close(worker, fd);
+      return;
+    }
+    sent = 0;
+  }
+  worker->bytes_echoed += sent;
+  if (sent < len) {
+    /* The socket buffer is full: keep the rest, and stop reading until
+       it is sent. */
+    conn->buf = lean_get_buffer(worker);
+    memcpy(conn->buf, worker->lean_rx + sent, len - sent);
+    conn->buf_start = 0;
+    conn->buf_end = len - sent;
+    lean_watch(worker, fd, EPOLL_CTL_MOD, EPOLLOUT);
+  }
+}
+
+/* Sends data held for the connection, and resumes reading once done. */
+static void lean_write(struct worker *worker, int fd)
+{
+  struct lean_conn *conn = &lean_conns[fd];
+  ssize_t sent;
+  sent = send(fd, conn->buf + conn->buf_start, conn->buf_end - conn->buf_start, MSG_NOSIGNAL);
+  if (sent < 0) {
+    if (errno != EAGAIN && errno != EINTR)
+      lean_close(worker, fd);
+    return;
+  }
+  worker->bytes_echoed += sent;
+  conn->buf_start += sent;
+  if (conn->buf_start == conn->buf_end) {
+    lean_put_buffer(worker, conn->buf);
+    conn->buf = NULL;
+    lean_watch(worker, fd, EPOLL_CTL_MOD, EPOLLIN);
+  }
+}
+
+static void *lean_worker_main(void *ctx)
+{
+  struct worker *worker = ctx;
+  struct epoll_event events[LEAN_MAX_EVENTS];
+  int nb_events, fd;
+  while (1) {
+    nb_events = epoll_wait(worker->epoll_fd, events, LEAN_MAX_EVENTS, -1);
+    if (nb_events < 0) {
+      if (errno == EINTR)
+	continue;
+      perror("epoll_wait");
+      return NULL;
+    }
+    for (int i = 0; i < nb_events; i++) {
+      fd = events[i].data.fd;
+      switch (lean_conns[fd].kind) {
+      case LEAN_LISTENER:
+	lean_accept(worker, fd);
+	break;
+      case LEAN_CONN:
+	if (lean_conns[fd].buf != NULL)
+	  lean_write(worker, fd);
+	else
+	  lean_read(worker, fd);
+	break;
+      case LEAN_STOP:
+	return NULL;
+      }
+    }
+  }
+}
+
+/* Sets up the lean engine of a worker: epoll instance and listening
+   sockets.  Returns 0 on success. */
+static int lean_worker_init(struct worker *worker, struct addrlist *listen_addresses,
+			    uint16_t first_port, unsigned int nb_ports)
+{
+  worker->epoll_fd = epoll_create1(0);
+  if (worker->epoll_fd == -1) {
+    perror("Couldn't create epoll instance");
+    return -1;
+  }
+  worker->lean_rx = malloc(LEAN_BUFFER_SIZE);
+  worker->stop_fd = eventfd(0, EFD_NONBLOCK);
+  lean_conns[worker->stop_fd].kind = LEAN_STOP;
+  lean_watch(worker, worker->stop_fd, EPOLL_CTL_ADD, EPOLLIN);
+  if (open_listen_sockets(worker, listen_addresses, first_port, nb_ports) != 0)
+    return -1;
+  for (unsigned int l = 0; l < worker->nb_listeners; l++) {
+    lean_conns[worker->listen_fds[l]].kind = LEAN_LISTENER;
+    lean_watch(worker, worker->listen_fds[l], EPOLL_CTL_ADD, EPOLLIN);
+  }
+  return 0;
+}
+
+/* Frees the lean engine state of a worker, including its connections.
+   Lower file descriptors may belong to other workers. */
+static void lean_worker_free(struct worker *worker)
+{
+  for (int fd = 0; fd <= worker->lean_max_fd; fd++) {
+    if (lean_conns[fd].kind == LEAN_CONN && lean_conns[fd].worker_id == worker->worker_id)
+      lean_close(worker, fd);
+  }
+  for (unsigned int l = 0; l < worker->nb_listeners; l++)
+    close(worker->listen_fds[l]);
+  close(worker->stop_fd);
+  close(worker->epoll_fd);
+  for (unsigned int i = 0; i < worker->nb_free_bufs; i++)
+    free(worker->free_bufs[i]);
+  free(worker->free_bufs);
+  free(worker->lean_rx);
+  free(worker->listen_fds);
+}
+
+/* Returns the resident memory of the process in bytes, or 0 if unknown. */
+static unsigned long resident_memory()
+{
+  unsigned long size, resident;
+  FILE *statm = fopen("/proc/self/statm", "r");
+  if (statm == NULL)
+    return 0;
+  if (fscanf(statm, "%lu %lu", &size, &resident) != 2)
+    resident = 0;
+  fclose(statm);
+  return resident * sysconf(_SC_PAGESIZE);
 }
 
-static void
-accept_error_cb(struct evconnlistener *listener, void *ctx)
+/* Reads the number of connections dropped because the accept queue of a
+   listening socket was full (ListenOverflows in /proc/net/netstat).  This
+   counter covers the whole network namespace.  Returns 0 if unknown. */
+static unsigned long listen_overflows()
 {
-  struct event_base *base = evconnlistener_get_base(listener);
-  int err = EVUTIL_SOCKET_ERROR();
-  fprintf(stderr, "Got an error %d (%s) on the listener. "
-	  "Shutting down.\n", err, evutil_socket_error_to_string(err));
+  char names[8192], values[8192];
+  char *name, *value, *names_ptr, *values_ptr;
+  unsigned long overflows = 0;
+  FILE *netstat = fopen("/proc/net/netstat", "r");
+  if (netstat == NULL)
+    return 0;
+  /* Lines come in pairs: field names, then values. */
+  while (fgets(names, sizeof(names), netstat) != NULL
+	 && fgets(values, sizeof(values), netstat) != NULL) {
+    if (strncmp(names, "TcpExt:", 7) != 0)
+      continue;
+    name = strtok_r(names, " \n", &names_ptr);
+    value = strtok_r(values, " \n", &values_ptr);
+    while (name != NULL && value != NULL) {
+      if (strcmp(name, "ListenOverflows") == 0)
+	overflows = strtoul(value, NULL, 10);
+      name = strtok_r(NULL, " \n", &names_ptr);
+      value = strtok_r(NULL, " \n", &values_ptr);
+    }
+  }
+  fclose(netstat);
+  return overflows;
+}
 
-  event_base_loopexit(base, NULL);
+/* State of the periodic report of the main thread. */
+struct report {
+  struct timespec last_time;
+  unsigned long baseline_memory;
+  unsigned long first_overflows;
+  unsigned long last_overflows;
+  unsigned long last_accepted;
+  unsigned long last_open;
+  unsigned long peak_open;
+  double peak_bytes;
+  double peak_accept_rate;
+};
+
+static void report_init(struct report *report)
+{
+  memset(report, 0, sizeof(*report));
+  clock_gettime(CLOCK_MONOTONIC, &report->last_time);
+  report->baseline_memory = resident_memory();
+  report->first_overflows = report->last_overflows = listen_overflows();
+}
+
+/* Prints the accept rate, listen queue overflows, number of open
+   connections, and the user-space memory they use, i.e. the growth of
+   resident memory since startup, whenever one of them changed.  Keeps
+   track of the peaks. */
+static void print_report(struct report *report)
+{
+  unsigned long accepted = 0, open_conn = 0, overflows, resident;
+  double bytes_per_conn, accept_rate;
+  struct timespec now;
+  for (unsigned int i = 0; i < nb_threads; i++) {
+    unsigned long worker_accepted = RELAXED_LOAD(workers[i].accepted_conn);
+    accepted += worker_accepted;
+    open_conn += worker_accepted - RELAXED_LOAD(workers[i].closed_conn);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  overflows = listen_overflows();
+  accept_rate = (accepted - report->last_accepted) / TIMESPEC_DIFF(now, report->last_time);
+  report->last_time = now;
+  if (accepted == report->last_accepted && open_conn == report->last_open
+      && overflows == report->last_overflows)
+    return;
+  resident = resident_memory();
+  bytes_per_conn = open_conn == 0 ? 0. : ((double) resident - (double) report->baseline_memory) / open_conn;
+  printf("%lu connections open, %.0f accepted/s, %lu listen queue overflows, "
+	 "%.1f MiB resident, %.0f user-space bytes per connection\n",
+	 open_conn, accept_rate, overflows - report->last_overflows,
+	 resident / 1048576., bytes_per_conn);
+  fflush(stdout);
+  report->last_accepted = accepted;
+  report->last_open = open_conn;
+  report->last_overflows = overflows;
+  if (open_conn > report->peak_open) {
+    report->peak_open = open_conn;
+    report->peak_bytes = bytes_per_conn;
+  }
+  if (accept_rate > report->peak_accept_rate)
+    report->peak_accept_rate = accept_rate;
+}
+
+static void print_report_summary(struct report *report)
+{
+  if (report->peak_open > 0)
+    printf("Peak: %lu connections open (%.0f user-space bytes per connection), %.0f accepted/s\n",
+	   report->peak_open, report->peak_bytes, report->peak_accept_rate);
+  if (report->last_overflows > report->first_overflows)
+    printf("Warning: %lu connections dropped because a listen queue was full (ListenOverflows)\n",
+	   report->last_overflows - report->first_overflows);
+}
+
+/* Print per-thread counters, and the merged total, to see how evenly
+   the kernel spread connections across workers. */
+static void print_worker_stats()
+{
+  unsigned long total_accepted = 0, total_closed = 0, total_bytes = 0;
+  for (unsigned int i = 0; i < nb_threads; i++) {
+    total_accepted += workers[i].accepted_conn;
+    total_closed += workers[i].closed_conn;
+    total_bytes += workers[i].bytes_echoed;
+  }
+  for (unsigned int i = 0; i < nb_threads; i++) {
+    printf("Thread %u: %lu connections accepted (%.1f%%), %lu closed, %lu bytes echoed\n",
+	   i, workers[i].accepted_conn,
+	   total_accepted == 0 ? 0. : 100. * workers[i].accepted_conn / total_accepted,
+	   workers[i].closed_conn, workers[i].bytes_echoed);
+    if (engine == ENGINE_URING)
+      printf("Thread %u: %lu io_uring completions for %lu io_uring_enter() calls\n",
+	     i, workers[i].nb_completions, workers[i].ring.nb_enter);
+    if (engine == ENGINE_LEAN)
+      printf("Thread %u: %u pool buffers of %d bytes allocated\n",
+	     i, workers[i].nb_bufs, LEAN_BUFFER_SIZE);
+    if (dns_mode)
+      printf("Thread %u: %lu DNS answers sent, %lu invalid messages dropped\n",
+	     i, workers[i].dns_answers, workers[i].dns_invalid);
+    if (use_delay)
+      printf("Thread %u: %lu replies delayed, %lu pending at peak\n",
+	     i, workers[i].delayed_replies, workers[i].peak_pending);
+  }
+  printf("Total: %lu connections accepted, %lu closed, %lu bytes echoed\n",
+	 total_accepted, total_closed, total_bytes);
+}
+
+void usage(char* progname) {
+  fprintf(stderr, "usage: %s [-h] [-T threads] [-E engine] [-a addr-list] [-l n] [-d] [-A count] [-S size] [-D dist] [port|first_port-last_port]\n", progname);
+  fprintf(stderr, "Listens on the given TCP port or port range (default 4242) and echoes back anything sent to it.\n");
+  fprintf(stderr, "With option '-d', answer length-prefixed DNS queries instead of echoing them (messages that are not\n");
+  fprintf(stderr, "DNS queries are dropped).  Answers have [count] records (option '-A', default 1) with [size] bytes\n");
+  fprintf(stderr, "of data each (option '-S', default 4): A records for 4 bytes, TXT records otherwise, up to 64 KB in total.\n");
+  fprintf(stderr, "With option '-D', each reply (echoed message or DNS answer) is held for a random delay, drawn\n");
+  fprintf(stderr, "from 'const:<us>', 'exp:<mean_us>', 'bimodal:<p>:<us1>:<us2>' (us1 with probability p),\n");
+  fprintf(stderr, "or 'cdf:<file>' (empirical CDF, lines of '<us> <cumulative probability>'), with a resolution\n");
+  fprintf(stderr, "of %d us.  Replies of a connection are then framed, and may be reordered.\n", DELAY_TICK_USEC);
+  fprintf(stderr, "DNS mode and delays are only supported by the libevent engine.\n");
+  fprintf(stderr, "With option '-a', listen on the given comma-separated list of addresses or CIDR blocks\n");
+  fprintf(stderr, "instead of '::' (every address and port pair gets its own listening socket).\n");
+  fprintf(stderr, "With option '-T', run the given number of worker threads, each with its own\n");
+  fprintf(stderr, "event loop and its own SO_REUSEPORT listening socket.  By default, a single thread is used.\n");
+  fprintf(stderr, "Option '-E' selects the I/O engine: 'libevent' (default, bufferevents), or 'uring'\n");
+  fprintf(stderr, "(io_uring with multishot accept and recv, provided buffers, and linked sends), or 'lean'\n");
+  fprintf(stderr, "(raw epoll loop with 16 bytes of state per connection, and buffers only held while data is in flight).\n");
+  fprintf(stderr, "Every second, the accept rate, listen queue overflows, the number of open connections and\n");
+  fprintf(stderr, "the user-space memory they use are printed.\n");
+  fprintf(stderr, "With option '-l', log the address of one accepted connection out of n (by default, none).\n");
+  fprintf(stderr, "Per-thread statistics are printed when the server is stopped with SIGINT or SIGTERM.\n");
 }
 
 int main(int argc, char** argv)
 {
-  struct event_base *base;
-  struct evconnlistener *listener;
-  struct sockaddr_in6 sin;
+  struct sockaddr_storage sin;
+  socklen_t sin_len;
+  struct addrlist listen_addresses;
+  char *listen_spec = "::";
+  uint16_t first_port = 4242, last_port = 4242;
+  unsigned int nb_ports;
   struct rlimit limit_openfiles;
+  sigset_t stop_signals;
   FILE *nr_open;
   int ret;
-  int port = 4242;
+  int opt;
+  struct timespec one_second = {1, 0};
+  struct report report;
+  unsigned long dns_nb_records = 1, dns_rdata_size = 4;
+
+  while ((opt = getopt(argc, argv, "T:E:a:l:dA:S:D:h")) != -1) {
+    switch (opt) {
+    case 'T': /* Number of worker threads */
+      nb_threads = strtoul(optarg, NULL, 10);
+      break;
+    case 'a': /* Listen addresses */
+      listen_spec = optarg;
+      break;
+    case 'l': /* Accept log sampling */
+      log_accept_interval = strtoul(optarg, NULL, 10);
+      break;
+    case 'd': /* DNS mode */
+      dns_mode = 1;
+      break;
+    case 'A': /* Number of DNS answer records */
+      dns_nb_records = strtoul(optarg, NULL, 10);
+      break;
+    case 'S': /* Size of the data of DNS answer records */
+      dns_rdata_size = strtoul(optarg, NULL, 10);
+      break;
+    case 'D': /* Reply delay distribution */
+      if (delay_dist_parse(&delay_dist, optarg) != 0)
+	return 1;
+      use_delay = 1;
+      break;
+    case 'E': /* I/O engine */
+      if (strcmp(optarg, "libevent") == 0) {
+	engine = ENGINE_LIBEVENT;
+      } else if (strcmp(optarg, "uring") == 0) {
+	engine = ENGINE_URING;
+      } else if (strcmp(optarg, "lean") == 0) {
+	engine = ENGINE_LEAN;
+      } else {
+	fprintf(stderr, "Unknown engine '%s'\n", optarg);
+	usage(argv[0]);
+	return 1;
+      }
+      break;
+    case 'h': /* help */
+      usage(argv[0]);
+      return 0;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
 
-  if (argc > 1) {
-    port = atoi(argv[1]);
+  if (optind < argc) {
+    if (addrlist_parse_port_range(argv[optind], &first_port, &last_port) != 0)
+      return 1;
+  }
+  if (addrlist_parse(&listen_addresses, listen_spec) != 0) {
+    return 1;
+  }
+  nb_ports = last_port - first_port + 1;
+  if (listen_addresses.nb_addresses * nb_ports > MAX_LISTENERS) {
+    fprintf(stderr, "Too many listening sockets (at most %d addresses times ports)\n", MAX_LISTENERS);
+    return 1;
+  }
+  if (nb_threads == 0 || nb_threads > MAX_THREADS) {
+    fprintf(stderr, "Invalid number of threads (must be between 1 and %d)\n", MAX_THREADS);
+    return 1;
   }
-  if (port <= 0 || port > 65535) {
-    fprintf(stderr, "Invalid port\n");
+  if (dns_mode && engine != ENGINE_LIBEVENT) {
+    fprintf(stderr, "DNS mode is only supported by the libevent engine\n");
+    return 1;
+  }
+  if (use_delay && engine != ENGINE_LIBEVENT) {
+    fprintf(stderr, "Reply delays are only supported by the libevent engine\n");
+    return 1;
+  }
+  if (dns_mode && (dns_rdata_size == 0 || dns_template_init(&dns_template, dns_nb_records, dns_rdata_size) != 0)) {
+    fprintf(stderr, "Invalid DNS answers: %lu records of %lu bytes do not fit in a DNS message over TCP\n",
+	    dns_nb_records, dns_rdata_size);
     return 1;
   }
 
@@ -119,30 +1365,151 @@ int main(int argc, char** argv)
   }
   printf("Maximum number of TCP clients: %ld\n", limit_openfiles.rlim_cur);
 
-  base = event_base_new();
-  if (!base) {
-    fprintf(stderr, "Couldn't open event base\n");
-    return 1;
+  if (engine == ENGINE_LEAN) {
+    lean_conns_size = limit_openfiles.rlim_cur;
+    lean_conns = mmap(NULL, lean_conns_size * sizeof(struct lean_conn), PROT_READ | PROT_WRITE,
+		      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (lean_conns == MAP_FAILED) {
+      perror("Couldn't allocate connection state");
+      return 1;
+    }
   }
 
-  /* Clear the sockaddr before using it, in case there are extra
-   * platform-specific fields that can mess us up. */
-  memset(&sin, 0, sizeof(sin));
-  sin.sin6_family = AF_INET6;
-  /* Listen on the given port, on :: */
-  sin.sin6_port = htons(port);
-  listener = evconnlistener_new_bind(base, accept_conn_cb, NULL,
-				     LEV_OPT_CLOSE_ON_FREE|LEV_OPT_REUSEABLE, 8192,
-				     (struct sockaddr*)&sin, sizeof(sin));
-  if (!listener) {
-    perror("Couldn't create listener");
+  /* The main thread stops the workers' event loops, so event bases need
+     to be thread-safe. */
+  if (evthread_use_pthreads() != 0) {
+    fprintf(stderr, "Couldn't enable libevent thread support\n");
     return 1;
   }
+
+  /* Block stop signals in all threads: the main thread waits for them
+     explicitly with sigtimedwait(). */
+  sigemptyset(&stop_signals);
+  sigaddset(&stop_signals, SIGINT);
+  sigaddset(&stop_signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &stop_signals, NULL);
+
+  workers = calloc(nb_threads, sizeof(struct worker));
+  for (unsigned int i = 0; i < nb_threads; i++) {
+    workers[i].worker_id = i;
+    workers[i].nb_listeners = listen_addresses.nb_addresses * nb_ports;
+    if (engine == ENGINE_URING) {
+      if (uring_worker_init(&workers[i], &listen_addresses, first_port, nb_ports) != 0)
+	return 1;
+      continue;
+    }
+    if (engine == ENGINE_LEAN) {
+      if (lean_worker_init(&workers[i], &listen_addresses, first_port, nb_ports) != 0)
+	return 1;
+      continue;
+    }
+    if (use_delay) {
+      /* Delays are shorter than the default timer resolution of epoll. */
+      struct event_config *config = event_config_new();
+      event_config_set_flag(config, EVENT_BASE_FLAG_PRECISE_TIMER);
+      workers[i].base = event_base_new_with_config(config);
+      event_config_free(config);
+    } else {
+      workers[i].base = event_base_new();
+    }
+    if (!workers[i].base) {
+      fprintf(stderr, "Couldn't open event base\n");
+      return 1;
+    }
+    if (open_listen_sockets(&workers[i], &listen_addresses, first_port, nb_ports) != 0)
+      return 1;
+    workers[i].listen_events = calloc(workers[i].nb_listeners, sizeof(struct event*));
+    for (unsigned int l = 0; l < workers[i].nb_listeners; l++) {
+      workers[i].listen_events[l] = event_new(workers[i].base, workers[i].listen_fds[l],
+					      EV_READ|EV_PERSIST, accept_conn_cb, &workers[i]);
+      event_add(workers[i].listen_events[l], NULL);
+    }
+    if (use_delay) {
+      timer_wheel_init(&workers[i].wheel, wheel_now());
+      srand48_r(i + 1, &workers[i].rand_state);
+      workers[i].wheel_event = event_new(workers[i].base, -1, EV_PERSIST, wheel_tick, &workers[i]);
+    }
+  }
   char l_host[NI_MAXHOST];
-  char l_port[NI_MAXSERV];
-  getnameinfo((struct sockaddr*)&sin, sizeof(sin), l_host, NI_MAXHOST,
-	      l_port, NI_MAXSERV, NI_NUMERICHOST | NI_NUMERICSERV);
-  printf("Listening on %s port %s\n", l_host, l_port);
-  evconnlistener_set_error_cb(listener, accept_error_cb);
-  return event_base_dispatch(base);
+  if (listen_addresses.nb_addresses > 8)
+    printf("Listening on %lu addresses:\n", listen_addresses.nb_addresses);
+  for (uint64_t a = 0; a < listen_addresses.nb_addresses && a < 8; a++) {
+    sin_len = addrlist_get(&listen_addresses, a, first_port, &sin);
+    getnameinfo((struct sockaddr*)&sin, sin_len, l_host, NI_MAXHOST,
+		NULL, 0, NI_NUMERICHOST);
+    if (nb_ports == 1)
+      printf("Listening on %s port %u with %u thread(s)\n", l_host, first_port, nb_threads);
+    else
+      printf("Listening on %s ports %u-%u with %u thread(s)\n", l_host, first_port, last_port, nb_threads);
+  }
+  fflush(stdout);
+
+  for (unsigned int i = 0; i < nb_threads; i++) {
+    void *(*main_func)(void *) = worker_main;
+    if (engine == ENGINE_URING)
+      main_func = uring_worker_main;
+    else if (engine == ENGINE_LEAN)
+      main_func = lean_worker_main;
+    ret = pthread_create(&workers[i].thread, NULL, main_func, &workers[i]);
+    if (ret != 0) {
+      fprintf(stderr, "Failed to create worker thread: %s\n", strerror(ret));
+      return 1;
+    }
+  }
+
+  /* Report connection statistics every second, until we are asked to
+     stop.  The memory used before accepting any connection is the
+     baseline. */
+  report_init(&report);
+  while (sigtimedwait(&stop_signals, NULL, &one_second) == -1) {
+    if (errno != EAGAIN && errno != EINTR) {
+      perror("sigtimedwait");
+      break;
+    }
+    print_report(&report);
+  }
+  /* Then stop all workers. */
+  for (unsigned int i = 0; i < nb_threads; i++) {
+    if (engine != ENGINE_LIBEVENT) {
+      uint64_t one = 1;
+      if (write(workers[i].stop_fd, &one, sizeof(one)) != sizeof(one))
+	perror("Failed to stop worker");
+    } else {
+      event_base_loopbreak(workers[i].base);
+    }
+  }
+  for (unsigned int i = 0; i < nb_threads; i++) {
+    pthread_join(workers[i].thread, NULL);
+  }
+  print_worker_stats();
+  print_report_summary(&report);
+
+  for (unsigned int i = 0; i < nb_threads; i++) {
+    if (engine == ENGINE_URING) {
+      uring_worker_free(&workers[i]);
+      continue;
+    }
+    if (engine == ENGINE_LEAN) {
+      lean_worker_free(&workers[i]);
+      continue;
+    }
+    for (unsigned int l = 0; l < workers[i].nb_listeners; l++) {
+      event_free(workers[i].listen_events[l]);
+      close(workers[i].listen_fds[l]);
+    }
+    free(workers[i].listen_events);
+    free(workers[i].listen_fds);
+    if (workers[i].wheel_event != NULL)
+      event_free(workers[i].wheel_event);
+    event_base_free(workers[i].base);
+  }
+  free(workers);
+  if (dns_mode)
+    dns_template_free(&dns_template);
+  if (use_delay)
+    delay_dist_free(&delay_dist);
+  if (lean_conns != NULL)
+    munmap(lean_conns, lean_conns_size * sizeof(struct lean_conn));
+  addrlist_free(&listen_addresses);
+  return 0;
 }
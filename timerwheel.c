@@ -0,0 +1,108 @@
+#include <string.h>
+
+#include "timerwheel.h"
+
+/* Number of bits of the tick number used by each level */
+#define SLOT_BITS 8
+
+void timer_wheel_init(struct timer_wheel *wheel, uint64_t now)
+{
+  memset(wheel, 0, sizeof(*wheel));
+  wheel->current = now;
+}
+
+void timer_wheel_reset(struct timer_wheel *wheel, uint64_t now)
+{
+  if (wheel->count == 0 && now > wheel->current)
+    wheel->current = now;
+}
+
+/* Inserts a timer in the slot matching its expiry, which must not be in
+   the past, without counting it. */
+static void _insert(struct timer_wheel *wheel, struct timer_wheel_entry *entry)
+{
+  uint64_t delta;
+  unsigned int level = 0;
+  delta = entry->expiry - wheel->current;
+  while (level < TIMER_WHEEL_LEVELS - 1 && delta >= (uint64_t) 1 << (SLOT_BITS * (level + 1)))
+    level++;
+  if (delta >= (uint64_t) 1 << (SLOT_BITS * TIMER_WHEEL_LEVELS)) {
+    /* Too far away: clamp to the furthest slot of the last level */
+    entry->expiry = wheel->current + ((uint64_t) 1 << (SLOT_BITS * TIMER_WHEEL_LEVELS)) - 1;
+  }
+  struct timer_wheel_entry **slot =
+    &wheel->slots[level][(entry->expiry >> (SLOT_BITS * level)) & (TIMER_WHEEL_SLOTS - 1)];
+  entry->next = *slot;
+  if (entry->next != NULL)
+    entry->next->pprev = &entry->next;
+  entry->pprev = slot;
+  *slot = entry;
+}
+
+/* Unlinks a timer from its slot, without uncounting it. */
+static void _unlink(struct timer_wheel_entry *entry)
+{
+  *entry->pprev = entry->next;
+  if (entry->next != NULL)
+    entry->next->pprev = entry->pprev;
+  entry->pprev = NULL;
+}
+
+void timer_wheel_add(struct timer_wheel *wheel, struct timer_wheel_entry *entry, uint64_t expiry)
+{
+  /* The slot of the current tick has already expired. */
+  entry->expiry = expiry > wheel->current ? expiry : wheel->current + 1;
+  _insert(wheel, entry);
+  wheel->count++;
+}
+
+void timer_wheel_remove(struct timer_wheel *wheel, struct timer_wheel_entry *entry)
+{
+  if (entry->pprev == NULL)
+    return;
+  _unlink(entry);
+  wheel->count--;
+}
+
+int timer_wheel_pending(const struct timer_wheel_entry *entry)
+{
+  return entry->pprev != NULL;
+}
+
+/* Moves the timers of slot [index] of [level] down to lower levels. */
+static void _cascade(struct timer_wheel *wheel, unsigned int level, unsigned int index)
+{
+  struct timer_wheel_entry *entry;
+  /* Timers of this slot are due within 256^level ticks: they never go
+     back to the same slot. */
+  while ((entry = wheel->slots[level][index]) != NULL) {
+    _unlink(entry);
+    _insert(wheel, entry);
+  }
+}
+
+void timer_wheel_advance(struct timer_wheel *wheel, uint64_t now, timer_wheel_cb cb, void *ctx)
+{
+  struct timer_wheel_entry *entry;
+  unsigned int level, index;
+  while (wheel->current < now) {
+    wheel->current++;
+    /* When a level wraps around, the next slot of the level above is
+       due: move its timers down, starting from the highest level. */
+    for (level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+      if ((wheel->current & (((uint64_t) 1 << (SLOT_BITS * level)) - 1)) != 0)
+	break;
+    }
+    while (--level > 0)
+      _cascade(wheel, level, (wheel->current >> (SLOT_BITS * level)) & (TIMER_WHEEL_SLOTS - 1));
+    /* Expire timers one at a time, so that the callback can remove
+       other timers of the same slot.  New timers never go to the slot
+       of the current tick. */
+    index = wheel->current & (TIMER_WHEEL_SLOTS - 1);
+    while ((entry = wheel->slots[0][index]) != NULL) {
+      _unlink(entry);
+      wheel->count--;
+      cb(entry, ctx);
+    }
+  }
+}
@@ -0,0 +1,51 @@
+#include <stdint.h>
+
+/* Hierarchical timer wheel: O(1) insertion and expiry of timers, with a
+   resolution of one tick.  Level 0 has one slot per tick, and each slot
+   of level l covers 256^l ticks: timers move down one level when the
+   wheel reaches their slot, until they expire from level 0.  Timers
+   further than 256^TIMER_WHEEL_LEVELS ticks away are clamped. */
+#define TIMER_WHEEL_LEVELS 4
+#define TIMER_WHEEL_SLOTS 256
+
+/* Timer entry, to be embedded in the structure of the caller.  Entries
+   passed to timer_wheel_remove() or timer_wheel_pending() must be zeroed
+   before their first use. */
+struct timer_wheel_entry {
+  struct timer_wheel_entry *next;
+  /* Pointer to the pointer to this entry in its slot, NULL when the
+     timer is not in the wheel. */
+  struct timer_wheel_entry **pprev;
+  uint64_t expiry;
+};
+
+struct timer_wheel {
+  /* Current tick: every timer up to this tick has expired. */
+  uint64_t current;
+  /* Number of timers in the wheel */
+  uint64_t count;
+  struct timer_wheel_entry *slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+};
+
+typedef void (*timer_wheel_cb)(struct timer_wheel_entry *entry, void *ctx);
+
+void timer_wheel_init(struct timer_wheel *wheel, uint64_t now);
+
+/* Moves the current tick of an empty wheel to [now], so that advancing
+   it does not go through all ticks since the last timer expired. */
+void timer_wheel_reset(struct timer_wheel *wheel, uint64_t now);
+
+/* Adds a timer expiring at tick [expiry].  Timers in the past expire on
+   the next call to timer_wheel_advance(). */
+void timer_wheel_add(struct timer_wheel *wheel, struct timer_wheel_entry *entry, uint64_t expiry);
+
+/* Removes a timer before it expires.  Does nothing if the timer is not
+   in the wheel. */
+void timer_wheel_remove(struct timer_wheel *wheel, struct timer_wheel_entry *entry);
+
+/* Returns whether the timer is in the wheel. */
+int timer_wheel_pending(const struct timer_wheel_entry *entry);
+
+/* Advances the wheel up to tick [now], calling [cb] for each expired
+   timer.  The callback may add and remove timers. */
+void timer_wheel_advance(struct timer_wheel *wheel, uint64_t now, timer_wheel_cb cb, void *ctx);
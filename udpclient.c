@@ -1,9 +1,12 @@
+/* For sendmmsg() and recvmmsg() */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <getopt.h>
 #include <string.h>
 #include <errno.h>
+#include <limits.h>
 #include <math.h>
 #include <arpa/inet.h>
 #include <event2/event.h>
@@ -12,23 +15,49 @@
 #include <sys/resource.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/udp.h>
 #include <netdb.h>
 #include <time.h>
 
 #include "common.h"
 
+/* Maximum number of queries sent in a single scheduler tick, with
+   --batch.  When more queries are due, they are sent in several
+   batches. */
+#define SEND_BATCH_SIZE 1024
+
+/* Maximum number of datagrams read by a single recvmmsg() call. */
+#define RECV_BATCH_SIZE 64
+
+/* Maximum number of segments in a single UDP GSO send (kernel limit). */
+#define GSO_MAX_SEGMENTS 64
+
+/* Size of receive buffers: large enough for a GRO-coalesced packet with
+   --gso, or for a single DNS answer otherwise. */
+#define RECV_BUFFER_SIZE_GRO 65536
+#define RECV_BUFFER_SIZE 512
+
+/* Size of our DNS query (example.com, type A). */
+#define QUERY_SIZE 29
 
 struct udp_connection {
   /* Event associated with this connection. */
   struct event* event;
   /* ID of the connection, mostly for logging purpose. */
   uint32_t connection_id;
-  /* Current query ID, incremented for each query and used to index the
-     query_timestamps array. */
-  uint16_t query_id;
-  /* Used to remember when we sent the last [max_queries_in_flight]
-     queries, to compute a RTT. */
-  struct timespec* query_timestamps;
+  /* Outstanding queries, to compute RTTs and detect lost queries. */
+  struct query_table queries;
+  /* With --batch: number of queries queued on this connection during the
+     current tick, and position of the first one in the sorted batch. */
+  unsigned int batch_count;
+  unsigned int batch_first;
+};
+
+/* A query queued with --batch, waiting for the end of the tick. */
+struct pending_query {
+  struct udp_connection *conn;
+  struct outstanding_query *query;
+  uint32_t process_id;
 };
 
 struct callback_data {
@@ -39,6 +68,133 @@ struct callback_data {
 /* Array of all UDP connections */
 struct udp_connection *connections;
 
+/* DNS query for example.com (with type A) */
+static const char query_template[QUERY_SIZE] = {
+  0xff, 0xff, /* Query ID */
+  0x01, 0x00, 0x00, 0x01, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x07, 0x65, 0x78, 0x61,
+  0x6d, 0x70, 0x6c, 0x65, 0x03, 0x63, 0x6f, 0x6d,
+  0x00, 0x00, 0x01, 0x00, 0x01
+};
+
+/* RTTs of all answers (--hist) */
+static struct histogram rtt_histogram;
+
+/* Timeouts and loss counters of all connections */
+static struct query_tracker tracker;
+
+/* Schedule lag of all queries (live statistics) */
+static struct histogram lag_histogram;
+
+/* Batched I/O (--batch): queries due during a scheduler tick are queued,
+   and sent with sendmmsg() (or a single UDP GSO send per socket with
+   --gso) once all timers of the tick have run.  Answers are read with
+   recvmmsg() until the socket is drained.  UDP GRO is enabled on
+   sockets with --gso, and stays enabled even if GSO sends turn out not
+   to be supported. */
+static short use_batch = 0;
+static short use_gso = 0;
+static short use_gro = 0;
+static struct pending_query pending_queries[SEND_BATCH_SIZE];
+static unsigned int nb_pending_queries = 0;
+/* Run at the end of the current event loop iteration to send queued
+   queries. */
+static struct event *flush_event;
+/* Receive buffers of recvmmsg(), RECV_BATCH_SIZE of them */
+static char *recv_bufs;
+static size_t recv_buf_size;
+
+/* Number of queries sent (or queued with --batch) so far */
+static unsigned long queries_sent = 0;
+/* Number of queries that could not be sent */
+static unsigned long send_errors = 0;
+/* Number of answers received, and their size */
+static unsigned long answers_received = 0;
+static unsigned long bytes_received = 0;
+
+/* Processes an answer received at [now] (and [now_realtime], only set
+   when printing RTTs). */
+static void handle_answer(struct udp_connection *conn, const char *buf, size_t len,
+			  const struct timespec *now, const struct timespec *now_realtime)
+{
+  uint16_t query_id;
+  struct outstanding_query *query;
+  struct timespec rtt, lag;
+  int outcome;
+  answers_received++;
+  bytes_received += len;
+  if (len < 2) {
+    return;
+  }
+  /* Extract query ID in the answer (assuming it is either a real DNS
+     answer, or just our query being reflected back to us). */
+  DO_NTOHS(query_id, buf);
+  outcome = query_table_answer(&conn->queries, &tracker, query_id, now, &query);
+  if (outcome != ANSWER_ON_TIME && outcome != ANSWER_LATE) {
+    return;
+  }
+  /* Compute RTT, in microseconds.  Late answers are logged, but not
+     counted in latency percentiles. */
+  subtract_timespec(&rtt, now, &query->sent);
+  if (use_histogram && outcome == ANSWER_ON_TIME) {
+    histogram_record(&rtt_histogram, (rtt.tv_nsec / 1000) + (1000000 * rtt.tv_sec));
+  }
+  if (!print_rtt) {
+    return;
+  }
+  subtract_timespec(&lag, &query->sent, &query->intended);
+  log_answer(0, now_realtime, conn->connection_id, query->seq, &rtt, &lag);
+}
+
+/* Drains the socket with recvmmsg().  With UDP GRO, each received buffer
+   may hold several datagrams of the same size, given by a control
+   message. */
+static void read_answers_batch(struct udp_connection *conn, evutil_socket_t sock)
+{
+  static struct mmsghdr msgs[RECV_BATCH_SIZE];
+  static struct iovec iovecs[RECV_BATCH_SIZE];
+  static char controls[RECV_BATCH_SIZE][CMSG_SPACE(sizeof(int))];
+  struct timespec now, now_realtime;
+  struct cmsghdr *cmsg;
+  int nb_msgs;
+  size_t segment_size, len;
+
+  do {
+    for (int i = 0; i < RECV_BATCH_SIZE; i++) {
+      iovecs[i].iov_base = recv_bufs + i * recv_buf_size;
+      iovecs[i].iov_len = recv_buf_size;
+      memset(&msgs[i].msg_hdr, 0, sizeof(struct msghdr));
+      msgs[i].msg_hdr.msg_iov = &iovecs[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+      if (use_gro) {
+	msgs[i].msg_hdr.msg_control = controls[i];
+	msgs[i].msg_hdr.msg_controllen = sizeof(controls[i]);
+      }
+    }
+    nb_msgs = recvmmsg(sock, msgs, RECV_BATCH_SIZE, MSG_DONTWAIT, NULL);
+    if (nb_msgs <= 0)
+      continue;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (print_rtt) {
+      clock_gettime(CLOCK_REALTIME, &now_realtime);
+    }
+    for (int i = 0; i < nb_msgs; i++) {
+      len = msgs[i].msg_len;
+      segment_size = len;
+      for (cmsg = CMSG_FIRSTHDR(&msgs[i].msg_hdr); cmsg != NULL;
+	   cmsg = CMSG_NXTHDR(&msgs[i].msg_hdr, cmsg)) {
+	if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO)
+	  segment_size = *(int*) CMSG_DATA(cmsg);
+      }
+      for (size_t offset = 0; offset < len; offset += segment_size) {
+	handle_answer(conn, recv_bufs + i * recv_buf_size + offset,
+		      len - offset < segment_size ? len - offset : segment_size,
+		      &now, &now_realtime);
+      }
+    }
+  } while (nb_msgs == RECV_BATCH_SIZE);
+}
+
 static void ev_callback(evutil_socket_t fd, short events, void *ctx)
 {
   static char buf[256];
@@ -49,79 +205,245 @@ static void ev_callback(evutil_socket_t fd, short events, void *ctx)
   struct udp_connection *conn = ctx;
   evutil_socket_t sock;
   ssize_t ret;
-  uint16_t query_id;
-  struct timespec* query_timestamp;
-  struct timespec now, rtt;
+  struct timespec now;
   /* Used for logging, because "now" uses a monotonic clock. */
   struct timespec now_realtime;
-  if (!print_rtt) {
-    /* Just discard the message to avoid filling OS buffer. */
-    sock = event_get_fd(conn->event);
-    read(sock, buf, sizeof(buf));
+  sock = event_get_fd(conn->event);
+  if (use_batch) {
+    read_answers_batch(conn, sock);
     return;
   }
   clock_gettime(CLOCK_MONOTONIC, &now);
-  clock_gettime(CLOCK_REALTIME, &now_realtime);
-  sock = event_get_fd(conn->event);
+  if (print_rtt) {
+    clock_gettime(CLOCK_REALTIME, &now_realtime);
+  }
   ret = read(sock, buf, sizeof(buf));
-  if (ret == -1 || ret < 2) {
+  if (ret == -1) {
     return;
   }
-  /* Extract query ID in the answer (assuming it is either a real DNS
-     answer, or just our query being reflected back to us). */
-  DO_NTOHS(query_id, buf);
-  /* Compute RTT, in microseconds */
-  query_timestamp = &conn->query_timestamps[query_id % max_queries_in_flight];
-  subtract_timespec(&rtt, &now, query_timestamp);
-  /* CSV format: type (Answer), timestamp at the time of reception
-     (answer), connection ID, query ID, unused, unused, computed RTT in µs */
-  printf("A,%lu.%.9lu,%u,%u,,,%lu\n",
-	 now_realtime.tv_sec, now_realtime.tv_nsec,
-	 conn->connection_id,
-	 query_id,
-	 (rtt.tv_nsec / 1000) + (1000000 * rtt.tv_sec));
+  handle_answer(conn, buf, ret, &now, &now_realtime);
 }
 
-static void send_query(struct udp_connection* conn)
+/* Sends a query on the given connection.  [intended] is the time at
+   which the query should have been sent, according to the Poisson
+   schedule.  Returns the query, as recorded in the table of the
+   connection. */
+static struct outstanding_query *send_query(struct udp_connection* conn, const struct timespec *intended)
 {
-  /* DNS query for example.com (with type A) */
-  static char data[] = {
-    0xff, 0xff, /* Query ID */
-    0x01, 0x00, 0x00, 0x01, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00, 0x07, 0x65, 0x78, 0x61,
-    0x6d, 0x70, 0x6c, 0x65, 0x03, 0x63, 0x6f, 0x6d,
-    0x00, 0x00, 0x01, 0x00, 0x01
-  };
+  static char data[QUERY_SIZE];
   ssize_t ret;
   evutil_socket_t sock = event_get_fd(conn->event);
-  /* Copy query ID */
-  DO_HTONS(data, conn->query_id);
-  /* Record timestamp */
-  clock_gettime(CLOCK_MONOTONIC, &conn->query_timestamps[conn->query_id % max_queries_in_flight]);
+  struct outstanding_query *query;
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  query = query_table_send(&conn->queries, &tracker, intended, &now);
+  record_schedule_lag(&lag_histogram, &now, intended);
+  memcpy(data, query_template, QUERY_SIZE);
+  /* Copy query ID: the low 16 bits of the sequence number */
+  DO_HTONS(data, (uint16_t) query->seq);
   ret = send(sock, data, sizeof(data), 0);
   if (ret == -1) {
     perror("Error sending query");
+    send_errors++;
+  }
+  return query;
+}
+
+/* Sends the [count] queued queries of a connection, starting at
+   [queries], with a single sendmmsg() call, or with UDP GSO sends of up
+   to GSO_MAX_SEGMENTS queries each. */
+static void send_batch(struct udp_connection *conn, const struct pending_query *queries,
+		       unsigned int count)
+{
+  static char data[SEND_BATCH_SIZE][QUERY_SIZE];
+  static struct mmsghdr msgs[SEND_BATCH_SIZE];
+  static struct iovec iovecs[SEND_BATCH_SIZE];
+  static char control[CMSG_SPACE(sizeof(uint16_t))];
+  evutil_socket_t sock = event_get_fd(conn->event);
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  unsigned int sent = 0, segments;
+  int ret;
+
+  for (unsigned int i = 0; i < count; i++) {
+    memcpy(data[i], query_template, QUERY_SIZE);
+    DO_HTONS(data[i], (uint16_t) queries[i].query->seq);
+  }
+  while (use_gso && count - sent > 1) {
+    /* Queries are contiguous in [data], and all have the same size: the
+       kernel splits the buffer into QUERY_SIZE datagrams. */
+    uint16_t gso_size = QUERY_SIZE;
+    segments = count - sent > GSO_MAX_SEGMENTS ? GSO_MAX_SEGMENTS : count - sent;
+    iov.iov_base = data[sent];
+    iov.iov_len = segments * QUERY_SIZE;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_UDP;
+    cmsg->cmsg_type = UDP_SEGMENT;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+    memcpy(CMSG_DATA(cmsg), &gso_size, sizeof(gso_size));
+    ret = sendmsg(sock, &msg, 0);
+    if (ret == -1 && (errno == EINVAL || errno == EIO || errno == EOPNOTSUPP)) {
+      perror("UDP GSO not supported, falling back to sendmmsg");
+      use_gso = 0;
+      break;
+    }
+    if (ret == -1) {
+      /* Transient error (e.g. ENOBUFS): these queries are lost, but GSO
+	 is kept for the next ones. */
+      perror("Error sending queries");
+      send_errors += segments;
+    }
+    sent += segments;
+  }
+  if (sent == count)
+    return;
+  for (unsigned int i = sent; i < count; i++) {
+    iovecs[i].iov_base = data[i];
+    iovecs[i].iov_len = QUERY_SIZE;
+    memset(&msgs[i].msg_hdr, 0, sizeof(struct msghdr));
+    msgs[i].msg_hdr.msg_iov = &iovecs[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+  while (sent < count) {
+    ret = sendmmsg(sock, &msgs[sent], count - sent, 0);
+    if (ret == -1) {
+      perror("Error sending queries");
+      send_errors += count - sent;
+      return;
+    }
+    sent += ret;
   }
-  conn->query_id += 1;
+}
+
+/* Sends all queries queued during the current tick.  Queries are grouped
+   by connection (counting sort), so that each socket gets a single batch
+   send. */
+static void flush_pending_queries(evutil_socket_t fd, short events, void *ctx)
+{
+  static struct pending_query sorted[SEND_BATCH_SIZE];
+  static struct udp_connection *dirty[SEND_BATCH_SIZE];
+  unsigned int nb_dirty = 0, offset = 0;
+  struct udp_connection *conn;
+  struct outstanding_query *query;
+  struct timespec now, now_realtime, lag;
+
+  if (nb_pending_queries == 0)
+    return;
+  for (unsigned int i = 0; i < nb_pending_queries; i++) {
+    conn = pending_queries[i].conn;
+    if (conn->batch_count++ == 0)
+      dirty[nb_dirty++] = conn;
+  }
+  for (unsigned int i = 0; i < nb_dirty; i++) {
+    dirty[i]->batch_first = offset;
+    offset += dirty[i]->batch_count;
+    dirty[i]->batch_count = 0;
+  }
+  for (unsigned int i = 0; i < nb_pending_queries; i++) {
+    conn = pending_queries[i].conn;
+    sorted[conn->batch_first + conn->batch_count++] = pending_queries[i];
+  }
+
+  /* All queries of the batch share the same send timestamp. */
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if (print_rtt) {
+    clock_gettime(CLOCK_REALTIME, &now_realtime);
+  }
+  for (unsigned int i = 0; i < nb_dirty; i++) {
+    conn = dirty[i];
+    for (unsigned int q = conn->batch_first; q < conn->batch_first + conn->batch_count; q++) {
+      query = sorted[q].query;
+      query->sent = now;
+      record_schedule_lag(&lag_histogram, &now, &query->intended);
+      if (print_rtt) {
+	subtract_timespec(&lag, &query->sent, &query->intended);
+	log_query(0, &now_realtime, conn->connection_id, query->seq,
+		  sorted[q].process_id, &lag);
+      }
+    }
+    send_batch(conn, &sorted[conn->batch_first], conn->batch_count);
+    conn->batch_count = 0;
+  }
+  nb_pending_queries = 0;
+}
+
+/* Queues a query, to be sent at the end of the current tick.  Its
+   timeout starts now, and its send time is set when the batch is sent. */
+static void queue_query(struct udp_connection *conn, struct poisson_process *process)
+{
+  struct timespec now;
+  if (nb_pending_queries == SEND_BATCH_SIZE)
+    flush_pending_queries(-1, EV_TIMEOUT, NULL);
+  if (nb_pending_queries == 0)
+    event_active(flush_event, EV_TIMEOUT, 0);
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  pending_queries[nb_pending_queries].conn = conn;
+  pending_queries[nb_pending_queries].query = query_table_send(&conn->queries, &tracker,
+							       &process->current_event, &now);
+  pending_queries[nb_pending_queries].process_id = process->process_id;
+  nb_pending_queries++;
 }
 
 static void send_query_callback(void *ctx)
 {
-  static struct timespec now_realtime;
+  struct timespec now_realtime, lag;
   struct udp_connection *connection;
+  struct outstanding_query *query;
   struct callback_data *data = ctx;
   /* Select a UDP connection uniformly at random and send a query on it. */
-  connection = &data->connections[lrand48() % nb_conn];
+  connection = &data->connections[thread_lrand48() % nb_conn];
+  queries_sent++;
+  if (use_batch) {
+    queue_query(connection, data->process);
+    return;
+  }
+  query = send_query(connection, &data->process->current_event);
   if (print_rtt) {
     clock_gettime(CLOCK_REALTIME, &now_realtime);
-    /* CSV format: type (Query), timestamp, connection ID, query ID, Poisson ID, poisson interval (in µs), unused. */
-    printf("Q,%lu.%.9lu,%u,%u,%u,,\n",
-	   now_realtime.tv_sec, now_realtime.tv_nsec,
-	   connection->connection_id,
-	   connection->query_id,
-	   data->process->process_id);
-  }
-  send_query(connection);
+    subtract_timespec(&lag, &query->sent, &query->intended);
+    log_query(0, &now_realtime, connection->connection_id, query->seq,
+	      data->process->process_id, &lag);
+  }
+}
+
+static unsigned long thread_queries_sent()
+{
+  return queries_sent;
+}
+
+static unsigned long total_queries_sent()
+{
+  return queries_sent;
+}
+
+/* A single thread, whose UDP sockets are all up. */
+static void read_thread_counters(unsigned int thread, struct thread_counters *counters)
+{
+  counters->sent = queries_sent;
+  counters->answers = answers_received;
+  counters->bytes_sent = queries_sent * QUERY_SIZE;
+  counters->bytes_received = bytes_received;
+  counters->conn_up = nb_conn;
+  counters->conn_down = 0;
+}
+
+/* Starts the rate controller when queries start being sent, at the
+   initial rate given by [ctx].  With a fixed rate and duration, the
+   whole run is a single phase. */
+static void start_rate_control(evutil_socket_t fd, short events, void *ctx)
+{
+  double *initial_rate = ctx;
+  rate_controller_start(*initial_rate);
+  if (nb_phases > 0 && stdin_commands == 0)
+    start_phase();
+  if (search.slo_us > 0)
+    search_start();
 }
 
 static void add_poisson_sender()
@@ -132,6 +454,8 @@ static void add_poisson_sender()
   callback_arg->connections = connections;
   poisson_set_callback(process, send_query_callback, callback_arg);
   poisson_set_rate(process, poisson_rate);
+  if (use_absolute)
+    poisson_set_absolute(process);
   int ret = poisson_start_process(process, NULL);
   if (ret != 0) {
     fprintf(stderr, "Failed to start Poisson process %u\n", process->process_id);
@@ -139,7 +463,7 @@ static void add_poisson_sender()
 }
 
 void usage(char* progname) {
-  fprintf(stderr, "usage: %s [-h] [-v] [-R] [-s random_seed] [-t duration]  [--stdin]  [--stdin-rateslope]  -p <port>  -r <rate>  -c <nb_conn>  <host>\n",
+  fprintf(stderr, "usage: %s [-h] [-v] [-R] [-s random_seed] [-t duration]  [--stdin]  [--stdin-rateslope]  [--merged]  [--absolute]  [--hist interval]  [--rtt-log file]  [--batch]  [--gso]  [--search p99_us [--search-loss f] [--search-step s] [--search-warmup s]]  [--timeout ms]  [--stats ms]  [--stats-port port]  -p <port>  -r <rate>  -c <nb_conn>  <host>\n",
 	  progname);
   fprintf(stderr, "Connects to the specified host and port, with the chosen number of UDP connections.\n");
   fprintf(stderr, "[rate] is the total number of writes per second towards the server, accross all UDP connections.\n");
@@ -148,10 +472,37 @@ void usage(char* progname) {
   fprintf(stderr, "With option '-t', only send queries for the given amount of seconds.\n");
   fprintf(stderr, "With option '--stdin', the program ignores 'rate' and 'duration' and expects them\n");
   fprintf(stderr, "to be given on stdin as a sequence of '<duration_ms> <rate>' lines, with a first line giving the number of subsequent lines.\n");
+  fprintf(stderr, "Each rate is applied right away, and the target and achieved rates of each line (or of the whole run\n");
+  fprintf(stderr, "with '-t') are printed on stderr.\n");
   fprintf(stderr, "With option '--stdin-rateslope', the program starts from 'rate' qps, and expects\n");
   fprintf(stderr, "a sequence of '<duration_ms> <slope>' lines to be given on stdin, where each\n");
   fprintf(stderr, "'slope' in qps/s indicates how much to increase or decrease the query rate. The first line\n");
   fprintf(stderr, "must give the number of subsequent lines.\n");
+  fprintf(stderr, "With option '--merged', a single timer drives the aggregate Poisson query rate,\n");
+  fprintf(stderr, "instead of one timer per Poisson process.\n");
+  fprintf(stderr, "With option '--absolute', queries are scheduled against absolute intended send times, so that\n");
+  fprintf(stderr, "delays in the event loop don't add up (this is always the case with '--merged').\n");
+  fprintf(stderr, "The 'schedule_lag_us' CSV column gives how late each query was sent compared to its intended time.\n");
+  fprintf(stderr, "With option '--hist', keep an in-memory RTT histogram, and print latency percentiles on stderr\n");
+  fprintf(stderr, "every 'interval' seconds (0 for never) and at exit.  This is much cheaper than '-R'.\n");
+  fprintf(stderr, "With option '--rtt-log', queries and answers are written to the given file as fixed-size binary\n");
+  fprintf(stderr, "records (by a background thread), instead of CSV on stdout.  Use rttlog2csv to convert it to CSV.\n");
+  fprintf(stderr, "With option '--batch', queries due in the same scheduler tick are sent with a single sendmmsg()\n");
+  fprintf(stderr, "per socket, and answers are read with recvmmsg() until the socket is drained.\n");
+  fprintf(stderr, "Option '--gso' implies '--batch', and additionally uses UDP GSO to send the queries of a socket\n");
+  fprintf(stderr, "in a single buffer, and UDP GRO to receive coalesced answers.\n");
+  fprintf(stderr, "With option '--search', look for the highest rate with a p99 RTT of at most 'p99_us' microseconds\n");
+  fprintf(stderr, "and at most a fraction '--search-loss' of unanswered queries (default 0.001): starting at [rate], the\n");
+  fprintf(stderr, "rate is doubled until a step fails, then bisected.  Each step lasts '--search-warmup' seconds (default 2,\n");
+  fprintf(stderr, "not measured) plus '--search-step' seconds (default 10).  The capacity found is printed on stderr.\n");
+  fprintf(stderr, "Queries without an answer after '--timeout' milliseconds (default %u) are counted as lost.  Answers\n",
+	  QUERY_TIMEOUT_MSEC_DEFAULT);
+  fprintf(stderr, "that come later are logged, but not counted in histograms.  Loss, late, duplicate and mismatched\n");
+  fprintf(stderr, "answer counters are printed on stderr at exit.\n");
+  fprintf(stderr, "With option '--stats', print live statistics on stderr every 'ms' milliseconds: rates of queries, answers\n");
+  fprintf(stderr, "and bytes, queries in flight and lost, schedule lag and RTT percentiles.  With option '--stats-port',\n");
+  fprintf(stderr, "serve the same counters (totals since the start) in the Prometheus text format on\n");
+  fprintf(stderr, "http://127.0.0.1:<port>/metrics.\n");
   fprintf(stderr, "Option '-s' allows to choose a random seed (unsigned int) to determine times of transmission.  By default, the seed is set to 42\n");
 }
 
@@ -164,6 +515,8 @@ int main(int argc, char** argv)
   struct sockaddr_storage *server;
   struct timeval initial_timeout;
   struct timeval duration_timeval;
+  struct timeval start_delay = {5, 0};
+  double initial_rate;
   /* Optional stdin-based commands */
   unsigned int nb_commands;
   struct command *commands;
@@ -178,11 +531,15 @@ int main(int argc, char** argv)
   int ret;
   int opt;
   unsigned long int duration = 0, random_seed = 42;
+  unsigned long port_arg;
+  /* Whether we use a single merged-stream Poisson scheduler. */
+  short use_merged = 0;
   unsigned long int conn_id;
   unsigned int nb_poisson_processes;
   struct poisson_process *process;
   struct callback_data *callback_arg;
   char *host = NULL, *port = NULL;
+  char *rtt_log_path = NULL;
   char host_s[NI_MAXHOST];
   char port_s[NI_MAXSERV];
 
@@ -194,6 +551,19 @@ int main(int argc, char** argv)
   static struct option long_options[] = {
     {"stdin",            no_argument, NULL, 0},
     {"stdin-rateslope",  no_argument, NULL, 0},
+    {"merged",           no_argument, NULL, 0},
+    {"absolute",         no_argument, NULL, 0},
+    {"hist",             required_argument, NULL, 0},
+    {"rtt-log",          required_argument, NULL, 0},
+    {"batch",            no_argument, NULL, 0},
+    {"gso",              no_argument, NULL, 0},
+    {"search",           required_argument, NULL, 0},
+    {"search-loss",      required_argument, NULL, 0},
+    {"search-step",      required_argument, NULL, 0},
+    {"search-warmup",    required_argument, NULL, 0},
+    {"timeout",          required_argument, NULL, 0},
+    {"stats",            required_argument, NULL, 0},
+    {"stats-port",       required_argument, NULL, 0},
     {NULL,    0,         NULL, 0}
   };
   while ((opt = getopt_long(argc, argv, "p:r:c:n:vRs:t:h", long_options, &option_index)) != -1) {
@@ -205,6 +575,54 @@ int main(int argc, char** argv)
       if (option_index == 1) { /* --stdin-rateslope */
 	stdin_rateslope_commands = 1;
       }
+      if (option_index == 2) { /* --merged */
+	use_merged = 1;
+      }
+      if (option_index == 3) { /* --absolute */
+	use_absolute = 1;
+      }
+      if (option_index == 4) { /* --hist */
+	use_histogram = 1;
+	histogram_interval = strtoul(optarg, NULL, 10);
+      }
+      if (option_index == 5) { /* --rtt-log */
+	rtt_log_path = optarg;
+      }
+      if (option_index == 6) { /* --batch */
+	use_batch = 1;
+      }
+      if (option_index == 7) { /* --gso */
+	use_batch = 1;
+	use_gso = 1;
+	use_gro = 1;
+      }
+      if (option_index == 8) { /* --search */
+	search.slo_us = strtoul(optarg, NULL, 10);
+      }
+      if (option_index == 9) { /* --search-loss */
+	search.max_loss = strtod(optarg, NULL);
+      }
+      if (option_index == 10) { /* --search-step */
+	search.step_duration = strtoul(optarg, NULL, 10);
+      }
+      if (option_index == 11) { /* --search-warmup */
+	search.warmup = strtoul(optarg, NULL, 10);
+      }
+      if (option_index == 12) { /* --timeout */
+	query_timeout = strtoul(optarg, NULL, 10);
+      }
+      if (option_index == 13) { /* --stats */
+	stats_interval = strtoul(optarg, NULL, 10);
+      }
+      if (option_index == 14) { /* --stats-port */
+	port_arg = strtoul(optarg, NULL, 10);
+	if (port_arg == 0 || port_arg > 65535) {
+	  fprintf(stderr, "Error: invalid statistics port\n");
+	  usage(argv[0]);
+	  return 1;
+	}
+	stats_port = port_arg;
+      }
       break;
     case 'p': /* UDP port */
       port = optarg;
@@ -256,6 +674,38 @@ int main(int argc, char** argv)
     usage(argv[0]);
     return 1;
   }
+  if (search.slo_us > 0 && (duration != 0 || stdin_commands || stdin_rateslope_commands)) {
+    fprintf(stderr, "Error: --search is not compatible with -t, --stdin or --stdin-rateslope\n");
+    usage(argv[0]);
+    return 1;
+  }
+  if (search.slo_us > 0 && search.step_duration == 0) {
+    fprintf(stderr, "Error: search steps must last at least one second\n");
+    usage(argv[0]);
+    return 1;
+  }
+  if (search.slo_us > 0 && min_query_rate > UINT_MAX >> SEARCH_MAX_DOUBLINGS) {
+    /* The search may double the start rate SEARCH_MAX_DOUBLINGS times. */
+    fprintf(stderr, "Error: search start rate must be at most %u qps\n", UINT_MAX >> SEARCH_MAX_DOUBLINGS);
+    usage(argv[0]);
+    return 1;
+  }
+  if (query_timeout == 0) {
+    fprintf(stderr, "Error: query timeout must be positive\n");
+    usage(argv[0]);
+    return 1;
+  }
+  if (stats_interval > 0 || stats_port > 0) {
+    /* Latency percentiles come from the RTT histogram. */
+    use_stats = 1;
+    use_histogram = 1;
+  }
+  if (search.slo_us > 0) {
+    /* The search starts at [rate], and needs RTT histograms. */
+    search.start_rate = min_query_rate;
+    max_query_rate = min_query_rate << SEARCH_MAX_DOUBLINGS;
+    use_histogram = 1;
+  }
   host = argv[optind];
 
   if (stdin_commands == 1) {
@@ -280,27 +730,18 @@ int main(int argc, char** argv)
       return ret;
   }
 
-  srand48(random_seed);
+  thread_srand48(random_seed);
 
-  /* Compute maximum number of queries in flight.  Use a "safety factor"
-     of 8 to account for the worst case. */
-  double in_flight = 8 * (double) MAX_RTT_MSEC * (double) max_query_rate / (double) nb_conn / 1000.;
-  if (in_flight > 65534) {
-    max_queries_in_flight = 65535;
-  } else if (in_flight < 20) {
-    /* Use a minimum value to account for the worst case (burstiness on a
-       single UDP connection) */
-    max_queries_in_flight = 20;
-  } else {
-    max_queries_in_flight = ceil(in_flight);
-  }
-  debug("max queries in flight (per conn): %hu\n", max_queries_in_flight);
+  /* Size of the outstanding-query table of each connection */
+  query_table_size = compute_query_table_size(max_query_rate);
+  debug("Outstanding-query table size (per conn): %u\n", query_table_size);
 
   /* How many Poisson processes do we need. */
   nb_poisson_processes = POISSON_PROCESS_PERIOD_MSEC * min_query_rate / 1000;
-  debug("Will spawn %d independent Poisson processes\n", nb_poisson_processes);
+  if (!use_merged)
+    debug("Will spawn %d independent Poisson processes\n", nb_poisson_processes);
 
-  if (stdin_commands == 1) {
+  if (stdin_commands == 1 && !use_merged) {
     /* Set initial rate for each Poisson process */
     poisson_rate = (double) commands[0].query_rate / (double) nb_poisson_processes;
     info("Initial Poisson rate: %f\n", poisson_rate);
@@ -323,8 +764,14 @@ int main(int argc, char** argv)
 	    nb_conn, limit_openfiles.rlim_cur);
   }
 
-  if (print_rtt) {
-    printf("type,timestamp,connection_id,query_id,poisson_id,poisson_interval_us,rtt_us\n");
+  if (rtt_log_path != NULL) {
+    rtt_log = rttlog_open(rtt_log_path, 1);
+    if (rtt_log == NULL) {
+      return 1;
+    }
+    print_rtt = 1;
+  } else if (print_rtt) {
+    printf("type,timestamp,connection_id,query_id,poisson_id,poisson_interval_us,rtt_us,schedule_lag_us\n");
   }
 
   /* Connect to server */
@@ -398,10 +845,20 @@ int main(int argc, char** argv)
     fprintf(stderr, "Couldn't create event base\n");
     return 1;
   }
+  if (query_tracker_init(&tracker, base, query_table_size, query_timeout, NULL, NULL) != 0) {
+    fprintf(stderr, "Couldn't create query tracker\n");
+    return 1;
+  }
+  query_trackers = malloc(sizeof(struct query_tracker*));
+  query_trackers[0] = &tracker;
+  nb_query_trackers = 1;
+  histogram_init(&lag_histogram);
+  lag_histograms = malloc(sizeof(struct histogram*));
+  lag_histograms[0] = &lag_histogram;
 
   /* Connect again, but using libevent, and multiple times. */
   info("Opening %u connections to host %s port %s...\n", nb_conn, host_s, port_s);
-  connections = malloc(nb_conn * sizeof(struct udp_connection));
+  connections = calloc(nb_conn, sizeof(struct udp_connection));
   for (conn_id = 0; conn_id < nb_conn; conn_id++) {
     errno = 0;
     /* Create and connect socket */
@@ -421,16 +878,47 @@ int main(int argc, char** argv)
       fprintf(stderr, "Failed to create UDP event\n");
       break;
     }
+    if (use_gro) {
+      int on = 1;
+      if (setsockopt(sock, SOL_UDP, UDP_GRO, &on, sizeof(on)) != 0)
+	perror("Failed to enable UDP GRO");
+    }
     connections[conn_id].event = conn_event;
+    connections[conn_id].batch_count = 0;
     connections[conn_id].connection_id = conn_id;
-    connections[conn_id].query_id = 0;
-    connections[conn_id].query_timestamps = malloc(max_queries_in_flight * sizeof(struct timespec));
+    query_table_init(&connections[conn_id].queries, &tracker, conn_id);
     event_add(conn_event, NULL);
   }
   info("Opened %ld connections to host %s port %s\n", conn_id, host_s, port_s);
 
-  info("Starting %u Poisson processes generating queries...\n", nb_poisson_processes);
-  for (int i = 0; i < nb_poisson_processes; i++) {
+  if (use_batch) {
+    flush_event = event_new(base, -1, 0, flush_pending_queries, NULL);
+    recv_buf_size = use_gro ? RECV_BUFFER_SIZE_GRO : RECV_BUFFER_SIZE;
+    recv_bufs = malloc(RECV_BATCH_SIZE * recv_buf_size);
+  }
+
+  if (use_merged) {
+    /* A single process drives the aggregate rate. */
+    initial_timeout.tv_sec = 5;
+    initial_timeout.tv_usec = 0;
+    poisson_init(1);
+    merged_process = poisson_new(base);
+    callback_arg = malloc(sizeof(struct callback_data));
+    callback_arg->process = merged_process;
+    callback_arg->connections = connections;
+    poisson_set_merged(merged_process);
+    poisson_set_callback(merged_process, send_query_callback, callback_arg);
+    poisson_set_rate(merged_process, stdin_commands ? commands[0].query_rate : min_query_rate);
+    info("Starting merged-stream scheduler at %f qps...\n", merged_process->rate);
+    ret = poisson_start_process(merged_process, &initial_timeout);
+    if (ret != 0) {
+      fprintf(stderr, "Failed to start merged-stream scheduler\n");
+    }
+  } else {
+    info("Starting %u Poisson processes generating queries...\n", nb_poisson_processes);
+    poisson_init(nb_poisson_processes);
+  }
+  for (int i = 0; !use_merged && i < nb_poisson_processes; i++) {
     generate_poisson_interarrival(&initial_timeout, poisson_rate);
     /* Add 5 seconds to avoid missing query deadline even before we start
        the event loop.  Without this, the first queries all go out at the
@@ -443,19 +931,41 @@ int main(int argc, char** argv)
     callback_arg->connections = connections;
     poisson_set_callback(process, send_query_callback, callback_arg);
     poisson_set_rate(process, poisson_rate);
+    if (use_absolute)
+      poisson_set_absolute(process);
     ret = poisson_start_process(process, &initial_timeout);
     if (ret != 0) {
       fprintf(stderr, "Failed to start Poisson process %u\n", process->process_id);
     }
   }
 
+  /* Print periodic RTT summaries, starting when queries are sent. */
+  if (use_histogram) {
+    struct timeval reports_delay = {5, 0};
+    histogram_init(&rtt_histogram);
+    rtt_histograms = malloc(sizeof(struct histogram*));
+    rtt_histograms[0] = &rtt_histogram;
+    nb_rtt_histograms = 1;
+    event_base_once(base, -1, EV_TIMEOUT, start_rtt_histogram_reports, NULL, &reports_delay);
+  }
+
+  if (stdin_commands == 1)
+    init_phases(commands, nb_commands, 0, 1);
+  else if (duration > 0)
+    init_phases(NULL, 0, min_query_rate, 1);
+  /* Rate slopes change the rate of the schedulers themselves. */
+  if (stdin_rateslope_commands == 0) {
+    initial_rate = stdin_commands ? commands[0].query_rate : min_query_rate;
+    event_base_once(base, -1, EV_TIMEOUT, start_rate_control, &initial_rate, &start_delay);
+  }
+
   /* Schedule stop event. */
   if (duration > 0) {
     info("Scheduling stop event in %ld seconds.\n", duration);
     /* Account for the 5 seconds delay on all events */
     duration_timeval.tv_sec = 5 + duration;
     duration_timeval.tv_usec = 0;
-    event_base_loopexit(base, &duration_timeval);
+    event_base_once(base, -1, EV_TIMEOUT, end_of_run, NULL, &duration_timeval);
   }
 
   /* Schedule changes of query rate. */
@@ -464,11 +974,11 @@ int main(int argc, char** argv)
     /* Accounts for 5-seconds delay on all events */
     struct timeval delay_timeval = {5, 0};
     for (int i = 0; i < nb_commands; ++i) {
-      change_rate_ev = event_new(base, -1, 0, change_query_rate, &commands[i].query_rate);
+      change_rate_ev = event_new(base, -1, 0, change_query_rate, &commands[i]);
       event_add(change_rate_ev, &delay_timeval);
       timeval_add_ms(&delay_timeval, commands[i].duration_ms);
     }
-    event_base_loopexit(base, &delay_timeval);
+    event_base_once(base, -1, EV_TIMEOUT, end_of_run, NULL, &delay_timeval);
   }
 
   /* Schedule changes of query rate slope. */
@@ -485,25 +995,54 @@ int main(int argc, char** argv)
     event_base_loopexit(base, &delay_timeval);
   }
 
+  if (use_stats)
+    stats_start();
+
   info("Starting event loop\n");
   event_base_dispatch(base);
+  rate_controller_stop();
+  search_stop();
+  if (use_stats)
+    stats_stop();
+  if (use_histogram)
+    stop_rtt_histogram_reports();
+  print_query_counters(queries_sent);
+  if (send_errors > 0)
+    fprintf(stderr, "Send errors: %lu queries could not be sent\n", send_errors);
+
+  if (use_histogram) {
+    print_rtt_histogram_total();
+    free(rtt_histograms);
+  }
+  if (rtt_log != NULL) {
+    uint64_t dropped = rttlog_close(rtt_log);
+    if (dropped > 0) {
+      fprintf(stderr, "Warning: %lu records dropped from the RTT log (writer too slow)\n", dropped);
+    }
+  }
 
   /* Free all the things */
   if (stdin_commands == 1) {
     free(commands);
   }
+  free(phase_stats);
   if (stdin_rateslope_commands == 1) {
     free(rateslope_commands);
   }
+  if (use_batch) {
+    event_free(flush_event);
+    free(recv_bufs);
+  }
   for (conn_id = 0; conn_id < nb_conn; conn_id++) {
     if (connections[conn_id].event != NULL) {
       event_free(connections[conn_id].event);
     }
-    if (connections[conn_id].query_timestamps != NULL) {
-      free(connections[conn_id].query_timestamps);
-    }
+    query_table_free(&connections[conn_id].queries);
   }
   free(connections);
+  query_tracker_free(&tracker);
+  free(query_trackers);
+  free(lag_histograms);
   poisson_destroy(1);
   event_base_free(base);
   return 0;
@@ -0,0 +1,348 @@
+/* For sendmmsg() and recvmmsg() */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <event2/event.h>
+#include <event2/thread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netdb.h>
+
+#include "addrlist.h"
+#include "counters.h"
+#include "dns.h"
+
+/* Maximum number of worker threads (-T option). */
+#define MAX_THREADS 1024
+
+/* Maximum number of listening sockets per worker (listen addresses times
+   ports). */
+#define MAX_LISTENERS 65536
+
+/* Maximum number of datagrams received (and answered) with a single
+   recvmmsg() (and sendmmsg()) call. */
+#define BATCH_SIZE 64
+
+/* Large enough for any DNS query over UDP. */
+#define BUFFER_SIZE 4096
+
+/* Each worker thread runs its own event loop, with its own sockets bound
+   to the same addresses and ports (SO_REUSEPORT).  The kernel then
+   spreads incoming datagrams across all workers, by source address and
+   port. */
+struct worker {
+  unsigned int worker_id;
+  pthread_t thread;
+  struct event_base *base;
+  /* One socket (and read event) per (listen address, port) pair. */
+  struct event **events;
+  unsigned int nb_sockets;
+  /* Receive and send buffers, reused for every batch. */
+  char (*rx_buffers)[BUFFER_SIZE];
+  char (*tx_buffers)[BUFFER_SIZE];
+  /* Counters, only updated by the worker thread itself, but read by the
+     main thread every second. */
+  _Atomic uint64_t rx_packets;
+  _Atomic uint64_t tx_packets;
+  _Atomic uint64_t rx_bytes;
+  _Atomic uint64_t dropped_packets;
+};
+
+static struct worker *workers;
+static unsigned int nb_threads = 1;
+/* Whether we answer DNS queries instead of echoing datagrams back. */
+static short dns_mode = 0;
+
+/* Reads all pending datagrams on the socket, by batches, and sends the
+   corresponding replies with a single sendmmsg() per batch. */
+static void read_cb(evutil_socket_t sock, short events, void *ctx)
+{
+  struct worker *worker = ctx;
+  struct mmsghdr rx_msgs[BATCH_SIZE], tx_msgs[BATCH_SIZE];
+  struct iovec rx_iovecs[BATCH_SIZE], tx_iovecs[BATCH_SIZE];
+  struct sockaddr_storage addrs[BATCH_SIZE];
+  int nb_rx, nb_tx, sent;
+  uint64_t rx_bytes;
+  size_t len;
+
+  do {
+    for (int i = 0; i < BATCH_SIZE; i++) {
+      rx_iovecs[i].iov_base = worker->rx_buffers[i];
+      rx_iovecs[i].iov_len = BUFFER_SIZE;
+      memset(&rx_msgs[i].msg_hdr, 0, sizeof(struct msghdr));
+      rx_msgs[i].msg_hdr.msg_iov = &rx_iovecs[i];
+      rx_msgs[i].msg_hdr.msg_iovlen = 1;
+      rx_msgs[i].msg_hdr.msg_name = &addrs[i];
+      rx_msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+    }
+    nb_rx = recvmmsg(sock, rx_msgs, BATCH_SIZE, MSG_DONTWAIT, NULL);
+    if (nb_rx <= 0)
+      return;
+
+    /* Build replies, to the source address of each datagram. */
+    nb_tx = 0;
+    rx_bytes = 0;
+    for (int i = 0; i < nb_rx; i++) {
+      rx_bytes += rx_msgs[i].msg_len;
+      if (dns_mode) {
+	len = dns_make_answer(worker->rx_buffers[i], rx_msgs[i].msg_len,
+			      worker->tx_buffers[nb_tx], BUFFER_SIZE);
+	if (len == 0)
+	  continue;
+	tx_iovecs[nb_tx].iov_base = worker->tx_buffers[nb_tx];
+	tx_iovecs[nb_tx].iov_len = len;
+      } else {
+	tx_iovecs[nb_tx].iov_base = worker->rx_buffers[i];
+	tx_iovecs[nb_tx].iov_len = rx_msgs[i].msg_len;
+      }
+      memset(&tx_msgs[nb_tx].msg_hdr, 0, sizeof(struct msghdr));
+      tx_msgs[nb_tx].msg_hdr.msg_iov = &tx_iovecs[nb_tx];
+      tx_msgs[nb_tx].msg_hdr.msg_iovlen = 1;
+      tx_msgs[nb_tx].msg_hdr.msg_name = &addrs[i];
+      tx_msgs[nb_tx].msg_hdr.msg_namelen = rx_msgs[i].msg_hdr.msg_namelen;
+      nb_tx++;
+    }
+    RELAXED_ADD(worker->rx_packets, nb_rx);
+    RELAXED_ADD(worker->rx_bytes, rx_bytes);
+    RELAXED_ADD(worker->dropped_packets, nb_rx - nb_tx);
+
+    for (sent = 0; sent < nb_tx; ) {
+      int ret = sendmmsg(sock, &tx_msgs[sent], nb_tx - sent, 0);
+      if (ret == -1) {
+	if (errno != EAGAIN && errno != EWOULDBLOCK)
+	  perror("Error sending replies");
+	RELAXED_ADD(worker->dropped_packets, nb_tx - sent);
+	break;
+      }
+      sent += ret;
+    }
+    RELAXED_ADD(worker->tx_packets, sent);
+  } while (nb_rx == BATCH_SIZE);
+}
+
+static void *worker_main(void *ctx)
+{
+  struct worker *worker = ctx;
+  event_base_dispatch(worker->base);
+  return NULL;
+}
+
+/* Print the number of packets received and sent during the last
+   [interval] seconds, across all workers. */
+static void print_rates(double elapsed, double interval, uint64_t *last_rx, uint64_t *last_tx)
+{
+  uint64_t rx = 0, tx = 0;
+  for (unsigned int i = 0; i < nb_threads; i++) {
+    rx += RELAXED_LOAD(workers[i].rx_packets);
+    tx += RELAXED_LOAD(workers[i].tx_packets);
+  }
+  printf("[%.0f s] %.0f packets/s received, %.0f packets/s sent\n", elapsed,
+	 (rx - *last_rx) / interval, (tx - *last_tx) / interval);
+  fflush(stdout);
+  *last_rx = rx;
+  *last_tx = tx;
+}
+
+/* Print per-thread counters, and the merged total, to see how evenly
+   the kernel spread datagrams across workers. */
+static void print_worker_stats()
+{
+  uint64_t total_rx = 0, total_tx = 0, total_bytes = 0, total_dropped = 0;
+  for (unsigned int i = 0; i < nb_threads; i++) {
+    total_rx += workers[i].rx_packets;
+    total_tx += workers[i].tx_packets;
+    total_bytes += workers[i].rx_bytes;
+    total_dropped += workers[i].dropped_packets;
+  }
+  for (unsigned int i = 0; i < nb_threads; i++) {
+    printf("Thread %u: %lu packets received (%.1f%%), %lu sent, %lu bytes received, %lu dropped\n",
+	   i, (uint64_t) workers[i].rx_packets,
+	   total_rx == 0 ? 0. : 100. * workers[i].rx_packets / total_rx,
+	   (uint64_t) workers[i].tx_packets, (uint64_t) workers[i].rx_bytes,
+	   (uint64_t) workers[i].dropped_packets);
+  }
+  printf("Total: %lu packets received, %lu sent, %lu bytes received, %lu dropped\n",
+	 total_rx, total_tx, total_bytes, total_dropped);
+}
+
+void usage(char* progname) {
+  fprintf(stderr, "usage: %s [-h] [-d] [-T threads] [-a addr-list] [port|first_port-last_port]\n", progname);
+  fprintf(stderr, "Listens on the given UDP port or port range (default 4242) and echoes back every datagram.\n");
+  fprintf(stderr, "With option '-d', answer DNS queries with a single A record instead of echoing them\n");
+  fprintf(stderr, "(datagrams that are not DNS queries are dropped).\n");
+  fprintf(stderr, "With option '-a', listen on the given comma-separated list of addresses or CIDR blocks\n");
+  fprintf(stderr, "instead of '::'.\n");
+  fprintf(stderr, "With option '-T', run the given number of worker threads, each with its own\n");
+  fprintf(stderr, "event loop and its own SO_REUSEPORT sockets.  By default, a single thread is used.\n");
+  fprintf(stderr, "Datagrams are received and sent by batches of up to %d with recvmmsg() and sendmmsg().\n", BATCH_SIZE);
+  fprintf(stderr, "Packet rates are printed every second, and per-thread statistics are printed\n");
+  fprintf(stderr, "when the server is stopped with SIGINT or SIGTERM.\n");
+}
+
+int main(int argc, char** argv)
+{
+  struct sockaddr_storage sin;
+  socklen_t sin_len;
+  struct addrlist listen_addresses;
+  char *listen_spec = "::";
+  uint16_t first_port = 4242, last_port = 4242;
+  unsigned int nb_ports;
+  struct timespec one_second = {1, 0};
+  struct timespec start, now, last;
+  uint64_t last_rx = 0, last_tx = 0;
+  sigset_t stop_signals;
+  int on = 1;
+  int sock;
+  int ret;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "T:a:dh")) != -1) {
+    switch (opt) {
+    case 'T': /* Number of worker threads */
+      nb_threads = strtoul(optarg, NULL, 10);
+      break;
+    case 'a': /* Listen addresses */
+      listen_spec = optarg;
+      break;
+    case 'd': /* DNS mode */
+      dns_mode = 1;
+      break;
+    case 'h': /* help */
+      usage(argv[0]);
+      return 0;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  if (optind < argc) {
+    if (addrlist_parse_port_range(argv[optind], &first_port, &last_port) != 0)
+      return 1;
+  }
+  if (addrlist_parse(&listen_addresses, listen_spec) != 0) {
+    return 1;
+  }
+  nb_ports = last_port - first_port + 1;
+  if (listen_addresses.nb_addresses * nb_ports > MAX_LISTENERS) {
+    fprintf(stderr, "Too many listening sockets (at most %d addresses times ports)\n", MAX_LISTENERS);
+    return 1;
+  }
+  if (nb_threads == 0 || nb_threads > MAX_THREADS) {
+    fprintf(stderr, "Invalid number of threads (must be between 1 and %d)\n", MAX_THREADS);
+    return 1;
+  }
+
+  /* The main thread stops the workers' event loops, so event bases need
+     to be thread-safe. */
+  if (evthread_use_pthreads() != 0) {
+    fprintf(stderr, "Couldn't enable libevent thread support\n");
+    return 1;
+  }
+
+  /* Block stop signals in all threads: the main thread waits for them
+     explicitly with sigtimedwait(). */
+  sigemptyset(&stop_signals);
+  sigaddset(&stop_signals, SIGINT);
+  sigaddset(&stop_signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &stop_signals, NULL);
+
+  workers = calloc(nb_threads, sizeof(struct worker));
+  for (unsigned int i = 0; i < nb_threads; i++) {
+    workers[i].worker_id = i;
+    workers[i].base = event_base_new();
+    if (!workers[i].base) {
+      fprintf(stderr, "Couldn't open event base\n");
+      return 1;
+    }
+    workers[i].rx_buffers = malloc(BATCH_SIZE * BUFFER_SIZE);
+    workers[i].tx_buffers = malloc(BATCH_SIZE * BUFFER_SIZE);
+    workers[i].nb_sockets = listen_addresses.nb_addresses * nb_ports;
+    workers[i].events = calloc(workers[i].nb_sockets, sizeof(struct event*));
+    for (unsigned int l = 0; l < workers[i].nb_sockets; l++) {
+      sin_len = addrlist_get(&listen_addresses, l / nb_ports, first_port + l % nb_ports, &sin);
+      sock = socket(sin.ss_family, SOCK_DGRAM, 0);
+      if (sock == -1) {
+	perror("Couldn't create socket");
+	return 1;
+      }
+      /* Each worker binds its own sockets to the same addresses and ports. */
+      setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+      if (nb_threads > 1)
+	setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+      evutil_make_socket_nonblocking(sock);
+      if (bind(sock, (struct sockaddr*)&sin, sin_len) != 0) {
+	perror("Couldn't bind socket");
+	return 1;
+      }
+      workers[i].events[l] = event_new(workers[i].base, sock, EV_READ|EV_PERSIST, read_cb, &workers[i]);
+      event_add(workers[i].events[l], NULL);
+    }
+  }
+  char l_host[NI_MAXHOST];
+  if (listen_addresses.nb_addresses > 8)
+    printf("Listening on %lu addresses:\n", listen_addresses.nb_addresses);
+  for (uint64_t a = 0; a < listen_addresses.nb_addresses && a < 8; a++) {
+    sin_len = addrlist_get(&listen_addresses, a, first_port, &sin);
+    getnameinfo((struct sockaddr*)&sin, sin_len, l_host, NI_MAXHOST,
+		NULL, 0, NI_NUMERICHOST);
+    if (nb_ports == 1)
+      printf("Listening on %s UDP port %u with %u thread(s), %s mode\n", l_host, first_port,
+	     nb_threads, dns_mode ? "DNS" : "echo");
+    else
+      printf("Listening on %s UDP ports %u-%u with %u thread(s), %s mode\n", l_host, first_port,
+	     last_port, nb_threads, dns_mode ? "DNS" : "echo");
+  }
+  fflush(stdout);
+
+  for (unsigned int i = 0; i < nb_threads; i++) {
+    ret = pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]);
+    if (ret != 0) {
+      fprintf(stderr, "Failed to create worker thread: %s\n", strerror(ret));
+      return 1;
+    }
+  }
+
+  /* Print packet rates every second, until we are asked to stop. */
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  last = start;
+  while (sigtimedwait(&stop_signals, NULL, &one_second) == -1) {
+    if (errno != EAGAIN && errno != EINTR) {
+      perror("sigtimedwait");
+      break;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    print_rates(TIMESPEC_DIFF(now, start), TIMESPEC_DIFF(now, last), &last_rx, &last_tx);
+    last = now;
+  }
+  for (unsigned int i = 0; i < nb_threads; i++) {
+    event_base_loopbreak(workers[i].base);
+  }
+  for (unsigned int i = 0; i < nb_threads; i++) {
+    pthread_join(workers[i].thread, NULL);
+  }
+  print_worker_stats();
+
+  for (unsigned int i = 0; i < nb_threads; i++) {
+    for (unsigned int l = 0; l < workers[i].nb_sockets; l++) {
+      close(event_get_fd(workers[i].events[l]));
+      event_free(workers[i].events[l]);
+    }
+    free(workers[i].events);
+    free(workers[i].rx_buffers);
+    free(workers[i].tx_buffers);
+    event_base_free(workers[i].base);
+  }
+  free(workers);
+  addrlist_free(&listen_addresses);
+  return 0;
+}
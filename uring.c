@@ -0,0 +1,264 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+/* Accesses to ring indexes shared with the kernel */
+#define LOAD_ACQUIRE(_p) __atomic_load_n((_p), __ATOMIC_ACQUIRE)
+#define STORE_RELEASE(_p, _v) __atomic_store_n((_p), (_v), __ATOMIC_RELEASE)
+
+
+static int _setup(unsigned int entries, struct io_uring_params *params)
+{
+  return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int _enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags)
+{
+  return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int _register(int fd, unsigned int opcode, void *arg, unsigned int nr_args)
+{
+  return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+int uring_init(struct uring *ring, unsigned int entries, unsigned int flags)
+{
+  struct io_uring_params params;
+  void *sq_ring, *cq_ring;
+
+  memset(ring, 0, sizeof(*ring));
+  memset(&params, 0, sizeof(params));
+  params.flags = flags;
+  ring->fd = _setup(entries, &params);
+  if (ring->fd < 0)
+    return -errno;
+
+  ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+  ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  /* With IORING_FEAT_SINGLE_MMAP, both rings share the same mapping. */
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    if (ring->cq_ring_size > ring->sq_ring_size)
+      ring->sq_ring_size = ring->cq_ring_size;
+    ring->cq_ring_size = ring->sq_ring_size;
+  }
+  sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+		 MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  if (sq_ring == MAP_FAILED)
+    goto error;
+  ring->sq_ring = sq_ring;
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    cq_ring = sq_ring;
+  } else {
+    cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    if (cq_ring == MAP_FAILED)
+      goto error;
+  }
+  ring->cq_ring = cq_ring;
+  ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED)
+    goto error;
+
+  ring->sq_head = sq_ring + params.sq_off.head;
+  ring->sq_tail = sq_ring + params.sq_off.tail;
+  ring->sq_mask = *(unsigned int*)(sq_ring + params.sq_off.ring_mask);
+  ring->sq_array = sq_ring + params.sq_off.array;
+  ring->sqe_tail = *ring->sq_tail;
+  ring->cq_head = cq_ring + params.cq_off.head;
+  ring->cq_tail = cq_ring + params.cq_off.tail;
+  ring->cq_mask = *(unsigned int*)(cq_ring + params.cq_off.ring_mask);
+  ring->cqes = cq_ring + params.cq_off.cqes;
+  /* SQEs are always used in order: set up the indirection array once. */
+  for (unsigned int i = 0; i <= ring->sq_mask; i++)
+    ring->sq_array[i] = i;
+  return 0;
+
+ error:
+  {
+    int err = -errno;
+    uring_exit(ring);
+    return err;
+  }
+}
+
+void uring_exit(struct uring *ring)
+{
+  if (ring->sqes != NULL && ring->sqes != MAP_FAILED)
+    munmap(ring->sqes, ring->sqes_size);
+  if (ring->cq_ring != NULL && ring->cq_ring != ring->sq_ring)
+    munmap(ring->cq_ring, ring->cq_ring_size);
+  if (ring->sq_ring != NULL)
+    munmap(ring->sq_ring, ring->sq_ring_size);
+  if (ring->fd >= 0)
+    close(ring->fd);
+  memset(ring, 0, sizeof(*ring));
+  ring->fd = -1;
+}
+
+int uring_register_eventfd(struct uring *ring, int event_fd)
+{
+  if (_register(ring->fd, IORING_REGISTER_EVENTFD, &event_fd, 1) < 0)
+    return -errno;
+  return 0;
+}
+
+struct io_uring_sqe *uring_get_sqe(struct uring *ring)
+{
+  struct io_uring_sqe *sqe;
+  unsigned int head = LOAD_ACQUIRE(ring->sq_head);
+  if (ring->sqe_tail - head > ring->sq_mask) {
+    /* Queue full: submit what we have, without waiting. */
+    uring_submit_and_wait(ring, 0);
+    head = LOAD_ACQUIRE(ring->sq_head);
+    if (ring->sqe_tail - head > ring->sq_mask)
+      return NULL;
+  }
+  sqe = &ring->sqes[ring->sqe_tail & ring->sq_mask];
+  ring->sqe_tail++;
+  memset(sqe, 0, sizeof(*sqe));
+  return sqe;
+}
+
+unsigned int uring_sq_space(struct uring *ring)
+{
+  return ring->sq_mask + 1 - (ring->sqe_tail - LOAD_ACQUIRE(ring->sq_head));
+}
+
+int uring_submit_and_wait(struct uring *ring, unsigned int wait_nr)
+{
+  unsigned int to_submit = ring->sqe_tail - *ring->sq_tail;
+  int ret;
+  /* Publish new entries to the kernel */
+  STORE_RELEASE(ring->sq_tail, ring->sqe_tail);
+  if (to_submit == 0 && wait_nr == 0)
+    return 0;
+  do {
+    ring->nb_enter++;
+    ret = _enter(ring->fd, to_submit, wait_nr, wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0);
+  } while (ret < 0 && errno == EINTR);
+  return ret < 0 ? -errno : ret;
+}
+
+struct io_uring_cqe *uring_peek_cqe(struct uring *ring)
+{
+  unsigned int head = *ring->cq_head;
+  if (head == LOAD_ACQUIRE(ring->cq_tail))
+    return NULL;
+  return &ring->cqes[head & ring->cq_mask];
+}
+
+void uring_cqe_seen(struct uring *ring)
+{
+  STORE_RELEASE(ring->cq_head, *ring->cq_head + 1);
+}
+
+int uring_buf_ring_init(struct uring *ring, struct uring_buf_ring *br, uint16_t bgid,
+			unsigned int nb_entries, size_t buf_size)
+{
+  struct io_uring_buf_reg reg;
+  int ret;
+
+  memset(br, 0, sizeof(*br));
+  br->ring_size = nb_entries * sizeof(struct io_uring_buf);
+  br->ring = mmap(NULL, br->ring_size, PROT_READ | PROT_WRITE,
+		  MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+  if (br->ring == MAP_FAILED)
+    return -errno;
+  br->nb_entries = nb_entries;
+  br->bgid = bgid;
+  br->buf_size = buf_size;
+  br->buffers = malloc(nb_entries * buf_size);
+  if (br->buffers == NULL) {
+    munmap(br->ring, br->ring_size);
+    return -ENOMEM;
+  }
+
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uint64_t) (uintptr_t) br->ring;
+  reg.ring_entries = nb_entries;
+  reg.bgid = bgid;
+  ret = _register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1);
+  if (ret < 0) {
+    ret = -errno;
+    free(br->buffers);
+    munmap(br->ring, br->ring_size);
+    return ret;
+  }
+  br->ring->tail = 0;
+  for (unsigned int bid = 0; bid < nb_entries; bid++)
+    uring_buf_ring_recycle(br, bid);
+  return 0;
+}
+
+void uring_buf_ring_free(struct uring *ring, struct uring_buf_ring *br)
+{
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.bgid = br->bgid;
+  _register(ring->fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+  free(br->buffers);
+  munmap(br->ring, br->ring_size);
+}
+
+char *uring_buf_ring_buffer(struct uring_buf_ring *br, uint16_t bid)
+{
+  return br->buffers + (size_t) bid * br->buf_size;
+}
+
+void uring_buf_ring_recycle(struct uring_buf_ring *br, uint16_t bid)
+{
+  uint16_t tail = br->ring->tail;
+  struct io_uring_buf *buf = &br->ring->bufs[tail & (br->nb_entries - 1)];
+  buf->addr = (uint64_t) (uintptr_t) uring_buf_ring_buffer(br, bid);
+  buf->len = br->buf_size;
+  buf->bid = bid;
+  STORE_RELEASE(&br->ring->tail, tail + 1);
+}
+
+void uring_prep_multishot_accept(struct io_uring_sqe *sqe, int fd, uint64_t user_data)
+{
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = fd;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->user_data = user_data;
+}
+
+void uring_prep_multishot_recv(struct io_uring_sqe *sqe, int fd, uint16_t bgid, uint64_t user_data)
+{
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = fd;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = bgid;
+  sqe->user_data = user_data;
+}
+
+void uring_prep_send(struct io_uring_sqe *sqe, int fd, const void *buf, size_t len,
+		     int flags, uint64_t user_data)
+{
+  sqe->opcode = IORING_OP_SEND;
+  sqe->fd = fd;
+  sqe->addr = (uint64_t) (uintptr_t) buf;
+  sqe->len = len;
+  sqe->msg_flags = flags;
+  sqe->user_data = user_data;
+}
+
+void uring_prep_read(struct io_uring_sqe *sqe, int fd, void *buf, size_t len, uint64_t user_data)
+{
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = fd;
+  sqe->addr = (uint64_t) (uintptr_t) buf;
+  sqe->len = len;
+  /* Use the current file position (needed for non-seekable files) */
+  sqe->off = (uint64_t) -1;
+  sqe->user_data = user_data;
+}
@@ -0,0 +1,94 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <linux/io_uring.h>
+
+/* Minimal io_uring wrapper on top of the raw system calls, so that we do
+   not depend on liburing.  A ring is meant to be used by a single
+   thread. */
+struct uring {
+  int fd;
+  /* Submission queue, shared with the kernel */
+  unsigned int *sq_head;
+  unsigned int *sq_tail;
+  unsigned int sq_mask;
+  unsigned int *sq_array;
+  struct io_uring_sqe *sqes;
+  /* SQEs handed out by uring_get_sqe() but not submitted yet */
+  unsigned int sqe_tail;
+  /* Completion queue, shared with the kernel */
+  unsigned int *cq_head;
+  unsigned int *cq_tail;
+  unsigned int cq_mask;
+  struct io_uring_cqe *cqes;
+  /* Memory mappings */
+  void *sq_ring;
+  size_t sq_ring_size;
+  void *cq_ring;
+  size_t cq_ring_size;
+  size_t sqes_size;
+  /* Number of io_uring_enter() calls, for statistics. */
+  unsigned long nb_enter;
+};
+
+/* Ring of provided buffers (IORING_REGISTER_PBUF_RING): the kernel picks
+   a buffer from the ring for each completed receive, and the application
+   gives buffers back once it is done with them. */
+struct uring_buf_ring {
+  struct io_uring_buf_ring *ring;
+  size_t ring_size;
+  unsigned int nb_entries;
+  uint16_t bgid;
+  /* Buffer memory: nb_entries buffers of buf_size bytes. */
+  char *buffers;
+  size_t buf_size;
+};
+
+/* Creates a ring with (at least) [entries] submission entries.  Returns 0
+   on success, or a negative errno value. */
+int uring_init(struct uring *ring, unsigned int entries, unsigned int flags);
+
+void uring_exit(struct uring *ring);
+
+/* Registers an eventfd that the kernel signals whenever a completion is
+   posted, so that the ring can be watched by another event loop.
+   Returns 0 on success, or a negative errno value. */
+int uring_register_eventfd(struct uring *ring, int event_fd);
+
+/* Returns a free submission entry, cleared, submitting pending entries
+   first if the submission queue is full.  Returns NULL if it is still
+   full. */
+struct io_uring_sqe *uring_get_sqe(struct uring *ring);
+
+/* Returns the number of free submission entries. */
+unsigned int uring_sq_space(struct uring *ring);
+
+/* Submits pending entries, and waits for at least [wait_nr] completions.
+   Returns the number of submitted entries, or a negative errno value. */
+int uring_submit_and_wait(struct uring *ring, unsigned int wait_nr);
+
+/* Returns the next completion, or NULL if there is none.  Each
+   completion must be released with uring_cqe_seen(). */
+struct io_uring_cqe *uring_peek_cqe(struct uring *ring);
+
+void uring_cqe_seen(struct uring *ring);
+
+/* Registers a provided buffer ring of [nb_entries] buffers (a power of
+   two) of [buf_size] bytes each, as buffer group [bgid], and fills it
+   with all buffers.  Returns 0 on success, or a negative errno value. */
+int uring_buf_ring_init(struct uring *ring, struct uring_buf_ring *br, uint16_t bgid,
+			unsigned int nb_entries, size_t buf_size);
+
+void uring_buf_ring_free(struct uring *ring, struct uring_buf_ring *br);
+
+/* Returns the memory of buffer [bid]. */
+char *uring_buf_ring_buffer(struct uring_buf_ring *br, uint16_t bid);
+
+/* Gives buffer [bid] back to the kernel. */
+void uring_buf_ring_recycle(struct uring_buf_ring *br, uint16_t bid);
+
+/* Helpers to prepare submission entries. */
+void uring_prep_multishot_accept(struct io_uring_sqe *sqe, int fd, uint64_t user_data);
+void uring_prep_multishot_recv(struct io_uring_sqe *sqe, int fd, uint16_t bgid, uint64_t user_data);
+void uring_prep_send(struct io_uring_sqe *sqe, int fd, const void *buf, size_t len,
+		     int flags, uint64_t user_data);
+void uring_prep_read(struct io_uring_sqe *sqe, int fd, void *buf, size_t len, uint64_t user_data);
@@ -4,6 +4,8 @@
 
 #include "utils.h"
 
+/* State of the random generator of the current thread. */
+static __thread unsigned short _rand48_state[3];
 
 void subtract_timespec(struct timespec *result, const struct timespec *a, const struct timespec *b)
 {
@@ -22,6 +24,32 @@ void subtract_timespec(struct timespec *result, const struct timespec *a, const
   }
 }
 
+int compare_timespec(const struct timespec *a, const struct timespec *b)
+{
+  if (a->tv_sec != b->tv_sec)
+    return a->tv_sec < b->tv_sec ? -1 : 1;
+  if (a->tv_nsec != b->tv_nsec)
+    return a->tv_nsec < b->tv_nsec ? -1 : 1;
+  return 0;
+}
+
+void timespec_add_sec(struct timespec *a, double sec)
+{
+  long long int nsec = llrint(sec * 1000000000.);
+  a->tv_sec += nsec / 1000000000L;
+  a->tv_nsec += nsec % 1000000000L;
+  if (a->tv_nsec >= 1000000000L) {
+    a->tv_sec += 1;
+    a->tv_nsec -= 1000000000L;
+  }
+}
+
+void timespec_to_timeval(struct timeval *tv, const struct timespec *ts)
+{
+  tv->tv_sec = ts->tv_sec;
+  tv->tv_usec = ts->tv_nsec / 1000;
+}
+
 void timeval_add_ms(struct timeval *a, unsigned int ms)
 {
   a->tv_usec += ms * 1000;
@@ -40,12 +68,41 @@ void timeval_add_us(struct timeval *a, unsigned long int us)
   }
 }
 
+/* Thread-local equivalents of srand48(), drand48() and lrand48(): each
+   thread has its own generator state, so that worker threads neither
+   contend on nor interfere with each other's random sequence.  For a
+   given seed, the sequence is the same as with srand48(). */
+void thread_srand48(long int seed)
+{
+  /* Same initial state as srand48(), see its man page. */
+  _rand48_state[0] = 0x330E;
+  _rand48_state[1] = seed & 0xffff;
+  _rand48_state[2] = (seed >> 16) & 0xffff;
+}
+
+double thread_drand48()
+{
+  return erand48(_rand48_state);
+}
+
+long int thread_lrand48()
+{
+  return nrand48(_rand48_state);
+}
+
+/* Given a [rate], returns an interarrival sample (in seconds) according
+   to a Poisson process. */
+double poisson_interarrival(double rate)
+{
+  double u = thread_drand48();
+  return - log(1. - u) / rate;
+}
+
 /* Given a [rate], generate an interarrival sample according to a Poisson
    process and store it in [tv]. */
 void generate_poisson_interarrival(struct timeval* tv, double rate)
 {
-  double u = drand48();
-  double interarrival = - log(1. - u) / rate;
+  double interarrival = poisson_interarrival(rate);
   tv->tv_sec = (time_t) floor(interarrival);
   tv->tv_usec = lrint(interarrival * 1000000.) % 1000000;
 }
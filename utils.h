@@ -41,10 +41,34 @@ static inline int divide_closest(int a, int b)
 
 void subtract_timespec(struct timespec *result, const struct timespec *a, const struct timespec *b);
 
+/* Returns a negative value, zero, or a positive value if [a] is
+   respectively before, equal to, or after [b]. */
+int compare_timespec(const struct timespec *a, const struct timespec *b);
+
+/* Adds a (non-negative) number of seconds to [a]. */
+void timespec_add_sec(struct timespec *a, double sec);
+
+/* Converts a timespec to a timeval, e.g. to use it as a libevent timeout. */
+void timespec_to_timeval(struct timeval *tv, const struct timespec *ts);
+
 void timeval_add_ms(struct timeval *a, unsigned int ms);
 
 void timeval_add_us(struct timeval *a, unsigned long int us);
 
+/* Thread-local equivalents of srand48(), drand48() and lrand48(): each
+   thread has its own generator state, so that worker threads neither
+   contend on nor interfere with each other's random sequence.  For a
+   given seed, the sequence is the same as with srand48(). */
+void thread_srand48(long int seed);
+
+double thread_drand48();
+
+long int thread_lrand48();
+
+/* Given a [rate], returns an interarrival sample (in seconds) according
+   to a Poisson process. */
+double poisson_interarrival(double rate);
+
 /* Given a [rate], generate an interarrival sample according to a Poisson
    process and store it in [tv]. */
 void generate_poisson_interarrival(struct timeval* tv, double rate);